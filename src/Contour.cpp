@@ -72,6 +72,8 @@ Contour::Contour()
     scaleContour         = 1.0;
     lineWidth            = 1.5;
 
+    threadPool           = NULL;  // compute the distance field in the calling thread
+
     // graphics output
     drawBoundingRect     = false;
     drawBoundingRectLine = false;
@@ -134,6 +136,9 @@ void Contour::setup(int width, int height, float scaleFactor){
     
     // allocate FBO
     coloredDepthFbo.allocate(width, height, GL_RGBA32F);
+
+    // distance field of the silhouettes, 2 pixels per cell
+    distanceField.setup(width, height, 2.0);
     
     coloredDepthFbo.begin();
     ofClear(255,255,255, 0);
@@ -246,6 +251,11 @@ void Contour::update(float dt, ofImage &depthImage){
         contours[i] = contour;
     }
     
+    // Particles look inside the silhouettes through the distance field and
+    // find where they cross them with the segment tree
+    distanceField.update(contours, threadPool);
+    contourBVH.update(contours);
+
     for(int i = 0; i < m; i++){
         ofPolyline vMaskContour;
         vMaskContour = contourFinderVelMask.getPolyline(i);
@@ -282,6 +292,30 @@ void Contour::update(float dt, ofImage &depthImage){
     }
 }
 
+// Silhouettes given directly instead of found in the depth image, without
+// optical flow (headless runs like the benchmark). The distance field has to
+// be set up with the size of the silhouettes
+void Contour::setContours(const vector<ofPolyline>& silhouettes){
+    contours = silhouettes;
+    convexHulls = silhouettes;
+    vMaskContours = silhouettes;
+    boundingRects.resize(contours.size());
+    for(unsigned int i = 0; i < contours.size(); i++){
+        boundingRects[i] = contours[i].getBoundingBox();
+    }
+
+    distanceField.update(contours, threadPool);
+    contourBVH.update(contours);
+}
+
+void Contour::setFlowPixels(const ofFloatPixels& pixels, float scaleFactor){
+    flowPixels = pixels;
+    this->scaleFactor = scaleFactor;
+    flowWidth = pixels.getWidth();
+    flowHeight = pixels.getHeight();
+    rescaledRect.set(0, 0, flowWidth, flowHeight);
+}
+
 void Contour::draw(){
     // if is active or we are fading out
     if(isActive || isFadingOut){
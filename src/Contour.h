@@ -21,6 +21,9 @@
 #include "ofMain.h"
 #include "ofxCv.h"
 #include "ofxFlowTools.h"
+#include "DistanceField.h"
+#include "ContourBVH.h"
+#include "ThreadPool.h"
 
 using namespace flowTools;
 
@@ -30,11 +33,16 @@ class Contour{
 
         void setup(int width, int height, float scaleFactor = 4.0);
         void update(float dt, ofImage &depthImage);
+        void setContours(const vector<ofPolyline>& silhouettes);
         void draw();
 
         ofVec2f getFlowOffset(ofPoint p);
         ofVec2f getAverageFlow();
         ofVec2f getVelocityInPoint(ofPoint curPoint);
+
+        // Optical flow read by getFlowOffset, to record it and replay it without the depth images
+        ofFloatPixels& getFlowPixels() {return flowPixels;}
+        void setFlowPixels(const ofFloatPixels& pixels, float scaleFactor);
     
         ofTexture& getOpticalFlowDecay() {return opticalFlow.getOpticalFlowDecay();}
         ofTexture& getLuminanceMask() {return velocityMask.getLuminanceMask();}
@@ -105,6 +113,9 @@ class Contour{
         vector<ofPolyline> diffContours;
         vector<ofPolyline> vMaskContours;
         vector< vector<ofPoint> > velocities;
+        DistanceField distanceField;    // Inside tests and closest points of the silhouettes
+        ContourBVH contourBVH;          // Segments of the silhouettes, to find where particles cross them
+        ThreadPool* threadPool;         // Threads to compute the distance field (NULL to use the calling thread)
         //--------------------------------------------------------------
         bool drawBoundingRect;
         bool drawBoundingRectLine;
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "ContourBVH.h"
+
+#define BVH_LEAF_SIZE 4         // Maximum number of segments of a leaf
+#define BVH_MAX_DEPTH 64        // Size of the traversal stack
+
+ContourBVH::ContourBVH(){
+}
+
+void ContourBVH::update(const vector<ofPolyline>& contours){
+    // (1) segments with their normal pointing outside. Which side is outside
+    // depends on the winding of the contour, given by the sign of its area
+    segments.clear();
+    for(unsigned int i = 0; i < contours.size(); i++){
+        const vector<ofPoint>& points = contours[i].getVertices();
+        int n = points.size();
+        if(n < 3) continue;
+
+        float area = 0;
+        for(int j = 0; j < n; j++){
+            const ofPoint& p = points[j];
+            const ofPoint& q = points[(j+1) % n];
+            area += p.x*q.y - q.x*p.y;
+        }
+        float side = (area > 0) ? 1.0f : -1.0f;
+
+        for(int j = 0; j < n; j++){
+            const ofPoint& p = points[j];
+            const ofPoint& q = points[(j+1) % n];
+            ofVec2f normal(q.y - p.y, p.x - q.x);
+            float length = normal.length();
+            if(length == 0) continue;
+
+            Segment segment;
+            segment.a.set(p.x, p.y);
+            segment.b.set(q.x, q.y);
+            segment.normal = normal * (side / length);
+            segment.contour = i;
+            segments.push_back(segment);
+        }
+    }
+
+    // (2) tree over the segments
+    nodes.clear();
+    if(!segments.empty()){
+        nodes.reserve(2*segments.size()/BVH_LEAF_SIZE + 1);
+        build(0, segments.size());
+    }
+}
+
+// Node for the segments in [begin, end), split at the median of the longest
+// side of their bounding box
+int ContourBVH::build(int begin, int end){
+    int index = nodes.size();
+    nodes.push_back(Node());
+
+    float minX = segments[begin].a.x, maxX = minX;
+    float minY = segments[begin].a.y, maxY = minY;
+    for(int s = begin; s < end; s++){
+        minX = MIN(minX, MIN(segments[s].a.x, segments[s].b.x));
+        maxX = MAX(maxX, MAX(segments[s].a.x, segments[s].b.x));
+        minY = MIN(minY, MIN(segments[s].a.y, segments[s].b.y));
+        maxY = MAX(maxY, MAX(segments[s].a.y, segments[s].b.y));
+    }
+    nodes[index].minX = minX;
+    nodes[index].minY = minY;
+    nodes[index].maxX = maxX;
+    nodes[index].maxY = maxY;
+
+    if(end - begin <= BVH_LEAF_SIZE){
+        nodes[index].first = begin;
+        nodes[index].count = end - begin;
+        return index;
+    }
+
+    int middle = (begin + end) / 2;
+    if(maxX - minX > maxY - minY){
+        nth_element(segments.begin()+begin, segments.begin()+middle, segments.begin()+end, [](const Segment& s1, const Segment& s2){
+            return s1.a.x + s1.b.x < s2.a.x + s2.b.x;
+        });
+    }
+    else{
+        nth_element(segments.begin()+begin, segments.begin()+middle, segments.begin()+end, [](const Segment& s1, const Segment& s2){
+            return s1.a.y + s1.b.y < s2.a.y + s2.b.y;
+        });
+    }
+
+    build(begin, middle); // left child is the next node
+    int right = build(middle, end);
+    nodes[index].first = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+int ContourBVH::intersect(const ofPoint& a, const ofPoint& b, float* t, ofVec2f* normal) const{
+    if(nodes.empty()) return -1;
+
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    float bestT = 1.0f;
+    int best = -1;
+
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0){
+        const Node& node = nodes[stack[--top]];
+
+        // (1) skip the node if the path until the best hit misses its box
+        float pathMinX = MIN(a.x, a.x + dx*bestT), pathMaxX = MAX(a.x, a.x + dx*bestT);
+        float pathMinY = MIN(a.y, a.y + dy*bestT), pathMaxY = MAX(a.y, a.y + dy*bestT);
+        if(pathMaxX < node.minX || pathMinX > node.maxX || pathMaxY < node.minY || pathMinY > node.maxY) continue;
+
+        if(node.count == 0){
+            int left = (&node - &nodes[0]) + 1;
+            if(top + 2 > BVH_MAX_DEPTH) continue;
+            stack[top++] = node.first;
+            stack[top++] = left;
+            continue;
+        }
+
+        // (2) segments of the leaf
+        for(int s = node.first; s < node.first + node.count; s++){
+            const Segment& segment = segments[s];
+
+            // only when going in, so particles inside can get out
+            if(dx*segment.normal.x + dy*segment.normal.y >= 0) continue;
+
+            float sx = segment.b.x - segment.a.x;
+            float sy = segment.b.y - segment.a.y;
+            float denom = dx*sy - dy*sx;
+            if(denom == 0) continue; // parallel
+            float ax = segment.a.x - a.x;
+            float ay = segment.a.y - a.y;
+            float hitT = (ax*sy - ay*sx) / denom;  // along the path
+            float hitU = (ax*dy - ay*dx) / denom;  // along the segment
+            if(hitT >= 0 && hitT <= bestT && hitU >= 0 && hitU <= 1){
+                bestT = hitT;
+                best = s;
+            }
+        }
+    }
+
+    if(best == -1) return -1;
+    if(t != NULL) *t = bestT;
+    if(normal != NULL) *normal = segments[best].normal;
+    return segments[best].contour;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+
+// Bounding volume hierarchy over the segments of the contours, rebuilt once
+// per frame and shared by all the particles. Each segment keeps its normal
+// pointing out of its contour, so a particle that moved from a to b this frame
+// can find the first segment it crossed to get in, even if it went through a
+// thin part of the silhouette in a single step.
+class ContourBVH
+{
+    public:
+        ContourBVH();
+
+        void update(const vector<ofPolyline>& contours);
+
+        // First segment crossed from outside to inside on the way from a to b.
+        // Gives the fraction of the way where it happens and the normal of the
+        // segment (pointing outside). Returns the contour index or -1 if none
+        int intersect(const ofPoint& a, const ofPoint& b, float* t, ofVec2f* normal) const;
+
+        bool isEmpty() const {return segments.empty();}
+
+    protected:
+        struct Segment{
+            ofVec2f a, b;           // End points
+            ofVec2f normal;         // Normal pointing outside the contour
+            int contour;            // Contour index
+        };
+        struct Node{
+            float minX, minY;       // Bounding box of the segments below
+            float maxX, maxY;
+            int first;              // Leaf: first segment. Inner node: index of the right child (left is the next node)
+            int count;              // Number of segments of a leaf, 0 for inner nodes
+        };
+
+        int build(int begin, int end);
+        //--------------------------------------------------------------
+        vector<Segment> segments;   // Segments sorted so each leaf has a range
+        vector<Node> nodes;         // Root is the first one
+};
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#include "DepthFilter.h"
+
+#if !defined(CREA_NO_SIMD) && defined(__SSE2__)
+#define CREA_SSE2_FILTERS
+#include <emmintrin.h>
+#endif
+
+DepthFilter::DepthFilter(){
+    nearThreshold   = 255;
+    farThreshold    = 165;
+    cropLeft        = 0;
+    cropRight       = 0;
+    cropTop         = 0;
+    cropBottom      = 0;
+    numErodes       = 0;
+    numDilates      = 0;
+    blurSize        = 0;
+
+    thresholdTime   = 0.0;
+    erodeTime       = 0.0;
+    dilateTime      = 0.0;
+    blurTime        = 0.0;
+    totalTime       = 0.0;
+
+    width           = 0;
+    height          = 0;
+}
+
+void DepthFilter::setup(int width, int height){
+    this->width = width;
+    this->height = height;
+    cropLeft = 0;
+    cropRight = width;
+    cropTop = 0;
+    cropBottom = height;
+
+    mask.assign(width*height, 0);
+    rowPass.assign(width*height, 0);
+    rowSums.assign(width*height, 0);
+    columnSums.assign(width, 0);
+}
+
+void DepthFilter::update(const ofPixels& depth, ofPixels& filtered){
+    if((int)depth.getWidth() != width || (int)depth.getHeight() != height || depth.getNumChannels() != 1) return;
+    if((int)filtered.getWidth() != width || (int)filtered.getHeight() != height || filtered.getNumChannels() != 1) return;
+
+    uint64_t startTime = ofGetElapsedTimeMicros();
+    uint64_t stepStartTime = startTime;
+    auto endStep = [&](float& time){
+        uint64_t now = ofGetElapsedTimeMicros();
+        time = (now - stepStartTime) / 1000.0f;
+        stepStartTime = now;
+    };
+
+    // (1) band threshold and crop
+    threshold(depth.getData(), mask.data());
+    endStep(thresholdTime);
+
+    // (2) delete small white dots and fill the small holes
+    morphology(mask.data(), numErodes, true);
+    endStep(erodeTime);
+    morphology(mask.data(), numDilates, false);
+    endStep(dilateTime);
+
+    // (3) smooth the borders, the dilations and the blur do not go out of the crop
+    blur(mask.data(), filtered.getData(), MAX(blurSize, 0)/2);
+    endStep(blurTime);
+
+    totalTime = (ofGetElapsedTimeMicros() - startTime) / 1000.0f;
+}
+
+// White between the planes and inside the crop, black everywhere else
+void DepthFilter::threshold(const unsigned char* src, unsigned char* dst){
+    int left = ofClamp(cropLeft, 0, width);
+    int right = ofClamp(cropRight, left, width);
+    int top = ofClamp(cropTop, 0, height);
+    int bottom = ofClamp(cropBottom, top, height);
+    unsigned char low = ofClamp(farThreshold, 0, 255);
+    unsigned char high = ofClamp(nearThreshold, 0, 255);
+
+    memset(dst, 0, width*top);
+    for(int y = top; y < bottom; y++){
+        const unsigned char* s = src + y*width;
+        unsigned char* d = dst + y*width;
+        memset(d, 0, left);
+        int x = left;
+        if(low < 255){
+        #ifdef CREA_SSE2_FILTERS
+            // low < v <= high is max(v, low+1) == v and min(v, high) == v
+            __m128i lowPlusOne = _mm_set1_epi8((char)(low+1));
+            __m128i highV = _mm_set1_epi8((char)high);
+            for(; x + 16 <= right; x += 16){
+                __m128i v = _mm_loadu_si128((const __m128i*)(s + x));
+                __m128i aboveLow = _mm_cmpeq_epi8(_mm_max_epu8(v, lowPlusOne), v);
+                __m128i belowHigh = _mm_cmpeq_epi8(_mm_min_epu8(v, highV), v);
+                _mm_storeu_si128((__m128i*)(d + x), _mm_and_si128(aboveLow, belowHigh));
+            }
+        #endif
+            for(; x < right; x++) d[x] = (s[x] > low && s[x] <= high) ? 255 : 0;
+        }
+        else memset(d + left, 0, right-left);
+        memset(d + right, 0, width-right);
+    }
+    memset(dst + width*bottom, 0, width*(height-bottom));
+}
+
+// Minimum (erode) or maximum (dilate) in the square of side 2*radius+1 around
+// each pixel. Pixels out of the image do not count, as in OpenCV
+void DepthFilter::morphology(unsigned char* image, int radius, bool erode){
+    radius = MIN(radius, MIN(width, height)-1);
+    if(radius <= 0) return;
+
+    // (1) rows: image -> rowPass
+    for(int y = 0; y < height; y++){
+        const unsigned char* s = image + y*width;
+        unsigned char* d = rowPass.data() + y*width;
+        int x = 0;
+        for(; x < MIN(radius, width); x++){
+            unsigned char v = s[0];
+            for(int k = 1; k <= MIN(x+radius, width-1); k++) v = erode ? MIN(v, s[k]) : MAX(v, s[k]);
+            d[x] = v;
+        }
+    #ifdef CREA_SSE2_FILTERS
+        for(; x + 16 + radius <= width; x += 16){
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + x - radius));
+            for(int k = -radius+1; k <= radius; k++){
+                __m128i w = _mm_loadu_si128((const __m128i*)(s + x + k));
+                v = erode ? _mm_min_epu8(v, w) : _mm_max_epu8(v, w);
+            }
+            _mm_storeu_si128((__m128i*)(d + x), v);
+        }
+    #endif
+        for(; x < width; x++){
+            unsigned char v = s[x-radius];
+            for(int k = x-radius+1; k <= MIN(x+radius, width-1); k++) v = erode ? MIN(v, s[k]) : MAX(v, s[k]);
+            d[x] = v;
+        }
+    }
+
+    // (2) columns: rowPass -> image, whole rows at a time
+    for(int y = 0; y < height; y++){
+        int first = MAX(y-radius, 0);
+        int last = MIN(y+radius, height-1);
+        unsigned char* d = image + y*width;
+        memcpy(d, rowPass.data() + first*width, width);
+        for(int r = first+1; r <= last; r++){
+            const unsigned char* s = rowPass.data() + r*width;
+            int x = 0;
+        #ifdef CREA_SSE2_FILTERS
+            for(; x + 16 <= width; x += 16){
+                __m128i v = _mm_loadu_si128((const __m128i*)(d + x));
+                __m128i w = _mm_loadu_si128((const __m128i*)(s + x));
+                _mm_storeu_si128((__m128i*)(d + x), erode ? _mm_min_epu8(v, w) : _mm_max_epu8(v, w));
+            }
+        #endif
+            for(; x < width; x++) d[x] = erode ? MIN(d[x], s[x]) : MAX(d[x], s[x]);
+        }
+    }
+}
+
+// Mirror a coordinate out of [0, size) without repeating the border (OpenCV BORDER_REFLECT_101)
+static inline int reflect(int i, int size){
+    if(size == 1) return 0;
+    while(i < 0 || i >= size){
+        if(i < 0) i = -i;
+        if(i >= size) i = 2*size - 2 - i;
+    }
+    return i;
+}
+
+// Average in the square of side 2*radius+1 around each pixel, the image is
+// mirrored at the borders as in OpenCV. Only the crop is written, the rest is black
+void DepthFilter::blur(const unsigned char* src, unsigned char* dst, int radius){
+    int left = ofClamp(cropLeft, 0, width);
+    int right = ofClamp(cropRight, left, width);
+    int top = ofClamp(cropTop, 0, height);
+    int bottom = ofClamp(cropBottom, top, height);
+
+    memset(dst, 0, width*height);
+    if(radius <= 0){
+        for(int y = top; y < bottom; y++) memcpy(dst + y*width + left, src + y*width + left, right-left);
+        return;
+    }
+
+    // (1) rows: sum of the 2*radius+1 pixels around each pixel, running from
+    // left to right. Only the rows the crop needs, the mirrored ones are among them
+    radius = MIN(radius, MIN(width, height)-1);
+    for(int y = MAX(top-radius, 0); y < MIN(bottom+radius, height); y++){
+        const unsigned char* s = src + y*width;
+        uint16_t* d = rowSums.data() + y*width;
+        int sum = 0;
+        for(int k = -radius; k <= radius; k++) sum += s[reflect(k, width)];
+        d[0] = sum;
+        int x = 1;
+        for(; x <= radius && x < width; x++){
+            sum += s[reflect(x+radius, width)] - s[reflect(x-radius-1, width)];
+            d[x] = sum;
+        }
+        for(; x + radius < width; x++){
+            sum += s[x+radius] - s[x-radius-1];
+            d[x] = sum;
+        }
+        for(; x < width; x++){
+            sum += s[reflect(x+radius, width)] - s[reflect(x-radius-1, width)];
+            d[x] = sum;
+        }
+    }
+
+    // (2) columns: running sum of the row sums from top to bottom
+    int area = (2*radius+1)*(2*radius+1);
+    uint32_t* sums = columnSums.data();
+    memset(sums, 0, width*sizeof(uint32_t));
+    for(int k = -radius; k <= radius; k++){
+        const uint16_t* s = rowSums.data() + reflect(top+k, height)*width;
+        for(int x = left; x < right; x++) sums[x] += s[x];
+    }
+    for(int y = top; y < bottom; y++){
+        unsigned char* d = dst + y*width;
+        for(int x = left; x < right; x++) d[x] = (sums[x] + area/2) / area;
+        if(y+1 == bottom) break;
+        const uint16_t* added = rowSums.data() + reflect(y+1+radius, height)*width;
+        const uint16_t* removed = rowSums.data() + reflect(y-radius, height)*width;
+        for(int x = left; x < right; x++) sums[x] += added[x] - removed[x];
+    }
+}
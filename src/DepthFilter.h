@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#pragma once
+#include "ofMain.h"
+
+// Filter of the depth image of the kinect into the binary image of the
+// silhouettes: band threshold between the far and the near planes, crop,
+// erosions, dilations and blur. All the buffers are allocated in setup, so
+// filtering a frame does not allocate memory.
+//
+// The threshold and the crop are a single pass (SSE2 when available). N erosions
+// (or dilations) with a 3x3 square are the same as one with a (2N+1)x(2N+1)
+// square, which is done as a row pass and a column pass. The blur is a box
+// filter, also as a row pass and a column pass with running sums.
+class DepthFilter
+{
+    public:
+        DepthFilter();
+
+        void setup(int width, int height);
+        void update(const ofPixels& depth, ofPixels& filtered);
+
+        //--------------------------------------------------------------
+        int nearThreshold;          // Pixels brighter than this are too close
+        int farThreshold;           // Pixels up to this are too far
+        int cropLeft, cropRight;    // Columns [cropLeft, cropRight) are kept, the rest is black
+        int cropTop, cropBottom;    // Rows [cropTop, cropBottom) are kept
+        int numErodes;              // Number of erosions with a 3x3 square
+        int numDilates;             // Number of dilations with a 3x3 square
+        int blurSize;               // Size of the box blur (made odd, 1 or less does nothing)
+        //--------------------------------------------------------------
+        float thresholdTime;        // Time of each step in the last update (ms)
+        float erodeTime;
+        float dilateTime;
+        float blurTime;
+        float totalTime;
+
+    protected:
+        void threshold(const unsigned char* src, unsigned char* dst);
+        void morphology(unsigned char* image, int radius, bool erode);
+        void blur(const unsigned char* src, unsigned char* dst, int radius);
+        //--------------------------------------------------------------
+        int width;
+        int height;
+        vector<unsigned char> mask;     // Image being filtered
+        vector<unsigned char> rowPass;  // Result of the row pass of the erosions and dilations
+        vector<uint16_t> rowSums;       // Result of the row pass of the blur
+        vector<uint32_t> columnSums;    // Running sums of the column pass of the blur
+};
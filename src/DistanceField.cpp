@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "DistanceField.h"
+#include "Scanline.h"
+
+#define DIST_INF 1e20f
+
+// Squared distance transform of a line. f is 0 on the seeds and DIST_INF
+// elsewhere (or the result of a previous pass). d gets the squared distance to
+// the closest seed and arg its position, -1 if the line has no seeds. v and z
+// are the parabolas of the lower envelope and the limits between them
+static void distanceTransform(const float* f, int n, float* d, int* arg, int* v, float* z){
+    int k = -1;
+    for(int q = 0; q < n; q++){
+        if(f[q] >= DIST_INF) continue;
+        float fq = f[q] + q*q;
+        float s = 0;
+        while(k >= 0){
+            s = (fq - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+            if(s > z[k]) break;
+            k--; // parabola v[k] is hidden by the new one
+        }
+        k++;
+        v[k] = q;
+        z[k] = (k == 0) ? -DIST_INF : s;
+    }
+
+    if(k < 0){
+        for(int q = 0; q < n; q++){
+            d[q] = DIST_INF;
+            arg[q] = -1;
+        }
+        return;
+    }
+
+    z[k+1] = DIST_INF;
+    int j = 0;
+    for(int q = 0; q < n; q++){
+        while(z[j+1] < q) j++;
+        d[q] = (q - v[j])*(q - v[j]) + f[v[j]];
+        arg[q] = v[j];
+    }
+}
+
+DistanceField::DistanceField(){
+    width       = 0;
+    height      = 0;
+    cellSize    = 1;
+    cols        = 1;
+    rows        = 1;
+}
+
+void DistanceField::setup(int width, int height, float cellSize){
+    this->width = width;
+    this->height = height;
+    this->cellSize = MAX(cellSize, 1.0f);
+
+    cols = MAX((int)ceil(width/this->cellSize), 1);
+    rows = MAX((int)ceil(height/this->cellSize), 1);
+
+    insideContour.assign(cols*rows, -1);
+    closestVertex.assign(cols*rows, -1);
+    distance.assign(cols*rows, DIST_INF);
+    seedVertex.assign(cols*rows, -1);
+    columnDist.assign(cols*rows, DIST_INF);
+    columnSeed.assign(cols*rows, -1);
+}
+
+void DistanceField::update(const vector<ofPolyline>& contours, ThreadPool* threadPool){
+    // (1) put the vertices of all the contours together
+    vertices.clear();
+    normals.clear();
+    vertexContour.clear();
+    nextVertex.clear();
+    prevVertex.clear();
+    for(unsigned int i = 0; i < contours.size(); i++){
+        const vector<ofPoint>& points = contours[i].getVertices();
+        int n = points.size();
+        if(n == 0) continue;
+        int first = vertices.size();
+        bool closed = contours[i].isClosed();
+        for(int j = 0; j < n; j++){
+            int prev = (j > 0) ? j-1 : (closed ? n-1 : 0);
+            int next = (j < n-1) ? j+1 : (closed ? 0 : n-1);
+            ofVec2f tangent(points[next].x - points[prev].x, points[next].y - points[prev].y);
+            tangent.normalize();
+
+            vertices.push_back(points[j]);
+            normals.push_back(ofVec2f(-tangent.y, tangent.x));
+            vertexContour.push_back(i);
+            prevVertex.push_back(first + prev);
+            nextVertex.push_back(first + next);
+        }
+    }
+
+    if(vertices.empty()){
+        insideContour.assign(cols*rows, -1);
+        closestVertex.assign(cols*rows, -1);
+        distance.assign(cols*rows, DIST_INF);
+        return;
+    }
+
+    // (2) cells inside each contour
+    insideContour.assign(cols*rows, -1);
+    for(unsigned int i = 0; i < contours.size(); i++){
+        if(contours[i].size() > 2) fillInside(contours[i], i);
+    }
+
+    // (3) seed the cells the contours go through with their vertices
+    seedVertex.assign(cols*rows, -1);
+    for(unsigned int v = 0; v < vertices.size(); v++){
+        seedSegment(vertices[v], vertices[nextVertex[v]], v);
+    }
+
+    // (4) distance transform, first the columns and then the rows. Every
+    // column (and then every row) is independent of the others
+    int maxLength = MAX(cols, rows);
+    function<void(int, int)> transformColumns = [&](int begin, int end){
+        vector<float> f(maxLength), d(maxLength), z(maxLength+1);
+        vector<int> arg(maxLength), v(maxLength);
+        for(int x = begin; x < end; x++){
+            for(int y = 0; y < rows; y++) f[y] = (seedVertex[y*cols + x] != -1) ? 0 : DIST_INF;
+            distanceTransform(f.data(), rows, d.data(), arg.data(), v.data(), z.data());
+            for(int y = 0; y < rows; y++){
+                columnDist[y*cols + x] = d[y];
+                columnSeed[y*cols + x] = arg[y];
+            }
+        }
+    };
+    function<void(int, int)> transformRows = [&](int begin, int end){
+        vector<float> d(maxLength), z(maxLength+1);
+        vector<int> arg(maxLength), v(maxLength);
+        for(int y = begin; y < end; y++){
+            int row = y*cols;
+            distanceTransform(&columnDist[row], cols, d.data(), arg.data(), v.data(), z.data());
+            for(int x = 0; x < cols; x++){
+                int c = row + x;
+                if(arg[x] == -1){
+                    closestVertex[c] = -1;
+                    distance[c] = DIST_INF;
+                    continue;
+                }
+                // the closest seed is in column arg[x], at the row found for that column
+                int seedRow = columnSeed[row + arg[x]];
+                closestVertex[c] = seedVertex[seedRow*cols + arg[x]];
+                float dist = sqrt(d[x]) * cellSize;
+                distance[c] = (insideContour[c] != -1) ? -dist : dist;
+            }
+        }
+    };
+
+    if(threadPool != NULL){
+        threadPool->parallelFor(cols, transformColumns, 8);
+        threadPool->parallelFor(rows, transformRows, 8);
+    }
+    else{
+        transformColumns(0, cols);
+        transformRows(0, rows);
+    }
+}
+
+// Even-odd scanline fill of the cells whose center is inside the contour
+void DistanceField::fillInside(const ofPolyline& contour, int contourIdx){
+    forEachScanlineSpan(contour, cellSize, 0, rows-1, crossings, [&](int r, float x0, float x1){
+        int firstCol = MAX((int)ceil(x0/cellSize - 0.5f), 0);
+        int lastCol = MIN((int)ceil(x1/cellSize - 0.5f) - 1, cols-1);
+        for(int c = firstCol; c <= lastCol; c++) insideContour[r*cols + c] = contourIdx;
+    });
+}
+
+// Mark the cells under the segment a-b with its first vertex
+void DistanceField::seedSegment(const ofPoint& a, const ofPoint& b, int vertex){
+    float length = a.distance(b);
+    int steps = MAX((int)ceil(length / (cellSize*0.5f)), 1);
+    for(int s = 0; s <= steps; s++){
+        float t = (float)s/steps;
+        float x = a.x + (b.x - a.x) * t;
+        float y = a.y + (b.y - a.y) * t;
+        if(x < 0 || y < 0 || x >= cols*cellSize || y >= rows*cellSize) continue;
+        int c = (int)(y/cellSize)*cols + (int)(x/cellSize);
+        if(seedVertex[c] == -1) seedVertex[c] = vertex;
+    }
+}
+
+int DistanceField::getCell(const ofPoint& pos) const{
+    // clamp before converting to int so far away points do not overflow
+    int cx = (int)ofClamp(floor(pos.x/cellSize), 0, cols-1);
+    int cy = (int)ofClamp(floor(pos.y/cellSize), 0, rows-1);
+    return cy*cols + cx;
+}
+
+int DistanceField::getInside(const ofPoint& pos) const{
+    if(pos.x < 0 || pos.y < 0 || pos.x >= cols*cellSize || pos.y >= rows*cellSize) return -1;
+    return insideContour[getCell(pos)];
+}
+
+float DistanceField::getSignedDistance(const ofPoint& pos) const{
+    return distance[getCell(pos)];
+}
+
+int DistanceField::getClosestPoint(const ofPoint& pos, bool onlyInside, ofPoint* closestPoint, ofVec2f* normal) const{
+    if(vertices.empty()) return -1;
+    if(onlyInside && getInside(pos) == -1) return -1;
+
+    int v = closestVertex[getCell(pos)];
+    if(v == -1) return -1;
+
+    // (1) the field gives the closest vertex to the cell, project the point
+    // on the segments at both sides of it to get the exact closest point
+    ofPoint best = vertices[v];
+    float bestDistSqrd = pos.squareDistance(best);
+    int ends[2] = {prevVertex[v], nextVertex[v]};
+    for(int k = 0; k < 2; k++){
+        const ofPoint& a = vertices[v];
+        const ofPoint& b = vertices[ends[k]];
+        float dx = b.x - a.x;
+        float dy = b.y - a.y;
+        float lengthSqrd = dx*dx + dy*dy;
+        if(lengthSqrd == 0) continue;
+        float t = ofClamp(((pos.x - a.x)*dx + (pos.y - a.y)*dy) / lengthSqrd, 0, 1);
+        ofPoint candidate(a.x + dx*t, a.y + dy*t);
+        float distSqrd = pos.squareDistance(candidate);
+        if(distSqrd < bestDistSqrd){
+            bestDistSqrd = distSqrd;
+            best = candidate;
+        }
+    }
+
+    // (2) results
+    if(closestPoint != NULL) *closestPoint = best;
+    if(normal != NULL) *normal = normals[v];
+    return vertexContour[v];
+}
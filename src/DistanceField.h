@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include "ThreadPool.h"
+
+// Signed distance field of the silhouettes, rebuilt once per frame from the
+// contours. Every cell knows which contour it is inside of and which contour
+// vertex is the closest one, so asking if a point is inside a silhouette, for
+// its closest point or for the normal to bounce on are single lookups instead
+// of loops over all the vertices.
+//
+// The distances come from the linear time Euclidean distance transform of
+// Felzenszwalb and Huttenlocher, done by columns and then by rows.
+class DistanceField
+{
+    public:
+        DistanceField();
+
+        void setup(int width, int height, float cellSize = 2.0);
+        void update(const vector<ofPolyline>& contours, ThreadPool* threadPool = NULL);
+
+        // Index of the contour that contains the point (-1 if none)
+        int getInside(const ofPoint& pos) const;
+
+        // Distance to the closest contour, negative inside
+        float getSignedDistance(const ofPoint& pos) const;
+
+        // Closest point of the contours and normal of the contour there. Returns
+        // the index of its contour, or -1 if there is no contour (or if onlyInside
+        // and the point is outside all of them)
+        int getClosestPoint(const ofPoint& pos, bool onlyInside, ofPoint* closestPoint, ofVec2f* normal = NULL) const;
+
+        bool isEmpty() const {return vertices.empty();}
+        //--------------------------------------------------------------
+        int width;                  // Field boundaries
+        int height;
+        float cellSize;             // Size of the cells
+        int cols;                   // Number of cells in x
+        int rows;                   // Number of cells in y
+
+    protected:
+        int getCell(const ofPoint& pos) const;
+        void fillInside(const ofPolyline& contour, int contourIdx);
+        void seedSegment(const ofPoint& a, const ofPoint& b, int vertex);
+        //--------------------------------------------------------------
+        vector<int> insideContour;  // Contour that contains each cell (-1 if none)
+        vector<int> closestVertex;  // Closest vertex to each cell (-1 if there are no contours)
+        vector<float> distance;     // Signed distance of each cell to the closest vertex
+        //--------------------------------------------------------------
+        vector<ofPoint> vertices;   // Vertices of all the contours, one after the other
+        vector<ofVec2f> normals;    // Normal of the contour at each vertex
+        vector<int> vertexContour;  // Contour of each vertex
+        vector<int> nextVertex;     // Next vertex of the same contour
+        vector<int> prevVertex;     // Previous vertex of the same contour
+        //--------------------------------------------------------------
+        vector<int> seedVertex;     // Vertex that lies on each cell (-1 if none)
+        vector<float> columnDist;   // Squared distance to the closest seed of the same column
+        vector<int> columnSeed;     // Row of the closest seed of the same column
+        vector< pair<int, float> > crossings; // Rows and x where a contour crosses the cell centers
+};
@@ -373,6 +373,14 @@ ofVec2f Fluid::getFluidOffset(ofPoint p){
     return offset;
 }
 
+void Fluid::setFluidVelocities(const ofFloatPixels& velocities, float scaleFactor){
+    fluidVelocities = velocities;
+    this->scaleFactor = scaleFactor;
+    flowWidth = velocities.getWidth();
+    flowHeight = velocities.getHeight();
+    rescaledRect.set(0, 0, flowWidth, flowHeight);
+}
+
 void Fluid::reset(){
     fluid.reset();
 }
@@ -33,6 +33,10 @@ class Fluid{
         void draw();
     
         ofVec2f getFluidOffset(ofPoint p);
+
+        // Velocities read by getFluidOffset, to record them and replay them without simulating
+        ofFloatPixels& getFluidVelocities() {return fluidVelocities;}
+        void setFluidVelocities(const ofFloatPixels& velocities, float scaleFactor);
     
         void reset();
         void resetDrawForces();
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "FrameGovernor.h"
+
+static const char* particleModeNames[] = {"Emitter", "Boids", "Grid", "Random", "Animations"};
+
+FrameGovernor::FrameGovernor(){
+    isActive            = true;         // Change the load of the particle systems?
+    frameBudget         = 13.0;         // Target time of a frame (ms), some margin under 60 fps
+    minLoadScale        = 0.2;          // Minimum load of a particle system
+
+    overBudget          = 1.0;          // Decrease over the budget
+    underBudget         = 0.75;         // Increase under 75% of the budget
+    framesToDecrease    = 10;           // Decrease fast
+    framesToIncrease    = 90;           // Increase slowly
+    decreaseFactor      = 0.85;
+    increaseFactor      = 1.1;
+
+    smoothedFrameTime   = 0.0;
+    framesOver          = 0;
+    framesUnder         = 0;
+}
+
+void FrameGovernor::update(float frameTime, vector<ParticleSystem *>& systems){
+    // (1) average the frame time so a single slow frame does not count
+    smoothedFrameTime = (smoothedFrameTime == 0) ? frameTime : smoothedFrameTime*0.9 + frameTime*0.1;
+    if(!isActive) return;
+
+    if(smoothedFrameTime > frameBudget*overBudget){
+        framesOver++;
+        framesUnder = 0;
+    }
+    else if(smoothedFrameTime < frameBudget*underBudget){
+        framesUnder++;
+        framesOver = 0;
+    }
+    else{ // inside the band, keep the load as it is
+        framesOver = 0;
+        framesUnder = 0;
+    }
+
+    // (2) too slow: reduce the system that costs the most
+    if(framesOver >= framesToDecrease){
+        framesOver = 0;
+        ParticleSystem* heaviest = NULL;
+        for(unsigned int i = 0; i < systems.size(); i++){
+            ParticleSystem* ps = systems[i];
+            if(!ps->isActive || ps->loadScale <= minLoadScale || !ps->canReduceLoad()) continue;
+            if(heaviest == NULL || ps->updateTime + ps->drawTime > heaviest->updateTime + heaviest->drawTime) heaviest = ps;
+        }
+        if(heaviest != NULL){
+            heaviest->loadScale = MAX(heaviest->loadScale*decreaseFactor, minLoadScale);
+            lastDecision = string(particleModeNames[heaviest->particleMode]) + " load " + ofToString(heaviest->loadScale*100, 0) + "%"
+                         + " (frame " + ofToString(smoothedFrameTime, 1) + " ms, update " + ofToString(heaviest->updateTime, 1)
+                         + " ms, draw " + ofToString(heaviest->drawTime, 1) + " ms)";
+            ofLogNotice("FrameGovernor") << lastDecision;
+        }
+        else if(lastDecision != "Nothing to reduce"){ // said once, not every time it is still over
+            lastDecision = "Nothing to reduce";
+            ofLogWarning("FrameGovernor") << lastDecision << " (frame " << ofToString(smoothedFrameTime, 1) << " ms)";
+        }
+    }
+
+    // (3) time left: give load back to the most reduced system
+    if(framesUnder >= framesToIncrease){
+        framesUnder = 0;
+        ParticleSystem* lightest = NULL;
+        for(unsigned int i = 0; i < systems.size(); i++){
+            ParticleSystem* ps = systems[i];
+            if(ps->loadScale >= 1.0) continue;
+            if(lightest == NULL || ps->loadScale < lightest->loadScale) lightest = ps;
+        }
+        if(lightest != NULL){
+            lightest->loadScale = MIN(lightest->loadScale*increaseFactor, 1.0f);
+            lastDecision = string(particleModeNames[lightest->particleMode]) + " load " + ofToString(lightest->loadScale*100, 0) + "%"
+                         + " (frame " + ofToString(smoothedFrameTime, 1) + " ms)";
+            ofLogNotice("FrameGovernor") << lastDecision;
+        }
+    }
+}
+
+// All the systems back to full load
+void FrameGovernor::reset(vector<ParticleSystem *>& systems){
+    for(unsigned int i = 0; i < systems.size(); i++) systems[i]->loadScale = 1.0;
+    framesOver = 0;
+    framesUnder = 0;
+    lastDecision = "";
+}
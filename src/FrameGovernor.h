@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include "ParticleSystem.h"
+
+// Keeps the frame time inside a budget by changing the load of the particle
+// systems. When the frames are too slow for a while, the system that costs
+// the most gets a lower loadScale (less particles born, smaller pool and
+// smaller interaction radii). Systems that loadScale can't change, like a grid
+// without flocking, repulsion or connections, are left out, and a warning says
+// when there is nothing left to reduce. When there is time left for a longer
+// while, the most reduced system gets some load back. The two thresholds and
+// the number of frames to wait (hysteresis) keep it from changing every frame.
+//
+// Every decision is sent to ofLog and the last one is kept in lastDecision.
+class FrameGovernor
+{
+    public:
+        FrameGovernor();
+
+        // frameTime is the time spent in update and draw in the last frame (ms)
+        void update(float frameTime, vector<ParticleSystem *>& systems);
+        void reset(vector<ParticleSystem *>& systems);
+
+        //--------------------------------------------------------------
+        bool isActive;              // Change the load of the particle systems?
+        float frameBudget;          // Target time of a frame (ms)
+        float minLoadScale;         // Minimum load of a particle system
+        //--------------------------------------------------------------
+        float overBudget;           // Above frameBudget*overBudget the load goes down
+        float underBudget;          // Below frameBudget*underBudget the load goes up
+        int framesToDecrease;       // Frames over budget to decrease the load
+        int framesToIncrease;       // Frames under budget to increase the load
+        float decreaseFactor;       // Load multiplied by this when decreasing
+        float increaseFactor;       // Load multiplied by this when increasing
+        //--------------------------------------------------------------
+        float smoothedFrameTime;    // Average of the last frame times (ms)
+        string lastDecision;        // Description of the last change
+
+    protected:
+        int framesOver;             // Consecutive frames over budget
+        int framesUnder;            // Consecutive frames under budget
+};
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#include "MarkerDetector.h"
+
+#if !defined(CREA_NO_SIMD) && defined(__SSE2__)
+#define CREA_SSE2_FILTERS
+#include <emmintrin.h>
+#endif
+
+#define TILE_SIZE 16    // Side of the tiles that are skipped when they are dark (pixels)
+
+MarkerDetector::MarkerDetector(){
+    threshold       = 70;
+    cropLeft        = 0;
+    cropRight       = 0;
+    cropTop         = 0;
+    cropBottom      = 0;
+    mergeDistance   = 12;
+    minRadius       = 2.0;
+    maxRadius       = 80.0;
+
+    detectTime      = 0.0;
+
+    width           = 0;
+    height          = 0;
+    tilesX          = 0;
+    tilesY          = 0;
+    numActiveTiles  = 0;
+}
+
+void MarkerDetector::setup(int width, int height){
+    this->width = width;
+    this->height = height;
+    cropLeft = 0;
+    cropRight = width;
+    cropTop = 0;
+    cropBottom = height;
+
+    tilesX = (width + TILE_SIZE-1) / TILE_SIZE;
+    tilesY = (height + TILE_SIZE-1) / TILE_SIZE;
+    activeTiles.assign(tilesX*tilesY, 0);
+    labels.assign(width*height, 0);
+    blobs.reserve(256);
+    roots.reserve(256);
+}
+
+void MarkerDetector::update(const ofPixels& ir, ofPixels& mask){
+    if((int)ir.getWidth() != width || (int)ir.getHeight() != height || ir.getNumChannels() != 1) return;
+    if((int)mask.getWidth() != width || (int)mask.getHeight() != height || mask.getNumChannels() != 1) return;
+
+    uint64_t startTime = ofGetElapsedTimeMicros();
+
+    int left = ofClamp(cropLeft, 0, width);
+    int right = ofClamp(cropRight, left, width);
+    int top = ofClamp(cropTop, 0, height);
+    int bottom = ofClamp(cropBottom, top, height);
+
+    // (1) tiles with something bright
+    findActiveTiles(ir.getData(), left, right, top, bottom);
+
+    // (2) label the blobs in those tiles and merge the close ones
+    memset(mask.getData(), 0, width*height);
+    label(ir.getData(), mask.getData(), left, right, top, bottom);
+    mergeBlobs();
+
+    // (3) markers from the blobs of the right size
+    centroids.clear();
+    areas.clear();
+    boundingRects.clear();
+    for(unsigned int i = 0; i < roots.size(); i++){
+        const Blob& blob = blobs[roots[i]];
+        float radius = sqrt(blob.area / PI);
+        if(radius < minRadius || radius > maxRadius) continue;
+        // centroid of the pixel centers, as the center of a bounding box
+        centroids.push_back(cv::Point2f(blob.weightedX/blob.weight + 0.5, blob.weightedY/blob.weight + 0.5));
+        areas.push_back(blob.area);
+        boundingRects.push_back(cv::Rect(blob.minX, blob.minY, blob.maxX-blob.minX+1, blob.maxY-blob.minY+1));
+    }
+
+    detectTime = (ofGetElapsedTimeMicros() - startTime) / 1000.0f;
+}
+
+// A tile is active when some pixel of it inside the crop is above the threshold
+void MarkerDetector::findActiveTiles(const unsigned char* src, int left, int right, int top, int bottom){
+    unsigned char limit = ofClamp(threshold, 0, 255);
+    numActiveTiles = 0;
+    for(int ty = 0; ty < tilesY; ty++){
+        int y0 = MAX(ty*TILE_SIZE, top);
+        int y1 = MIN((ty+1)*TILE_SIZE, bottom);
+        for(int tx = 0; tx < tilesX; tx++){
+            int x0 = MAX(tx*TILE_SIZE, left);
+            int x1 = MIN((tx+1)*TILE_SIZE, right);
+            bool active = false;
+            if(x0 < x1 && y0 < y1 && limit < 255){
+            #ifdef CREA_SSE2_FILTERS
+                if(x1 - x0 == 16){
+                    __m128i maxV = _mm_setzero_si128();
+                    for(int y = y0; y < y1; y++) maxV = _mm_max_epu8(maxV, _mm_loadu_si128((const __m128i*)(src + y*width + x0)));
+                    // some byte above the limit when max(v, limit) is not limit
+                    __m128i limitV = _mm_set1_epi8((char)limit);
+                    active = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(maxV, limitV), limitV)) != 0xFFFF;
+                }
+                else
+            #endif
+                {
+                    unsigned char maxValue = 0;
+                    for(int y = y0; y < y1; y++){
+                        const unsigned char* s = src + y*width;
+                        for(int x = x0; x < x1; x++) maxValue = MAX(maxValue, s[x]);
+                    }
+                    active = maxValue > limit;
+                }
+            }
+            activeTiles[ty*tilesX + tx] = active;
+            if(active) numActiveTiles++;
+        }
+    }
+}
+
+// Single pass in raster order over the active tiles. A pixel takes the label
+// of its neighbors already visited (left, up-left, up and up-right), joining
+// their labels when they are different, or a new label. The neighbors in the
+// tiles that are not active are always dark
+void MarkerDetector::label(const unsigned char* src, unsigned char* dst, int left, int right, int top, int bottom){
+    unsigned char limit = ofClamp(threshold, 0, 255);
+    blobs.clear();
+    if(numActiveTiles == 0) return;
+
+    for(int y = top; y < bottom; y++){
+        const unsigned char* row = src + y*width;
+        const unsigned char* up = (y > top) ? row - width : NULL;
+        const unsigned char* tiles = &activeTiles[(y/TILE_SIZE)*tilesX];
+        for(int tx = 0; tx < tilesX; tx++){
+            if(!tiles[tx]) continue;
+            int x0 = MAX(tx*TILE_SIZE, left);
+            int x1 = MIN((tx+1)*TILE_SIZE, right);
+            for(int x = x0; x < x1; x++){
+                if(row[x] <= limit) continue;
+                int i = y*width + x;
+                int l = -1;
+                if(x > left && row[x-1] > limit) l = labels[i-1];
+                if(up != NULL){
+                    for(int nx = MAX(x-1, left); nx <= MIN(x+1, right-1); nx++){
+                        if(up[nx] <= limit) continue;
+                        int n = labels[i - width + nx - x];
+                        if(l < 0) l = n;
+                        else if(n != l) join(l, n);
+                    }
+                }
+                if(l < 0){
+                    l = blobs.size();
+                    Blob blob = {l, 0, 0.0, 0.0, 0.0, x, y, x, y};
+                    blobs.push_back(blob);
+                }
+                labels[i] = l;
+                dst[i] = 255;
+
+                Blob& blob = blobs[l];
+                float w = row[x] - limit;
+                blob.area++;
+                blob.weight += w;
+                blob.weightedX += w*x;
+                blob.weightedY += w*y;
+                blob.minX = MIN(blob.minX, x);
+                blob.maxX = MAX(blob.maxX, x);
+                blob.minY = MIN(blob.minY, y);
+                blob.maxY = MAX(blob.maxY, y);
+            }
+        }
+    }
+}
+
+// Adds the statistics of the joined labels to their roots, then joins the
+// blobs whose bounding boxes are separated by mergeDistance pixels or less
+void MarkerDetector::mergeBlobs(){
+    roots.clear();
+    for(unsigned int i = 0; i < blobs.size(); i++){
+        int root = findRoot(i);
+        if(root == (int)i) roots.push_back(i);
+        else addStatistics(blobs[root], blobs[i]);
+    }
+    if(mergeDistance <= 0 || roots.size() < 2) return;
+
+    // (1) sweep the blobs from left to right, only the next few can be close
+    sort(roots.begin(), roots.end(), [this](int a, int b){ return blobs[a].minX < blobs[b].minX; });
+    for(unsigned int i = 0; i < roots.size(); i++){
+        const Blob& a = blobs[roots[i]];
+        for(unsigned int j = i+1; j < roots.size(); j++){
+            const Blob& b = blobs[roots[j]];
+            if(b.minX - a.maxX - 1 > mergeDistance) break;
+            int gapY = MAX(b.minY - a.maxY, a.minY - b.maxY) - 1;
+            if(gapY <= mergeDistance) join(roots[i], roots[j]);
+        }
+    }
+
+    // (2) add the statistics of the merged blobs as before
+    unsigned int numRoots = 0;
+    for(unsigned int i = 0; i < roots.size(); i++){
+        int root = findRoot(roots[i]);
+        if(root != roots[i]) addStatistics(blobs[root], blobs[roots[i]]);
+    }
+    for(unsigned int i = 0; i < roots.size(); i++){
+        if(blobs[roots[i]].parent == roots[i]) roots[numRoots++] = roots[i];
+    }
+    roots.resize(numRoots);
+}
+
+int MarkerDetector::findRoot(int i){
+    while(blobs[i].parent != i){
+        blobs[i].parent = blobs[blobs[i].parent].parent;
+        i = blobs[i].parent;
+    }
+    return i;
+}
+
+// The label with the highest number becomes part of the other one
+void MarkerDetector::join(int a, int b){
+    a = findRoot(a);
+    b = findRoot(b);
+    if(a < b) blobs[b].parent = a;
+    else if(b < a) blobs[a].parent = b;
+}
+
+void MarkerDetector::addStatistics(Blob& root, const Blob& blob){
+    root.area += blob.area;
+    root.weight += blob.weight;
+    root.weightedX += blob.weightedX;
+    root.weightedY += blob.weightedY;
+    root.minX = MIN(root.minX, blob.minX);
+    root.maxX = MAX(root.maxX, blob.maxX);
+    root.minY = MIN(root.minY, blob.minY);
+    root.maxY = MAX(root.maxY, blob.maxY);
+}
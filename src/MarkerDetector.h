@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#pragma once
+#include "ofMain.h"
+#include "ofxCv.h"
+
+// Detector of the IR markers: the blobs brighter than a threshold in the IR
+// image of the kinect, with their centroid and area. The IR image is black
+// almost everywhere, so the image is divided in tiles of 16x16 pixels and only
+// the tiles with some pixel above the threshold are looked at.
+//
+// The blobs are labeled in a single pass over the pixels of those tiles
+// (8-connected, with union-find), adding up the statistics of each label on
+// the way. The centroid of a blob is the average of its pixel positions
+// weighted by how much brighter than the threshold they are, which moves
+// smoothly with the marker instead of jumping pixel by pixel.
+//
+// Pieces of the same marker that are separated by a few dark pixels are
+// merged into one blob, and blobs too small (noise) or too big are dropped.
+class MarkerDetector
+{
+    public:
+        MarkerDetector();
+
+        void setup(int width, int height);
+        void update(const ofPixels& ir, ofPixels& mask);
+
+        const vector<cv::Point2f>& getCentroids() const { return centroids; }
+        const vector<float>& getAreas() const { return areas; }
+        const vector<cv::Rect>& getBoundingRects() const { return boundingRects; }
+        int getNumActiveTiles() const { return numActiveTiles; }
+        int getNumTiles() const { return tilesX*tilesY; }
+
+        //--------------------------------------------------------------
+        int threshold;              // Pixels brighter than this are part of a marker
+        int cropLeft, cropRight;    // Columns [cropLeft, cropRight) are looked at
+        int cropTop, cropBottom;    // Rows [cropTop, cropBottom) are looked at
+        int mergeDistance;          // Blobs closer than this (pixels) are the same marker
+        float minRadius;            // Blobs with the area of a circle smaller than this are dropped
+        float maxRadius;            // Blobs with the area of a circle bigger than this are dropped
+        //--------------------------------------------------------------
+        float detectTime;           // Time of the last update (ms)
+
+    protected:
+        struct Blob{
+            int parent;             // Label of the blob it is part of (itself if it is a root)
+            int area;               // Number of pixels
+            double weight;          // Sum of the brightness over the threshold
+            double weightedX;       // Sum of x times the brightness over the threshold
+            double weightedY;
+            int minX, minY, maxX, maxY;
+        };
+
+        void findActiveTiles(const unsigned char* src, int left, int right, int top, int bottom);
+        void label(const unsigned char* src, unsigned char* dst, int left, int right, int top, int bottom);
+        void mergeBlobs();
+        int findRoot(int i);
+        void join(int a, int b);
+        void addStatistics(Blob& root, const Blob& blob);
+        //--------------------------------------------------------------
+        int width;
+        int height;
+        int tilesX, tilesY;
+        int numActiveTiles;
+        vector<unsigned char> activeTiles;  // Tiles with some pixel above the threshold
+        vector<int> labels;                 // Label of each pixel (only valid in the blobs)
+        vector<Blob> blobs;                 // Statistics of each label
+        vector<int> roots;                  // Labels of the blobs that are not part of another
+        //--------------------------------------------------------------
+        vector<cv::Point2f> centroids;      // Markers found in the last update
+        vector<float> areas;
+        vector<cv::Rect> boundingRects;
+};
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "NeighborGrid.h"
+
+// Limit the number of cells so a tiny radius does not make clearing the grid
+// more expensive than the particles themselves
+#define MAX_GRID_CELLS 65536
+
+NeighborGrid::NeighborGrid(){
+    width       = 0;
+    height      = 0;
+    cellSize    = 1;
+    cols        = 1;
+    rows        = 1;
+}
+
+void NeighborGrid::setup(int width, int height){
+    this->width = width;
+    this->height = height;
+}
+
+void NeighborGrid::update(const vector<float>& x, const vector<float>& y, int n, float cellSize){
+    // Resize grid if the cell size has changed
+    float minCellSize = sqrt((float)width*height/MAX_GRID_CELLS);
+    cellSize = MAX(cellSize, MAX(minCellSize, 1.0f));
+    if(cellSize != this->cellSize || cellStart.empty()){
+        this->cellSize = cellSize;
+        cols = MAX((int)ceil(width/cellSize), 1);
+        rows = MAX((int)ceil(height/cellSize), 1);
+    }
+
+    int numCells = cols*rows;
+
+    // (1) count particles per cell
+    cellStart.assign(numCells+1, 0);
+    particleCell.resize(n);
+    for(int i = 0; i < n; i++){
+        int c = getCellY(y[i])*cols + getCellX(x[i]);
+        particleCell[i] = c;
+        cellStart[c+1]++;
+    }
+
+    // (2) prefix sum so cellStart[c] is the first slot of cell c
+    for(int c = 0; c < numCells; c++){
+        cellStart[c+1] += cellStart[c];
+    }
+
+    // (3) scatter particle indices into their cell slots
+    cellCursor.assign(cellStart.begin(), cellStart.end()-1);
+    cellParticles.resize(n);
+    for(int i = 0; i < n; i++){
+        cellParticles[cellCursor[particleCell[i]]++] = i;
+    }
+}
+
+int NeighborGrid::getCellX(float x) const{
+    // clamp before converting to int so far away particles do not overflow
+    return (int)ofClamp(floor(x/cellSize), 0, cols-1);
+}
+
+int NeighborGrid::getCellY(float y) const{
+    return (int)ofClamp(floor(y/cellSize), 0, rows-1);
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+
+// Uniform grid (cell list) over the particle positions. It is rebuilt from
+// scratch every frame with a counting sort: particle indices end up grouped
+// by cell in 'cellParticles' and the particles of cell c are the ones in
+// [cellStart[c], cellStart[c+1]). Positions outside the boundaries are
+// clamped to the border cells.
+class NeighborGrid
+{
+    public:
+        NeighborGrid();
+
+        void setup(int width, int height);
+        void update(const vector<float>& x, const vector<float>& y, int n, float cellSize);
+
+        // Call f(i, j) once for every pair of particles in the same or in
+        // adjacent cells. With cellSize >= interaction radius this visits
+        // every pair closer than the radius.
+        template<typename F> void forEachPair(F f) const;
+
+        // Call f(j) for every particle j != i in the cell of particle i and
+        // the 8 around it. Visits each pair twice (once from each side) but
+        // only touches particle i, so different particles can run in parallel.
+        template<typename F> void forEachNeighbor(int i, F f) const;
+
+        // Call f(j) for every particle j in the cells that overlap the square
+        // of side 2*radius centered at (x, y). f still has to check the distance.
+        template<typename F> void forEachInSquare(float x, float y, float radius, F f) const;
+
+        int getCellX(float x) const;
+        int getCellY(float y) const;
+        int getNumCells() const {return cols*rows;}
+        //--------------------------------------------------------------
+        int width;                  // Grid boundaries
+        int height;
+        //--------------------------------------------------------------
+        float cellSize;             // Size of the cells
+        int cols;                   // Number of cells in x
+        int rows;                   // Number of cells in y
+        //--------------------------------------------------------------
+        vector<int> cellStart;      // First position in cellParticles of each cell
+        vector<int> cellParticles;  // Particle indices sorted by cell
+        vector<int> particleCell;   // Cell of each particle
+
+    protected:
+        vector<int> cellCursor;
+};
+
+template<typename F> void NeighborGrid::forEachPair(F f) const{
+    for(int cy = 0; cy < rows; cy++){
+        for(int cx = 0; cx < cols; cx++){
+            int c = cy*cols + cx;
+            int end = cellStart[c+1];
+            for(int a = cellStart[c]; a < end; a++){
+                int i = cellParticles[a];
+
+                // same cell, only the particles after this one
+                for(int b = a+1; b < end; b++) f(i, cellParticles[b]);
+
+                // half of the neighbor cells so each pair is visited once
+                if(cx+1 < cols){
+                    int n = c+1;
+                    for(int b = cellStart[n]; b < cellStart[n+1]; b++) f(i, cellParticles[b]);
+                }
+                if(cy+1 < rows){
+                    int first = MAX(cx-1, 0);
+                    int last = MIN(cx+1, cols-1);
+                    // cells of the next row are consecutive, so it is a single range
+                    int n0 = c + cols - cx + first;
+                    int n1 = c + cols - cx + last;
+                    for(int b = cellStart[n0]; b < cellStart[n1+1]; b++) f(i, cellParticles[b]);
+                }
+            }
+        }
+    }
+}
+
+template<typename F> void NeighborGrid::forEachNeighbor(int i, F f) const{
+    int c = particleCell[i];
+    int cx = c % cols;
+    int cy = c / cols;
+    int first = MAX(cx-1, 0);
+    int last = MIN(cx+1, cols-1);
+    for(int ny = MAX(cy-1, 0); ny <= MIN(cy+1, rows-1); ny++){
+        // cells of a row are consecutive, so it is a single range
+        int n0 = ny*cols + first;
+        int n1 = ny*cols + last;
+        for(int b = cellStart[n0]; b < cellStart[n1+1]; b++){
+            int j = cellParticles[b];
+            if(j != i) f(j);
+        }
+    }
+}
+
+template<typename F> void NeighborGrid::forEachInSquare(float x, float y, float radius, F f) const{
+    int first = getCellX(x - radius);
+    int last = getCellX(x + radius);
+    for(int ny = getCellY(y - radius); ny <= getCellY(y + radius); ny++){
+        // cells of a row are consecutive, so it is a single range
+        int n0 = ny*cols + first;
+        int n1 = ny*cols + last;
+        for(int b = cellStart[n0]; b < cellStart[n1+1]; b++) f(cellParticles[b]);
+    }
+}
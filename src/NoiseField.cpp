@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "NoiseField.h"
+
+NoiseField::NoiseField(){
+    cols        = 1;
+    rows        = 1;
+    numLayers   = 1;
+    cellWidth   = 1;
+    cellHeight  = 1;
+    values.assign(1, 0);
+}
+
+void NoiseField::setup(int width, int height, float cellWidth, float cellHeight, int numLayers){
+    this->cellWidth = MAX(cellWidth, 1.0f);
+    this->cellHeight = MAX(cellHeight, 1.0f);
+    this->numLayers = MAX(numLayers, 1);
+
+    // one node more than cells so the nodes cover the whole area
+    cols = (int)ceil(width/this->cellWidth) + 1;
+    rows = (int)ceil(height/this->cellHeight) + 1;
+    values.assign(cols*rows*this->numLayers, 0);
+}
+
+float NoiseField::sample(float x, float y, int layer) const{
+    // (1) position in cells, clamped to the field
+    float gx = ofClamp(x/cellWidth, 0, cols-1);
+    float gy = ofClamp(y/cellHeight, 0, rows-1);
+    int c0 = MIN((int)gx, MAX(cols-2, 0));
+    int r0 = MIN((int)gy, MAX(rows-2, 0));
+    int c1 = MIN(c0+1, cols-1);
+    int r1 = MIN(r0+1, rows-1);
+    float tx = gx - c0;
+    float ty = gy - r0;
+
+    // (2) bilinear interpolation of the four nodes around
+    const float* v = &values[layer*rows*cols];
+    float top = v[r0*cols + c0] + (v[r0*cols + c1] - v[r0*cols + c0]) * tx;
+    float bottom = v[r1*cols + c0] + (v[r1*cols + c1] - v[r1*cols + c0]) * tx;
+    return top + (bottom - top) * ty;
+}
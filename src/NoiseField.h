@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include "ThreadPool.h"
+
+// Scalar noise evaluated once per frame on a coarse grid and sampled by the
+// particles with bilinear interpolation, so the noise cost depends on the
+// grid resolution and not on the number of particles.
+//
+// The field can have several layers of the same noise with a different offset.
+// Particles pick a layer with their seed, so close particles do not all move
+// the same way. A cell as wide (or high) as the field makes it 1D.
+class NoiseField
+{
+    public:
+        NoiseField();
+
+        void setup(int width, int height, float cellWidth, float cellHeight, int numLayers = 1);
+
+        // Evaluate noise(x, y, layer) at every node of the grid
+        template<typename F> void update(F noise, ThreadPool* threadPool = NULL);
+
+        float sample(float x, float y, int layer = 0) const;
+        int getNumLayers() const {return numLayers;}
+        //--------------------------------------------------------------
+        int cols;               // Number of nodes in x
+        int rows;               // Number of nodes in y
+        int numLayers;          // Number of layers
+        float cellWidth;        // Distance between nodes
+        float cellHeight;
+
+    protected:
+        vector<float> values;   // Noise at the nodes, layer by layer and row by row
+};
+
+template<typename F> void NoiseField::update(F noise, ThreadPool* threadPool){
+    float* values = this->values.data();
+    int cols = this->cols;
+    int rows = this->rows;
+    float cellWidth = this->cellWidth;
+    float cellHeight = this->cellHeight;
+
+    // each row of each layer is a job
+    function<void(int, int)> fillRows = [=](int begin, int end){
+        for(int r = begin; r < end; r++){
+            int layer = r / rows;
+            float y = (r % rows) * cellHeight;
+            float* row = values + r*cols;
+            for(int c = 0; c < cols; c++){
+                row[c] = noise(c * cellWidth, y, layer);
+            }
+        }
+    };
+
+    if(threadPool != NULL) threadPool->parallelFor(rows*numLayers, fillRows, 4);
+    else fillRows(0, rows*numLayers);
+}
@@ -11,410 +11,1035 @@
  * This program is distributed in the hope that it will be useful, but WITHOUT
  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
  * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
- * details.     
+ * details.
  *
  * You should have received a copy of the Affero GNU General Public License
  * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
  */
 
 #include "Particle.h"
+#include "ParticleKernels.h"
 
-Particle::Particle(){
-    isAlive         = true;
+#define MAX_CIRCLE_RESOLUTION 22
 
-    opacity         = 255;
-
-    isTouched       = false;
-
-    immortal        = false;
+ParticleParams::ParticleParams(){
+    friction        = 1.0;
+    limitSpeed      = false;
+    maxSpeed        = 120.0;
+    sizeAge         = false;
 
     bounces         = false;
     bounceTop       = true;
     steers          = false;
     infiniteWalls   = false;
+    bounceDamping   = true;
+    damping         = 0.6;
 
-    sizeAge         = false;
+    flockingRadiusSqrd  = 0;
+    lowThresh           = 0;
+    highThresh          = 0;
+    separationStrength  = 0;
+    alignmentStrength   = 0;
+    attractionStrength  = 0;
+
+    width           = ofGetWidth();
+    height          = ofGetHeight();
+
+    randomKey       = 0;
+}
+
+ParticleDrawParams::ParticleDrawParams(){
+    color           = ofColor(255);
+    opacity         = 255;
     opacityAge      = false;
-    colorAge        = false;
     flickersAge     = false;
+    colorAge        = false;
     isEmpty         = false;
     drawLine        = false;
     drawStroke      = false;
     strokeWidth     = 1.2;
+    interpolation   = 1.0;
+}
 
-    limitSpeed      = false;
-    maxSpeed        = 120.0;
-    bounceDamping   = true;
-    damping         = 0.6;
+Particles::Particles(){
+    numParticles    = 0;
+    capacity        = 0;
+    layoutVersion   = 0;
+    trailLength     = 0;
+}
 
-    age             = 0;
+void Particles::setup(int width, int height){
+    params.width = width;
+    params.height = height;
+}
 
-    width           = ofGetWidth();
-    height          = ofGetHeight();
+// Grow the pool keeping the living particles. Only place where memory is allocated
+void Particles::reserve(int capacity){
+    if(capacity <= this->capacity) return;
+
+    x.resize(capacity);             y.resize(capacity);
+    prevX.resize(capacity);         prevY.resize(capacity);
+    iniX.resize(capacity);          iniY.resize(capacity);
+    vx.resize(capacity);            vy.resize(capacity);
+    fx.resize(capacity);            fy.resize(capacity);
+    seed.resize(capacity);          age.resize(capacity);
+    mass.resize(capacity);          lifetime.resize(capacity);
+    initialRadius.resize(capacity); radius.resize(capacity);
+    hue.resize(capacity);
+    immortal.resize(capacity);      isAlive.resize(capacity);
+    isTouched.resize(capacity);     isAsleep.resize(capacity);
+    slot.resize(capacity);
+
+    // Slots of the particles keep their number so the handles stay valid,
+    // new slots go to the bottom of the free stack so lower slots are used first
+    int oldCapacity = this->capacity;
+    slotGeneration.resize(capacity, 1);
+    slotIndex.resize(capacity, -1);
+    freeSlots.insert(freeSlots.begin(), capacity-oldCapacity, 0);
+    for(int s = oldCapacity; s < capacity; s++){
+        freeSlots[capacity-1-s] = s;
+    }
+    trailX.resize((size_t)capacity*trailLength);
+    trailY.resize((size_t)capacity*trailLength);
+    trailHead.resize(capacity, 0);
+    trailCount.resize(capacity, 0);
+
+    this->capacity = capacity;
 }
 
-void Particle::setup(float id, ofPoint pos, ofPoint vel, ofColor color, float initialRadius, float lifetime){
-    this->id = id;
-    this->pos = pos;
-    this->vel = vel;
-    this->color = color;
-    this->initialRadius = initialRadius;
-    this->lifetime = lifetime;
-
-    this->radius = initialRadius;
-    this->mass = initialRadius * initialRadius * 0.005f;
-    this->prevPos = pos;
-    this->iniPos = pos;
-    this->originalHue = color.getHue();
-}
-
-void Particle::update(float dt){
-    if(isAlive){
-        // Update position
-        acc = frc/mass;     // Newton's second law F = m*a
-        vel += acc*dt;      // Euler's method
-        vel *= friction;    // Decay velocity
-        if(limitSpeed) limitVelocity();
-        pos += vel*dt;
-        frc.set(0, 0);      // Restart force
-
-        // Update age and check if particle has to die
-        age += dt;
-        if(!immortal && age >= lifetime) isAlive = false;
-        else if(immortal) age = fmodf(age, lifetime);
+// Change the positions kept for each trail. The trails start again empty and
+// their memory is released when there are no trails
+void Particles::setTrailLength(int length){
+    length = ofClamp(length, 0, 65535);
+    if(length == trailLength) return;
+    trailLength = length;
+    vector<float>((size_t)capacity*trailLength).swap(trailX);
+    vector<float>((size_t)capacity*trailLength).swap(trailY);
+    fill(trailHead.begin(), trailHead.end(), 0);
+    fill(trailCount.begin(), trailCount.end(), 0);
+}
 
-        // Decrease particle radius with age
-        if (sizeAge) radius = initialRadius * (1.0f - (age/lifetime));
-
-        // Decrease particle opacity with age
-        if (opacityAge) opacity *= (1.0f - (age/lifetime));
-        if (flickersAge){
-//            opacity *= (1.0f - (age/lifetime)*0.4);
-            if((age/lifetime) > 0.75 && ofRandomf() > (1.4 - age/lifetime))
-                opacity *= 0.5;
+ParticleHandle Particles::add(ofPoint pos, ofPoint vel, ofColor color, float initialRadius, float lifetime){
+    if(numParticles >= capacity || freeSlots.empty()) return INVALID_PARTICLE_HANDLE; // pool is full
+
+    int i = numParticles++;
+    layoutVersion++;
+
+    unsigned int s = freeSlots.back();
+    freeSlots.pop_back();
+    slot[i] = s;
+    slotIndex[s] = i;
+    trailHead[s] = 0;
+    trailCount[s] = 0;
+    ParticleHandle handle = getHandle(i);
+
+    x[i] = pos.x;                   y[i] = pos.y;
+    prevX[i] = pos.x;               prevY[i] = pos.y;
+    iniX[i] = pos.x;                iniY[i] = pos.y;
+    vx[i] = vel.x;                  vy[i] = vel.y;
+    fx[i] = 0;                      fy[i] = 0;
+
+    // hash the handle to get a noise seed that is different for each particle
+    seed[i] = (float)((handle * 2654435761ULL >> 16) % 100000);
+    age[i] = 0;
+    mass[i] = initialRadius * initialRadius * 0.005f;
+    this->lifetime[i] = lifetime;
+    this->initialRadius[i] = initialRadius;
+    radius[i] = initialRadius;
+    hue[i] = color.getHue();
+
+    immortal[i] = false;
+    isAlive[i] = true;
+    isTouched[i] = false;
+    isAsleep[i] = false;
+
+    return handle;
+}
+
+// Remove the dead particles moving the last particle into their place
+void Particles::removeDead(){
+    int i = 0;
+    while(i < numParticles){
+        if(isAlive[i]){
+            i++;
+            continue;
         }
 
-        // Change particle color with age
-        if (colorAge){
-            color.setBrightness(ofMap(age, 0, lifetime, 255, 180));
-            color.setHue(ofMap(age, 0, lifetime, originalHue, originalHue-100));
+        // invalidate the handles to this particle and free its slot
+        unsigned int s = slot[i];
+        slotGeneration[s]++;
+        if(slotGeneration[s] == 0) slotGeneration[s] = 1; // 0 is never a valid generation
+        slotIndex[s] = -1;
+        freeSlots.push_back(s);
+
+        int last = --numParticles;
+        if(i != last) move(last, i);
+        layoutVersion++;
+    }
+}
+
+void Particles::clear(){
+    for(int i = 0; i < numParticles; i++) isAlive[i] = false;
+    removeDead();
+}
+
+// Living particles and their handle slots, so the handles of a restored pool
+// are the same as when it was saved. Reads into an empty pool
+void Particles::transfer(SnapshotArchive& archive){
+    int32_t n = numParticles;
+    int32_t poolCapacity = capacity;
+    archive.transfer(n);
+    archive.transfer(poolCapacity);
+    if(archive.isReading()){
+        // the slots of all the pool have to be there, check it before allocating
+        if(!archive.isValid() || capacity != 0 || n < 0 || n > poolCapacity
+           || !archive.hasBytes((size_t)poolCapacity*2*sizeof(unsigned int))){
+            archive.setInvalid();
+            return;
         }
+        reserve(poolCapacity);
+        numParticles = n;
+        layoutVersion++;
+    }
 
-        // hackish way to make particles glitter when they slow down a lot
-//        if(vel.lengthSquared() < 5.0) {
-//            vel.x = ofRandom(-10, 10);
-//            vel.y = ofRandom(-10, 10);
-//        }
+    archive.transfer(x, n);             archive.transfer(y, n);
+    archive.transfer(prevX, n);         archive.transfer(prevY, n);
+    archive.transfer(iniX, n);          archive.transfer(iniY, n);
+    archive.transfer(vx, n);            archive.transfer(vy, n);
+    archive.transfer(fx, n);            archive.transfer(fy, n);
+    archive.transfer(seed, n);          archive.transfer(age, n);
+    archive.transfer(mass, n);          archive.transfer(lifetime, n);
+    archive.transfer(initialRadius, n); archive.transfer(radius, n);
+    archive.transfer(hue, n);
+    archive.transfer(immortal, n);      archive.transfer(isAlive, n);
+    archive.transfer(isTouched, n);     archive.transfer(isAsleep, n);
 
-        // Bounce particle with the window margins
-        if(bounces){
-            marginsBounce();
+    archive.transfer(slot, n);
+    archive.transfer(slotGeneration, poolCapacity);
+    archive.transfer(slotIndex, poolCapacity);
+    archive.transfer(freeSlots);
+
+    // the slots index the arrays, broken ones would write out of them later
+    if(archive.isReading() && archive.isValid() && !hasValidSlots()) archive.setInvalid();
+}
+
+// Every particle is alive and owns a different slot, and the free slots are
+// exactly the ones no particle owns
+bool Particles::hasValidSlots() const{
+    vector<unsigned char> used(capacity, false);
+    for(int i = 0; i < numParticles; i++){
+        if(!isAlive[i]) return false;
+        unsigned int s = slot[i];
+        if(s >= (unsigned int)capacity || slotIndex[s] != i) return false;
+        used[s] = true;
+    }
+    if(freeSlots.size() != (size_t)(capacity - numParticles)) return false;
+    for(size_t k = 0; k < freeSlots.size(); k++){
+        unsigned int s = freeSlots[k];
+        if(s >= (unsigned int)capacity || used[s]) return false;
+        used[s] = true; // a free slot can't be there twice either
+    }
+    for(int s = 0; s < capacity; s++){
+        int i = slotIndex[s];
+        if(i != -1 && (i < 0 || i >= numParticles || slot[i] != (unsigned int)s)) return false;
+    }
+    return true;
+}
+
+// Interleave the bits of x and y (16 bits each), so close cells get close keys
+static inline uint32_t mortonCode(uint32_t x, uint32_t y){
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    y = (y | (y << 8)) & 0x00FF00FF;
+    y = (y | (y << 4)) & 0x0F0F0F0F;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+    return x | (y << 1);
+}
+
+void Particles::computeMortonKeys(float cellSize){
+    mortonKeys.resize(numParticles);
+    float invCellSize = 1.0f/cellSize;
+    for(int i = 0; i < numParticles; i++){
+        uint32_t cx = (uint32_t)ofClamp(x[i]*invCellSize, 0, 65535);
+        uint32_t cy = (uint32_t)ofClamp(y[i]*invCellSize, 0, 65535);
+        mortonKeys[i] = mortonCode(cx, cy);
+    }
+}
+
+// Fraction of consecutive particles that go backwards in the Z-order. It is 0
+// right after sortByMorton and about 0.5 when the order is random
+float Particles::getMortonDisorder(float cellSize){
+    if(numParticles < 2) return 0;
+    computeMortonKeys(cellSize);
+    int backwards = 0;
+    for(int i = 1; i < numParticles; i++){
+        if(mortonKeys[i] < mortonKeys[i-1]) backwards++;
+    }
+    return (float)backwards/(numParticles-1);
+}
+
+// Move the particles in memory so they follow the Z-order of cells of
+// cellSize, so the particles that are close in space are close in the arrays.
+// Stable radix sort of the keys, 8 bits per pass, the passes where all the keys
+// have the same digit are skipped. The trails stay in their slots and the
+// handles keep pointing to their particles. False if they were already sorted
+// and nothing moved
+bool Particles::sortByMorton(float cellSize){
+    int n = numParticles;
+    if(n < 2) return false;
+    computeMortonKeys(cellSize);
+    bool isSorted = true;
+    for(int i = 1; i < n && isSorted; i++) isSorted = mortonKeys[i] >= mortonKeys[i-1];
+    if(isSorted) return false;
+
+    // (1) sort the keys and where they come from
+    mortonOrder.resize(n);
+    sortedKeys.resize(n);
+    sortedOrder.resize(n);
+    for(int i = 0; i < n; i++) mortonOrder[i] = i;
+    for(int shift = 0; shift < 32; shift += 8){
+        int count[257] = {0};
+        for(int i = 0; i < n; i++) count[((mortonKeys[i] >> shift) & 0xFF) + 1]++;
+        if(count[((mortonKeys[0] >> shift) & 0xFF) + 1] == n) continue; // same digit for all
+        for(int d = 0; d < 256; d++) count[d+1] += count[d];
+        for(int i = 0; i < n; i++){
+            int k = count[(mortonKeys[i] >> shift) & 0xFF]++;
+            sortedKeys[k] = mortonKeys[i];
+            sortedOrder[k] = mortonOrder[i];
         }
-        else if(steers){
-            marginsSteer();
+        mortonKeys.swap(sortedKeys);
+        mortonOrder.swap(sortedOrder);
+    }
+
+    // (2) move every array, one at a time so only one scratch array is needed
+    permute(x, scratchFloats);              permute(y, scratchFloats);
+    permute(prevX, scratchFloats);          permute(prevY, scratchFloats);
+    permute(iniX, scratchFloats);           permute(iniY, scratchFloats);
+    permute(vx, scratchFloats);             permute(vy, scratchFloats);
+    permute(fx, scratchFloats);             permute(fy, scratchFloats);
+    permute(seed, scratchFloats);           permute(age, scratchFloats);
+    permute(mass, scratchFloats);           permute(lifetime, scratchFloats);
+    permute(initialRadius, scratchFloats);  permute(radius, scratchFloats);
+    permute(hue, scratchFloats);
+    permute(immortal, scratchBytes);        permute(isAlive, scratchBytes);
+    permute(isTouched, scratchBytes);       permute(isAsleep, scratchBytes);
+    permute(slot, scratchSlots);
+    for(int i = 0; i < n; i++) slotIndex[slot[i]] = i;
+
+    layoutVersion++;
+    return true;
+}
+
+// values[i] = old values[mortonOrder[i]]. The arrays are swapped, so the
+// scratch keeps the capacity of the pool and nothing is allocated next time
+template<typename T> void Particles::permute(vector<T>& values, vector<T>& scratch){
+    scratch.resize(values.size());
+    for(int i = 0; i < numParticles; i++) scratch[i] = values[mortonOrder[i]];
+    values.swap(scratch);
+}
+
+ParticleHandle Particles::getHandle(int i) const{
+    unsigned int s = slot[i];
+    return ((ParticleHandle)slotGeneration[s] << 32) | s;
+}
+
+float Particles::random(int i, ParticleRandom use, float min, float max) const{
+    return RandomStream::hashUniform(params.randomKey + use, getHandle(i), min, max);
+}
+
+int Particles::getIndex(ParticleHandle handle) const{
+    unsigned int s = (unsigned int)(handle & 0xFFFFFFFF);
+    unsigned int generation = (unsigned int)(handle >> 32);
+    if(s >= (unsigned int)capacity || slotGeneration[s] != generation) return -1;
+    return slotIndex[s];
+}
+
+void Particles::move(int from, int to){
+    x[to] = x[from];                        y[to] = y[from];
+    prevX[to] = prevX[from];                prevY[to] = prevY[from];
+    iniX[to] = iniX[from];                  iniY[to] = iniY[from];
+    vx[to] = vx[from];                      vy[to] = vy[from];
+    fx[to] = fx[from];                      fy[to] = fy[from];
+    seed[to] = seed[from];                  age[to] = age[from];
+    mass[to] = mass[from];                  lifetime[to] = lifetime[from];
+    initialRadius[to] = initialRadius[from];radius[to] = radius[from];
+    hue[to] = hue[from];
+    immortal[to] = immortal[from];          isAlive[to] = isAlive[from];
+    isTouched[to] = isTouched[from];        isAsleep[to] = isAsleep[from];
+
+    slot[to] = slot[from];
+    slotIndex[slot[to]] = to;
+}
+
+void Particles::update(int begin, int end, float dt){
+    // Keep where the particles were to know what they crossed
+    copy(x.begin()+begin, x.begin()+end, prevX.begin()+begin);
+    copy(y.begin()+begin, y.begin()+end, prevY.begin()+begin);
+
+    // Update position, velocity and age of all the particles with the SIMD kernel
+    ParticleKernels::get().integrate(*this, begin, end, dt);
+
+    // Age and margins with the kernel compiled for the behaviors of this frame
+    static const vector<UpdateKernel> updateKernels = getUpdateKernels();
+    unsigned int flags = 0;
+    if(params.sizeAge) flags |= UPDATE_SIZE_AGE;
+    if(params.bounces) flags |= UPDATE_BOUNCE;
+    else if(params.steers) flags |= UPDATE_STEER;
+    else if(params.infiniteWalls) flags |= UPDATE_WRAP;
+    (this->*updateKernels[flags])(begin, end);
+
+    // Add where the particles were to their trail, overwriting the oldest position
+    if(trailLength > 0){
+        for(int i = begin; i < end; i++){
+            if(!isAlive[i]) continue;
+            unsigned int s = slot[i];
+            size_t k = (size_t)s*trailLength + trailHead[s];
+            trailX[k] = prevX[i];
+            trailY[k] = prevY[i];
+            trailHead[s] = (trailHead[s] + 1) % trailLength;
+            if(trailCount[s] < trailLength) trailCount[s]++;
         }
-        else if(infiniteWalls){
-            marginsWrap();
+    }
+}
+
+// The behaviors are template flags, so each combination is a loop without the
+// branches of the others
+template<unsigned int flags> void Particles::updateAgeAndMargins(int begin, int end){
+    for(int i = begin; i < end; i++){
+        if(!isAlive[i]) continue;
+
+        // Check if particle has to die
+        if(!immortal[i] && age[i] >= lifetime[i]) isAlive[i] = false;
+        else if(immortal[i]) age[i] = fmodf(age[i], lifetime[i]);
+
+        // Decrease particle radius with age
+        if(flags & UPDATE_SIZE_AGE){
+            float agePct = age[i]/lifetime[i];
+            radius[i] = initialRadius[i] * (1.0f - agePct);
         }
+
+        // Bounce particle with the window margins
+        if(flags & UPDATE_BOUNCE) marginsBounce(i);
+        if(flags & UPDATE_STEER) marginsSteer(i);
+        if(flags & UPDATE_WRAP) marginsWrap(i);
     }
 }
 
-void Particle::draw(){
-    if(isAlive){
-        ofPushStyle();
-        ofSetColor(color, opacity);
+// Table with the kernel of every combination of flags, the flags are the index
+template<unsigned int flags> void Particles::addUpdateKernels(vector<UpdateKernel>& kernels){
+    addUpdateKernels<flags-1>(kernels);
+    kernels.push_back(&Particles::updateAgeAndMargins<flags>);
+}
+
+template<> void Particles::addUpdateKernels<0>(vector<UpdateKernel>& kernels){
+    kernels.push_back(&Particles::updateAgeAndMargins<0>);
+}
+
+vector<Particles::UpdateKernel> Particles::getUpdateKernels(){
+    vector<UpdateKernel> kernels;
+    addUpdateKernels<NUM_UPDATE_KERNELS-1>(kernels);
+    return kernels;
+}
 
-        if(isEmpty){
-            ofNoFill();
-            ofSetLineWidth(2);
+// Points of a circle of radius 1 for each resolution, so the sin and cos are
+// computed once and not for every particle
+static const vector<ofVec2f>& getCirclePoints(int resolution){
+    static vector< vector<ofVec2f> > circles(MAX_CIRCLE_RESOLUTION+1);
+    vector<ofVec2f>& circle = circles[resolution];
+    if(circle.empty()){
+        for(int k = 0; k < resolution; k++){
+            float angle = TWO_PI * k / resolution;
+            circle.push_back(ofVec2f(cos(angle), sin(angle)));
         }
-        else{
-            ofFill();
+    }
+    return circle;
+}
+
+static void addDisc(ofMesh& mesh, float x, float y, float radius, int resolution, const ofFloatColor& color){
+    vector<ofVec3f>& vertices = mesh.getVertices();
+    vector<ofFloatColor>& colors = mesh.getColors();
+    vector<ofIndexType>& indices = mesh.getIndices();
+    const vector<ofVec2f>& circle = getCirclePoints(resolution);
+
+    ofIndexType center = vertices.size();
+    vertices.push_back(ofVec3f(x, y));
+    colors.push_back(color);
+    for(int k = 0; k < resolution; k++){
+        vertices.push_back(ofVec3f(x + circle[k].x*radius, y + circle[k].y*radius));
+        colors.push_back(color);
+        indices.push_back(center);
+        indices.push_back(center + 1 + k);
+        indices.push_back(center + 1 + (k+1)%resolution);
+    }
+}
+
+static void addRing(ofMesh& mesh, float x, float y, float radius, float width, int resolution, const ofFloatColor& color){
+    vector<ofVec3f>& vertices = mesh.getVertices();
+    vector<ofFloatColor>& colors = mesh.getColors();
+    vector<ofIndexType>& indices = mesh.getIndices();
+    const vector<ofVec2f>& circle = getCirclePoints(resolution);
+
+    float inner = MAX(radius - width*0.5f, 0.0f);
+    float outer = radius + width*0.5f;
+    ofIndexType first = vertices.size();
+    for(int k = 0; k < resolution; k++){
+        vertices.push_back(ofVec3f(x + circle[k].x*inner, y + circle[k].y*inner));
+        vertices.push_back(ofVec3f(x + circle[k].x*outer, y + circle[k].y*outer));
+        colors.push_back(color);
+        colors.push_back(color);
+        ofIndexType i0 = first + 2*k;
+        ofIndexType i1 = first + 2*((k+1)%resolution);
+        indices.push_back(i0);  indices.push_back(i0+1);    indices.push_back(i1+1);
+        indices.push_back(i0);  indices.push_back(i1+1);    indices.push_back(i1);
+    }
+}
+
+static void addLine(ofMesh& mesh, const ofVec2f& from, const ofVec2f& to, float width, const ofFloatColor& color){
+    vector<ofVec3f>& vertices = mesh.getVertices();
+    vector<ofFloatColor>& colors = mesh.getColors();
+    vector<ofIndexType>& indices = mesh.getIndices();
+
+    ofVec2f dir = to - from;
+    float length = dir.length();
+    if(length == 0) return;
+    ofVec2f side = ofVec2f(-dir.y, dir.x) * (width*0.5f/length);
+
+    ofIndexType first = vertices.size();
+    vertices.push_back(from + side);    vertices.push_back(from - side);
+    vertices.push_back(to + side);      vertices.push_back(to - side);
+    for(int k = 0; k < 4; k++) colors.push_back(color);
+    indices.push_back(first);   indices.push_back(first+1); indices.push_back(first+2);
+    indices.push_back(first+1); indices.push_back(first+3); indices.push_back(first+2);
+}
+
+// Fill a triangle mesh with all the particles, with color and opacity in the
+// vertices, so they are drawn with a single draw call. Color and opacity come
+// from the system and are changed here with the age of each particle. Circles, outlines,
+// lines and trails are tessellated here instead of using point sprites or instancing, so
+// it works with any OpenGL version (also Mesa software rendering)
+void Particles::buildMesh(ofMesh& mesh, int begin, int end){
+    mesh.clear();
+    mesh.setMode(OF_PRIMITIVE_TRIANGLES);
+
+    // kernel compiled for the changes with age of this frame
+    static const vector<MeshKernel> meshKernels = getMeshKernels();
+    unsigned int flags = 0;
+    if(drawParams.opacityAge) flags |= DRAW_OPACITY_AGE;
+    if(drawParams.flickersAge) flags |= DRAW_FLICKERS_AGE;
+    if(drawParams.colorAge) flags |= DRAW_COLOR_AGE;
+    (this->*meshKernels[flags])(mesh, begin, end);
+}
+
+template<unsigned int flags> void Particles::buildMeshRange(ofMesh& mesh, int begin, int end){
+    ofFloatColor systemColor(drawParams.color);
+    float t = drawParams.interpolation;
+
+    // Trails first so the particles are drawn over them
+    if(trailLength > 0){
+        vector<ofVec2f> points(trailLength+1);
+        for(int i = begin; i < end; i++){
+            if(!isAlive[i]) continue;
+            float px = prevX[i] + (x[i] - prevX[i])*t;
+            float py = prevY[i] + (y[i] - prevY[i])*t;
+            float width = drawParams.drawLine ? ofMap(radius[i], 0, 15, 1, 5, true) : fabs(radius[i])*2;
+            addTrail(mesh, points, i, px, py, width, getDrawColor<flags>(i, systemColor));
         }
+    }
+
+    for(int i = begin; i < end; i++){
+        if(!isAlive[i]) continue;
+
+        float px = prevX[i] + (x[i] - prevX[i])*t;
+        float py = prevY[i] + (y[i] - prevY[i])*t;
+        ofFloatColor c = getDrawColor<flags>(i, systemColor);
 
-        if(!drawLine){
-            int resolution = ofMap(fabs(radius), 0, 10, 6, 22, true);
-            ofSetCircleResolution(resolution);
-            ofDrawCircle(pos, radius);
-            if(drawStroke){
-                ofPushStyle();
-                ofNoFill();
-                ofSetLineWidth(strokeWidth);
-                ofSetColor(0, opacity);
-                ofDrawCircle(pos, radius);
-                ofPopStyle();
+        if(!drawParams.drawLine){
+            int resolution = ofMap(fabs(radius[i]), 0, 10, 6, MAX_CIRCLE_RESOLUTION, true);
+            float r = fabs(radius[i]);
+            if(drawParams.isEmpty) addRing(mesh, px, py, r, 2, resolution, c);
+            else addDisc(mesh, px, py, r, resolution, c);
+            if(drawParams.drawStroke){
+                addRing(mesh, px, py, r, drawParams.strokeWidth, resolution, ofFloatColor(0, 0, 0, c.a));
             }
         }
         else{
-//            if(pos.squareDistance(prevPos) >= 25) ofDrawLine(pos, pos-vel.getNormalized()*5);
-//            else ofDrawLine(pos, prevPos);
-//            prevPos = pos;
-            ofSetLineWidth(ofMap(radius, 0, 15, 1, 5, true));
-            ofDrawLine(pos, pos-vel.getNormalized()*radius);
+            ofVec2f pos(px, py);
+            float width = ofMap(radius[i], 0, 15, 1, 5, true);
+            addLine(mesh, pos, pos - ofVec2f(vx[i], vy[i]).getNormalized()*radius[i], width, c);
+        }
+    }
+}
+
+template<unsigned int flags> void Particles::addMeshKernels(vector<MeshKernel>& kernels){
+    addMeshKernels<flags-1>(kernels);
+    kernels.push_back(&Particles::buildMeshRange<flags>);
+}
+
+template<> void Particles::addMeshKernels<0>(vector<MeshKernel>& kernels){
+    kernels.push_back(&Particles::buildMeshRange<0>);
+}
+
+vector<Particles::MeshKernel> Particles::getMeshKernels(){
+    vector<MeshKernel> kernels;
+    addMeshKernels<NUM_DRAW_KERNELS-1>(kernels);
+    return kernels;
+}
+
+// Color and opacity of a particle with its age
+template<unsigned int flags> ofFloatColor Particles::getDrawColor(int i, const ofFloatColor& systemColor){
+    float agePct = age[i]/lifetime[i];
+
+    // Decrease particle opacity with age
+    float opacity = drawParams.opacity;
+    if (flags & DRAW_OPACITY_AGE) opacity *= (1.0f - agePct);
+    if (flags & DRAW_FLICKERS_AGE){
+        if(agePct > 0.75 && random(i, RANDOM_FLICKER, -1, 1) > (1.4 - agePct))
+            opacity *= 0.5;
+    }
+
+    // Change particle color with age
+    ofFloatColor c = systemColor;
+    if (flags & DRAW_COLOR_AGE){
+        ofColor color = drawParams.color;
+        color.setBrightness(ofMap(age[i], 0, lifetime[i], 255, 180));
+        color.setHue(ofMap(age[i], 0, lifetime[i], hue[i], hue[i]-100));
+        c = ofFloatColor(color);
+    }
+    c.a = opacity/255.0f;
+    return c;
+}
+
+// Strip from the drawn position of the particle along the positions of its
+// trail, thinner and more transparent the older the position. The trail ends
+// where the particle jumped to the other side of the space (infinite walls).
+// points has room for the whole trail, so it is allocated once per mesh
+void Particles::addTrail(ofMesh& mesh, vector<ofVec2f>& points, int i, float px, float py, float width, const ofFloatColor& color){
+    unsigned int s = slot[i];
+    int n = trailCount[s];
+    if(n == 0) return;
+
+    // (1) positions from the newest to the oldest, starting at the drawn position
+    const float* ringX = &trailX[(size_t)s*trailLength];
+    const float* ringY = &trailY[(size_t)s*trailLength];
+    int head = trailHead[s];
+    float maxJump = MIN(params.width, params.height)*0.5f;
+    float maxJumpSqrd = maxJump*maxJump;
+    points[0].set(px, py);
+    int numPoints = 1;
+    for(int j = 1; j <= n; j++){
+        int k = (head - j + trailLength) % trailLength;
+        ofVec2f p(ringX[k], ringY[k]);
+        if(p.squareDistance(points[numPoints-1]) > maxJumpSqrd) break;
+        points[numPoints++] = p;
+    }
+    if(numPoints < 2) return;
+
+    // (2) two vertices for each position, to the sides of the trail
+    vector<ofVec3f>& vertices = mesh.getVertices();
+    vector<ofFloatColor>& colors = mesh.getColors();
+    vector<ofIndexType>& indices = mesh.getIndices();
+    ofIndexType first = vertices.size();
+    ofVec2f side(0, 0);
+    for(int j = 0; j < numPoints; j++){
+        ofVec2f dir = points[MAX(j-1, 0)] - points[MIN(j+1, numPoints-1)];
+        float length = dir.length();
+        if(length > 0) side.set(-dir.y/length, dir.x/length); // keep the last side if it does not move
+
+        float fade = 1.0f - (float)j/numPoints;
+        ofVec2f offset = side * (width*0.5f*fade);
+        ofFloatColor c = color;
+        c.a *= fade;
+        vertices.push_back(points[j] + offset);
+        vertices.push_back(points[j] - offset);
+        colors.push_back(c);
+        colors.push_back(c);
+        if(j > 0){
+            ofIndexType k = first + 2*j;
+            indices.push_back(k-2); indices.push_back(k-1); indices.push_back(k);
+            indices.push_back(k-1); indices.push_back(k+1); indices.push_back(k);
         }
+    }
+}
 
-        ofPopStyle();
+void Particles::getDrawPositions(vector<float>& drawX, vector<float>& drawY) const{
+    float t = drawParams.interpolation;
+    drawX.resize(numParticles);
+    drawY.resize(numParticles);
+    for(int i = 0; i < numParticles; i++){
+        drawX[i] = prevX[i] + (x[i] - prevX[i])*t;
+        drawY[i] = prevY[i] + (y[i] - prevY[i])*t;
     }
 }
 
-void Particle::addForce(ofPoint force){
-    frc += force;
+void Particles::addForce(int i, ofPoint force){
+    fx[i] += force.x;
+    fy[i] += force.y;
+}
+
+// Add a force proportional to the mass of each particle
+void Particles::addGravity(int begin, int end, ofPoint gravity){
+    ParticleKernels::get().addGravity(*this, begin, end, gravity.x, gravity.y);
 }
 
-void Particle::addNoise(float turbulence){
-    // Perlin noise
-    float angle = ofSignedNoise(id*0.001f, pos.x * 0.005f,  pos.y * 0.005f, ofGetElapsedTimef() * 0.1f) * 20.0f;
-    ofPoint noiseVector(cos(angle), sin(angle));
-    if(!immortal) frc += noiseVector * turbulence * age; // if immortal this doesn't affect, age == 0
-    else frc += noiseVector * turbulence;
+// The noise is read from a field computed once per frame, each particle
+// uses the layer of the field given by its seed
+void Particles::addNoise(int begin, int end, float turbulence, const NoiseField& field){
+    int numLayers = field.getNumLayers();
+    for(int i = begin; i < end; i++){
+        // Perlin noise
+        float angle = field.sample(x[i], y[i], (int)seed[i] % numLayers) * 20.0f;
+        float strength = immortal[i] ? turbulence : turbulence * age[i]; // if immortal this doesn't affect, age == 0
+        fx[i] += cos(angle) * strength;
+        fy[i] += sin(angle) * strength;
+    }
 }
 
-void Particle::addRepulsionForce(ofPoint posOfForce, float radiusSqrd, float scale){
+void Particles::addRepulsionForce(int i, ofPoint posOfForce, float radiusSqrd, float scale){
 
     // (1) calculate the direction to force source and distance
-    ofPoint dir         = pos - posOfForce;
-    float distSqrd      = pos.squareDistance(posOfForce); // faster than length or distance (no square root)
+    float dx            = x[i] - posOfForce.x;
+    float dy            = y[i] - posOfForce.y;
+    float distSqrd      = dx*dx + dy*dy; // faster than length or distance (no square root)
 
     // (2) if close enough update force
-    if (distSqrd < radiusSqrd){
+    if (distSqrd < radiusSqrd && distSqrd > 0){
         float pct = 1 - (distSqrd / radiusSqrd);  // stronger on the inside
-        dir.normalize();
-        frc += dir * scale * pct;
-    }
-}
-
-void Particle::addRepulsionForce(Particle &p, float radiusSqrd, float scale){
-    
-    // (1) make a vector of where this particle p is:
-    ofPoint posOfForce;
-    posOfForce.set(p.pos.x, p.pos.y);
-    
-    // (2) calculate the direction to particle and distance
-    ofPoint dir         = pos - posOfForce;
-    float distSqrd      = pos.squareDistance(posOfForce); // faster than length or distance (no square root)
-    
-    // (3) if close enough update both forces
-    if (distSqrd < radiusSqrd){
+        float F = scale * pct / sqrt(distSqrd);
+        fx[i] += dx * F;
+        fy[i] += dy * F;
+    }
+}
+
+void Particles::addRepulsionForce(int i, int j, float radiusSqrd, float scale){
+
+    // (1) calculate the direction to particle j and distance
+    float dx            = x[i] - x[j];
+    float dy            = y[i] - y[j];
+    float distSqrd      = dx*dx + dy*dy; // faster than length or distance (no square root)
+
+    // (2) if close enough update both forces
+    if (distSqrd < radiusSqrd && distSqrd > 0){
         float pct = 1 - (distSqrd / radiusSqrd);  // stronger on the inside
-        dir.normalize();
-        frc   += dir * scale * pct;
-        p.frc -= dir * scale * pct;
+        float F = scale * pct / sqrt(distSqrd);
+        fx[i] += dx * F;
+        fy[i] += dy * F;
+        fx[j] -= dx * F;
+        fy[j] -= dy * F;
     }
 }
 
-void Particle::addRepulsionForce(Particle &p, float scale){
+void Particles::addRepulsionForce(int i, int j, float scale){
     // (1) make radius of repulsion equal to particle's radius sum
-    float radius        = this->radius + p.radius;
+    float radius        = this->radius[i] + this->radius[j];
     float radiusSqrd    = radius*radius;
     // (2) call addRepulsion force with the computed radius
-    addRepulsionForce(p, radiusSqrd, scale);
+    addRepulsionForce(i, j, radiusSqrd, scale);
+}
+
+// Repulsion only applied to particle i, for updates where each particle
+// computes its own force and particle j belongs to another thread
+void Particles::addRepulsionForceFrom(int i, int j, float radiusSqrd, float scale){
+    float dx            = x[i] - x[j];
+    float dy            = y[i] - y[j];
+    float distSqrd      = dx*dx + dy*dy;
+
+    if (distSqrd < radiusSqrd && distSqrd > 0){
+        float pct = 1 - (distSqrd / radiusSqrd);
+        float F = scale * pct / sqrt(distSqrd);
+        fx[i] += dx * F;
+        fy[i] += dy * F;
+    }
 }
 
-void Particle::addAttractionForce(ofPoint posOfForce, float radiusSqrd, float scale){
+void Particles::addAttractionForce(int i, ofPoint posOfForce, float radiusSqrd, float scale){
 
     // (1) calculate the direction to force source and distance
-    ofPoint dir         = pos - posOfForce;
-    float distSqrd      = pos.squareDistance(posOfForce); // faster than length or distance (no square root)
+    float dx            = x[i] - posOfForce.x;
+    float dy            = y[i] - posOfForce.y;
+    float distSqrd      = dx*dx + dy*dy; // faster than length or distance (no square root)
 
     // (2) if close enough update force
-    if (distSqrd < radiusSqrd){
+    if (distSqrd < radiusSqrd && distSqrd > 0){
         float pct = 1 - (distSqrd / radiusSqrd);  // stronger on the inside
-        dir.normalize();
-        frc -= dir * scale * pct;
-    }
-}
-
-void Particle::addAttractionForce(Particle &p, float radiusSqrd, float scale){
-    
-    // (1) make a vector of where this particle p is:
-    ofPoint posOfForce;
-    posOfForce.set(p.pos.x, p.pos.y);
-    
-    // (2) calculate the direction to particle and distance
-    ofPoint dir         = pos - posOfForce;
-    float distSqrd      = pos.squareDistance(posOfForce); // faster than length or distance (no square root)
-    
-    // (3) if close enough update both forces
-    if (distSqrd < radiusSqrd){
+        float F = scale * pct / sqrt(distSqrd);
+        fx[i] -= dx * F;
+        fy[i] -= dy * F;
+    }
+}
+
+void Particles::addAttractionForce(int i, int j, float radiusSqrd, float scale){
+
+    // (1) calculate the direction to particle j and distance
+    float dx            = x[i] - x[j];
+    float dy            = y[i] - y[j];
+    float distSqrd      = dx*dx + dy*dy; // faster than length or distance (no square root)
+
+    // (2) if close enough update both forces
+    if (distSqrd < radiusSqrd && distSqrd > 0){
         float pct = 1 - (distSqrd / radiusSqrd);  // stronger on the inside
-        dir.normalize();
-        frc   -= dir * scale * pct;
-        p.frc += dir * scale * pct;
+        float F = scale * pct / sqrt(distSqrd);
+        fx[i] -= dx * F;
+        fy[i] -= dy * F;
+        fx[j] += dx * F;
+        fy[j] += dy * F;
     }
 }
 
 //------------------------------------------------------------------
-void Particle::returnToOrigin(float radiusSqrd, float scale){
-    // (1) calculate the direction to origin position and distance
-    ofPoint dirToOrigin = iniPos - pos;
-    float distSqrd = pos.squareDistance(iniPos);
-    
-    // (2) set force depending on the distance
-    float pct = 1;
-    if(distSqrd < radiusSqrd){
-        pct = distSqrd / radiusSqrd; // decrease force when closer to origin
-    }
-    
-    // (3) update force
-    dirToOrigin.normalize();
-    frc += dirToOrigin * scale * pct;
+void Particles::returnToOrigin(int begin, int end, float radiusSqrd, float scale){
+    ParticleKernels::get().returnToOrigin(*this, begin, end, radiusSqrd, scale);
 }
 
-void Particle::addFlockingForces(Particle &p){
-    ofPoint dir = pos - p.pos;
-    float distSqrd = pos.squareDistance(p.pos);
+void Particles::addFlockingForces(int i, int j){
+    float dx = x[i] - x[j];
+    float dy = y[i] - y[j];
+    float distSqrd = dx*dx + dy*dy;
 
-    if(0.01f < distSqrd && distSqrd < flockingRadiusSqrd){ // if neighbor particle within zone radius...
+    if(0.01f < distSqrd && distSqrd < params.flockingRadiusSqrd){ // if neighbor particle within zone radius...
 
-        float percent = distSqrd/flockingRadiusSqrd;
+        float percent = distSqrd/params.flockingRadiusSqrd;
 
         // Separate
-        if(percent < lowThresh){            // ... and is within the lower threshold limits, separate
-            float F = (lowThresh/percent - 1.0f) * separationStrength;
-            dir = dir.getNormalized() * F;
-            frc += dir;
-            p.frc -= dir;
+        if(percent < params.lowThresh){            // ... and is within the lower threshold limits, separate
+            float F = (params.lowThresh/percent - 1.0f) * params.separationStrength / sqrt(distSqrd);
+            fx[i] += dx * F;
+            fy[i] += dy * F;
+            fx[j] -= dx * F;
+            fy[j] -= dy * F;
         }
         // Align
-        else if(percent < highThresh){      // ... else if it is within the higher threshold limits, align
-            float threshDelta = highThresh - lowThresh;
-            float adjustedPercent = (percent - lowThresh) / threshDelta;
-            float F = (0.5f - cos(adjustedPercent * M_PI * 2.0f) * 0.5f + 0.5f) * alignmentStrength;
-            frc += p.vel.getNormalized() * F;
-            p.frc += vel.getNormalized() * F;
+        else if(percent < params.highThresh){      // ... else if it is within the higher threshold limits, align
+            float threshDelta = params.highThresh - params.lowThresh;
+            float adjustedPercent = (percent - params.lowThresh) / threshDelta;
+            float F = (0.5f - cos(adjustedPercent * M_PI * 2.0f) * 0.5f + 0.5f) * params.alignmentStrength;
+            ofPoint velI = getVel(i).getNormalized() * F;
+            ofPoint velJ = getVel(j).getNormalized() * F;
+            fx[i] += velJ.x;
+            fy[i] += velJ.y;
+            fx[j] += velI.x;
+            fy[j] += velI.y;
         }
         // Attract
         else{                               // ... else, attract
-            float threshDelta = 1.0f - highThresh;
-            float adjustedPercent = (percent - highThresh) / threshDelta;
-            float F = (0.5f - cos(adjustedPercent * M_PI * 2.0f) * 0.5f + 0.5f) * attractionStrength;
-            dir = dir.getNormalized() * F;
-            frc -= dir;
-            p.frc += dir;
+            float threshDelta = 1.0f - params.highThresh;
+            float adjustedPercent = (percent - params.highThresh) / threshDelta;
+            float F = (0.5f - cos(adjustedPercent * M_PI * 2.0f) * 0.5f + 0.5f) * params.attractionStrength / sqrt(distSqrd);
+            fx[i] -= dx * F;
+            fy[i] -= dy * F;
+            fx[j] += dx * F;
+            fy[j] += dy * F;
         }
     }
 }
 
-void Particle::pullToCenter(){
-    ofPoint center(width/2, height/2);
-    ofPoint dirToCenter = pos - center;
-    float distToCenterSqrd = dirToCenter.lengthSquared();
+// Flocking force of particle j only applied to particle i. Same as the
+// i side of addFlockingForces, so visiting every neighbor of i gives the
+// same total force
+void Particles::addFlockingForceFrom(int i, int j){
+    float dx = x[i] - x[j];
+    float dy = y[i] - y[j];
+    float distSqrd = dx*dx + dy*dy;
+
+    if(0.01f < distSqrd && distSqrd < params.flockingRadiusSqrd){
+        float percent = distSqrd/params.flockingRadiusSqrd;
+
+        if(percent < params.lowThresh){            // separate
+            float F = (params.lowThresh/percent - 1.0f) * params.separationStrength / sqrt(distSqrd);
+            fx[i] += dx * F;
+            fy[i] += dy * F;
+        }
+        else if(percent < params.highThresh){      // align
+            float threshDelta = params.highThresh - params.lowThresh;
+            float adjustedPercent = (percent - params.lowThresh) / threshDelta;
+            float F = (0.5f - cos(adjustedPercent * M_PI * 2.0f) * 0.5f + 0.5f) * params.alignmentStrength;
+            ofPoint velJ = getVel(j).getNormalized() * F;
+            fx[i] += velJ.x;
+            fy[i] += velJ.y;
+        }
+        else{                               // attract
+            float threshDelta = 1.0f - params.highThresh;
+            float adjustedPercent = (percent - params.highThresh) / threshDelta;
+            float F = (0.5f - cos(adjustedPercent * M_PI * 2.0f) * 0.5f + 0.5f) * params.attractionStrength / sqrt(distSqrd);
+            fx[i] -= dx * F;
+            fy[i] -= dy * F;
+        }
+    }
+}
+
+void Particles::pullToCenter(int begin, int end){
+    float centerX = params.width/2;
+    float centerY = params.height/2;
     float distThresh = 900.0f;
+    float pullStrength = 0.000015f;
+
+    for(int i = begin; i < end; i++){
+        float dx = x[i] - centerX;
+        float dy = y[i] - centerY;
+        float distToCenterSqrd = dx*dx + dy*dy;
 
-    if(distToCenterSqrd > distThresh){
-        dirToCenter.normalize();
-        float pullStrength = 0.000015f;
-        frc -= dirToCenter * ( ( distToCenterSqrd - distThresh ) * pullStrength );
+        if(distToCenterSqrd > distThresh){
+            float F = ( ( distToCenterSqrd - distThresh ) * pullStrength ) / sqrt(distToCenterSqrd);
+            fx[i] -= dx * F;
+            fy[i] -= dy * F;
+        }
     }
 }
 
-void Particle::seek(ofPoint target, float radiusSqrd, float scale){
+void Particles::seek(int i, ofPoint target, float radiusSqrd, float scale){
     // (1) calculate the direction to target & length
-    ofPoint dirToTarget = target - pos;
-    float distSqrd = pos.squareDistance(target);
-    
+    float dx = target.x - x[i];
+    float dy = target.y - y[i];
+    float distSqrd = dx*dx + dy*dy;
+    if(distSqrd == 0) return;
+
     // (2) scale force depending on the distance
     float pct = 1;
     if(distSqrd < radiusSqrd){
         pct = distSqrd / radiusSqrd; // decrease force when closer to target
     }
-    
+
     // (3) update force
-    dirToTarget.normalize();
-    frc += dirToTarget * scale * pct;
+    float F = scale * pct / sqrt(distSqrd);
+    fx[i] += dx * F;
+    fy[i] += dy * F;
 }
 
 // seek target independent of distance
-void Particle::seek(ofPoint target, float scale){
+void Particles::seek(int i, ofPoint target, float scale){
     // (1) calculate the direction to target & length
-    ofPoint dirToTarget = target - pos;
-    
+    float dx = target.x - x[i];
+    float dy = target.y - y[i];
+    float dist = sqrt(dx*dx + dy*dy);
+    if(dist == 0) return;
+
     // (2) scale force randomly
-    float pct = ofRandom(0, 1);
-    
-    // (3) update force
-    dirToTarget.normalize();
-    vel += dirToTarget * scale * pct;
+    float pct = random(i, RANDOM_SEEK);
+
+    // (3) update velocity
+    float F = scale * pct / dist;
+    vx[i] += dx * F;
+    vy[i] += dy * F;
 }
 
 
-void Particle::marginsBounce(){
+void Particles::marginsBounce(int i){
     bool isBouncing = false;
+    float r = radius[i];
 
-    if(pos.x > width-radius){
-        pos.x = width-radius;
-        vel.x *= -1.0;
+    if(x[i] > params.width-r){
+        x[i] = params.width-r;
+        vx[i] *= -1.0;
     }
-    else if(pos.x < radius){
-        pos.x = radius;
-        vel.x *= -1.0;
+    else if(x[i] < r){
+        x[i] = r;
+        vx[i] *= -1.0;
     }
-    if(pos.y > height-radius){
-        pos.y = height-radius;
-        vel.y *= -1.0;
+    if(y[i] > params.height-r){
+        y[i] = params.height-r;
+        vy[i] *= -1.0;
         isBouncing = true;
     }
-    else if(bounceTop && pos.y < radius){
-        pos.y = radius;
-        vel.y *= -1.0;
+    else if(params.bounceTop && y[i] < r){
+        y[i] = r;
+        vy[i] *= -1.0;
     }
 
-    if (isBouncing && bounceDamping){
-        vel *= damping;
+    if (isBouncing && params.bounceDamping){
+        vx[i] *= params.damping;
+        vy[i] *= params.damping;
     }
 }
 
-void Particle::marginsSteer(){
-    float margin = radius*10;
+void Particles::marginsSteer(int i){
+    float margin = radius[i]*10;
 
-    if(pos.x > width-margin){
-        vel.x -= ofMap(pos.x, width-margin, width, maxSpeed/1000.0, maxSpeed/10.0);
+    if(x[i] > params.width-margin){
+        vx[i] -= ofMap(x[i], params.width-margin, params.width, params.maxSpeed/1000.0, params.maxSpeed/10.0);
     }
-    else if(pos.x < margin){
-        vel.x += ofMap(pos.x, 0, margin, maxSpeed/10.0, maxSpeed/1000.0);
+    else if(x[i] < margin){
+        vx[i] += ofMap(x[i], 0, margin, params.maxSpeed/10.0, params.maxSpeed/1000.0);
     }
 
-    if(pos.y > height-margin){
-        vel.y -= ofMap(pos.y, height-margin, height, maxSpeed/1000.0, maxSpeed/10.0);
+    if(y[i] > params.height-margin){
+        vy[i] -= ofMap(y[i], params.height-margin, params.height, params.maxSpeed/1000.0, params.maxSpeed/10.0);
     }
-    else if(pos.y < margin){
-        vel.y += ofMap(pos.y, 0, margin, maxSpeed/10.0, maxSpeed/10.0);
+    else if(y[i] < margin){
+        vy[i] += ofMap(y[i], 0, margin, params.maxSpeed/10.0, params.maxSpeed/10.0);
     }
 }
 
-void Particle::marginsWrap(){
-    if(pos.x-radius > (float)width){
-        pos.x = -radius;
+void Particles::marginsWrap(int i){
+    float r = radius[i];
+
+    // the previous position moves too so it does not look like it crossed the screen
+    if(x[i]-r > (float)params.width){
+        prevX[i] += -r - x[i];
+        x[i] = -r;
     }
-    else if(pos.x+radius < 0.0){
-        pos.x = width;
+    else if(x[i]+r < 0.0){
+        prevX[i] += params.width - x[i];
+        x[i] = params.width;
     }
 
-    if(pos.y-radius > (float)height){
-        pos.y = -radius;
+    if(y[i]-r > (float)params.height){
+        prevY[i] += -r - y[i];
+        y[i] = -r;
     }
-    else if(pos.y+radius < 0.0){
-        pos.y = height;
+    else if(y[i]+r < 0.0){
+        prevY[i] += params.height - y[i];
+        y[i] = params.height;
     }
 }
 
-void Particle::contourBounce(ofPolyline contour){
-    unsigned int index;
-    ofPoint contactPoint = contour.getClosestPoint(pos, &index);
-    ofVec2f normal = contour.getNormalAtIndex(index);
+// normal of the contour at the closest point to the particle
+void Particles::contourBounce(int i, const ofVec2f& normal){
+    ofVec2f vel(vx[i], vy[i]);
     vel = vel - 2*vel.dot(normal)*normal; //reflection vector
     vel *= 0.35; // damping
-    age += 0.5;
+    vx[i] = vel.x;
+    vy[i] = vel.y;
+    age[i] += 0.5;
 }
 
-void Particle::kill(){
-    isAlive = false;
-}
+// Bounce the particles that went into a silhouette during the last update,
+// anywhere on the way from the previous position so fast particles do not go
+// through thin parts
+void Particles::contourCollide(int begin, int end, const ContourBVH& contours){
+    if(contours.isEmpty()) return;
+    for(int i = begin; i < end; i++){
+        if(!isAlive[i] || (x[i] == prevX[i] && y[i] == prevY[i])) continue;
+
+        float t;
+        ofVec2f normal;
+        if(contours.intersect(ofPoint(prevX[i], prevY[i]), ofPoint(x[i], y[i]), &t, &normal) != -1){
+            // (1) back to where it hit, just outside
+            x[i] = prevX[i] + (x[i] - prevX[i])*t + normal.x*0.5f;
+            y[i] = prevY[i] + (y[i] - prevY[i])*t + normal.y*0.5f;
 
-void Particle::limitVelocity(){
-    if(vel.lengthSquared() > (maxSpeed*maxSpeed)){
-        vel.normalize();
-        vel *= maxSpeed;
+            // (2) reflect the velocity
+            contourBounce(i, normal);
+        }
     }
 }
 
+void Particles::kill(int i){
+    isAlive[i] = false;
+}
+
+// Is the particle back at its origin and almost stopped?
+bool Particles::isAtRest(int i, float maxDistSqrd, float maxSpeedSqrd) const{
+    float dx = x[i] - iniX[i];
+    float dy = y[i] - iniY[i];
+    return dx*dx + dy*dy <= maxDistSqrd && vx[i]*vx[i] + vy[i]*vy[i] <= maxSpeedSqrd;
+}
+
+// Leave the particle exactly at its origin, so it stays there without being updated
+void Particles::fallAsleep(int i){
+    x[i] = iniX[i];     y[i] = iniY[i];
+    prevX[i] = iniX[i]; prevY[i] = iniY[i];
+    vx[i] = 0;          vy[i] = 0;
+    isAsleep[i] = true;
+}
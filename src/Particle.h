@@ -19,92 +19,202 @@
 
 #pragma once
 #include "ofMain.h"
-#include "irMarker.h"
+#include "RandomStream.h"
+#include "NoiseField.h"
+#include "ContourBVH.h"
+#include "SnapshotArchive.h"
 
-class Particle
+// Handle to a particle that stays valid while the particle is alive, even if
+// it moves inside the arrays. Low 32 bits are the slot, high 32 bits are the
+// generation of the slot when the particle was created.
+typedef uint64_t ParticleHandle;
+#define INVALID_PARTICLE_HANDLE 0
+
+// Uses of the per particle random numbers, so they are independent in the same frame
+enum ParticleRandom {RANDOM_SEEK, RANDOM_FLICKER, RANDOM_GRAVITY_INTERACTION};
+
+// Behaviors compiled into the update and mesh kernels, a kernel for each combination
+enum ParticleUpdateFlags {UPDATE_SIZE_AGE = 1, UPDATE_BOUNCE = 2, UPDATE_STEER = 4, UPDATE_WRAP = 8, NUM_UPDATE_KERNELS = 16};
+enum ParticleDrawFlags {DRAW_OPACITY_AGE = 1, DRAW_FLICKERS_AGE = 2, DRAW_COLOR_AGE = 4, NUM_DRAW_KERNELS = 8};
+
+// Parameters shared by all the particles of a system that the update reads
+// for every particle. The particle system sets them once per frame.
+struct ParticleParams
+{
+    ParticleParams();
+
+    float friction;         // Decay of the velocity
+    bool limitSpeed;        // Limit the speed of the particles?
+    float maxSpeed;         // Maximum speed
+    bool sizeAge;           // Particles change size with age?
+    //--------------------------------------------------------------
+    bool bounces;           // Particles bounce with the window margins?
+    bool bounceTop;         // Particles bounce with top margin?
+    bool steers;            // Particles steer direction before touching the walls?
+    bool infiniteWalls;     // Particles go back to the opposite wall?
+    bool bounceDamping;     // Decrease velocity when particles bounce?
+    float damping;          // Damping when particles bounce walls
+    //--------------------------------------------------------------
+    float flockingRadiusSqrd;
+    float lowThresh;        // separate
+    float highThresh;       // align
+    float separationStrength;
+    float alignmentStrength;
+    float attractionStrength;
+    //--------------------------------------------------------------
+    int width;              // Particles boundaries
+    int height;
+    //--------------------------------------------------------------
+    uint64_t randomKey;     // Changes every frame, key of the per particle random numbers
+};
+
+// Parameters shared by all the particles of a system that are only read
+// when building the mesh to draw them
+struct ParticleDrawParams
+{
+    ParticleDrawParams();
+
+    ofColor color;          // Color of the particles
+    float opacity;          // Opacity of the particle system
+    bool opacityAge;        // Particles change opacity with age?
+    bool flickersAge;       // Particles flicker opacity when about to die?
+    bool colorAge;          // Particles change color with age?
+    bool isEmpty;           // Draw only contour of the particles?
+    bool drawLine;          // Draw particles as a line?
+    bool drawStroke;        // Draw stroke line around particles?
+    float strokeWidth;      // Stroke line width
+    float interpolation;    // Where to draw between the previous (0) and the current (1) position
+};
+
+// Structure-of-arrays particle storage. Every attribute lives in its own
+// packed array and the functions work on a particle index or on an index
+// range [begin, end), so the update passes walk memory sequentially. Only
+// what is different for each particle is stored per particle, everything that
+// is the same for the whole system is in the parameter blocks.
+//
+// The arrays are a fixed-capacity pool: living particles are always packed in
+// [0, size()), dead particles are removed by moving the last one into their
+// place and no memory is allocated unless the pool has to grow.
+//
+// The trails are kept by handle slot and not by particle, since the slot of a
+// particle does not change while it lives, so they are not copied when the
+// particles move.
+class Particles
 {
     public:
-        Particle();
-
-        void setup(float id, ofPoint pos, ofPoint vel, ofColor color, float initialRadius, float lifetime);
-        void update(float dt);
-        void draw();
-
-        void addForce(ofPoint force);
-        void addNoise(float turbulence);
-        void addRepulsionForce(ofPoint posOfForce, float radiusSqrd, float scale);
-        void addAttractionForce(ofPoint posOfForce, float radiusSqrd, float scale);
-        void addRepulsionForce(Particle &p, float radiusSqrd, float scale);
-        void addAttractionForce(Particle &p, float radiusSqrd, float scale);
-        void addRepulsionForce(Particle &p, float scale);
-        void returnToOrigin(float radiusSqrd, float scale);
-
-        void addFlockingForces(Particle &p);
-        void seek(ofPoint target, float radiusSqrd, float scale);
-        void seek(ofPoint target, float scale);
-        void pullToCenter();
-        void limitVelocity();
-
-        void marginsBounce();
-        void marginsSteer();
-        void marginsWrap();
-    
-        void contourBounce(ofPolyline contour);
-
-        void kill();
-//--------------------------------------------------------------
-        float opacity;
-//--------------------------------------------------------------
-        ofPoint pos;            // Position
-        ofPoint prevPos;        // Previous position
-        ofPoint iniPos;         // Initial position
-        ofPoint vel;            // Velocity
-        ofPoint acc;            // Acceleration
-        ofPoint frc;            // Force
-        ofColor color;          // Color
-// --------------------------------------------------------------
-        ofPolyline contour;     // Particle creation boundaries
+        Particles();
+
+        void setup(int width, int height);
+        void reserve(int capacity);
+        ParticleHandle add(ofPoint pos, ofPoint vel, ofColor color, float initialRadius, float lifetime);
+        void removeDead();
+        void clear();
+        void transfer(SnapshotArchive& archive);
+        int  size() const {return numParticles;}
+        int  getCapacity() const {return capacity;}
+        void setTrailLength(int length);
+        float getMortonDisorder(float cellSize);
+        bool sortByMorton(float cellSize);
+        int  getTrailLength() const {return trailLength;}
+        unsigned int getLayoutVersion() const {return layoutVersion;}
+
+        ParticleHandle getHandle(int i) const;
+        int  getIndex(ParticleHandle handle) const;   // -1 if the particle does not exist anymore
+
+        void update(int begin, int end, float dt);
+        void buildMesh(ofMesh& mesh, int begin, int end);
+        void getDrawPositions(vector<float>& drawX, vector<float>& drawY) const;
+
+        void addForce(int i, ofPoint force);
+        void addGravity(int begin, int end, ofPoint gravity);
+        void addNoise(int begin, int end, float turbulence, const NoiseField& field);
+        void addRepulsionForce(int i, ofPoint posOfForce, float radiusSqrd, float scale);
+        void addAttractionForce(int i, ofPoint posOfForce, float radiusSqrd, float scale);
+        void addRepulsionForce(int i, int j, float radiusSqrd, float scale);
+        void addAttractionForce(int i, int j, float radiusSqrd, float scale);
+        void addRepulsionForce(int i, int j, float scale);
+        void addRepulsionForceFrom(int i, int j, float radiusSqrd, float scale);
+        void returnToOrigin(int begin, int end, float radiusSqrd, float scale);
+
+        void addFlockingForces(int i, int j);
+        void addFlockingForceFrom(int i, int j);
+        void seek(int i, ofPoint target, float radiusSqrd, float scale);
+        void seek(int i, ofPoint target, float scale);
+        void pullToCenter(int begin, int end);
+
+        void marginsBounce(int i);
+        void marginsSteer(int i);
+        void marginsWrap(int i);
+
+        void contourBounce(int i, const ofVec2f& normal);
+        void contourCollide(int begin, int end, const ContourBVH& contours);
+
+        void kill(int i);
+        bool isAtRest(int i, float maxDistSqrd, float maxSpeedSqrd) const;
+        void fallAsleep(int i);
+
+        ofPoint getPos(int i) const {return ofPoint(x[i], y[i]);}
+        ofPoint getVel(int i) const {return ofPoint(vx[i], vy[i]);}
+
+        // Random number in [min, max) that only depends on the frame, the
+        // particle and the use, so it is the same from any thread
+        float random(int i, ParticleRandom use, float min = 0, float max = 1) const;
 // --------------------------------------------------------------
-        float id;               // Particle ID
-        float age;              // Time of living
-        float mass;             // Mass of the particle
-        float lifetime;         // Allowed lifetime
-        float friction;         // Decay of the velocity
-        float initialRadius;    // Radius of the particle when borns
-        float radius;           // Radius of the particle
-        float originalHue;      // Initial hue color
+        vector<float> x, y;             // Position
+        vector<float> prevX, prevY;     // Previous position
+        vector<float> iniX, iniY;       // Initial position
+        vector<float> vx, vy;           // Velocity
+        vector<float> fx, fy;           // Force
 // --------------------------------------------------------------
-        bool immortal;          // Can the particle die?
-        bool isAlive;           // Is the particle alive?
-        bool isTouched;         // Particle has been activated through some event
-
-        bool sizeAge;           // Particle changes size with age?
-        bool opacityAge;        // Particle changes opacity with age?
-        bool flickersAge;       // Particle flickers opacity when about to die?
-        bool colorAge;          // Particle changes color with age?
-        bool isEmpty;           // Draw only contour of the particle?
-        bool drawLine;          // Draw particle as a line from prevPos to pos?
-        bool drawStroke;        // Draw stroke line around particle?
-        float strokeWidth;      // Stroke line width
-
-        bool limitSpeed;        // Limit the speed of the particle?
-        bool bounceDamping;     // Decrease velocity when particle bounces?
-
-        bool bounces;           // Particle bounces with the window margins?
-        bool bounceTop;         // Particle bounces with top margin?
-        bool steers;            // Particle steers direction before touching the walls?
-        bool infiniteWalls;     // Particle goes back to the opposite wall?
+        vector<float> seed;             // Noise seed of the particle
+        vector<float> age;              // Time of living
+        vector<float> mass;             // Mass of the particle
+        vector<float> lifetime;         // Allowed lifetime
+        vector<float> initialRadius;    // Radius of the particle when borns
+        vector<float> radius;           // Radius of the particle
+        vector<float> hue;              // Hue of the color when the particle was born
 // --------------------------------------------------------------
-        float flockingRadiusSqrd;
-        float lowThresh;        // separate
-        float highThresh;       // align
-        float separationStrength;
-        float alignmentStrength;
-        float attractionStrength;
-        float maxSpeed;         // Maximum speed
-        float damping;          // Damping when particle bounces walls
+        vector<unsigned char> immortal; // Can the particle die?
+        vector<unsigned char> isAlive;  // Is the particle alive?
+        vector<unsigned char> isTouched;// Particle has been activated through some event
+        vector<unsigned char> isAsleep; // Particle rests at its origin and is not updated until something wakes it
 // --------------------------------------------------------------
-        int width;              // Particle boundaries
-        int height;
-};
+        ParticleParams params;          // Read by the update, hot
+        ParticleDrawParams drawParams;  // Read only when drawing, cold
 
+    protected:
+        void move(int from, int to);
+        bool hasValidSlots() const;
+        void computeMortonKeys(float cellSize);
+        template<typename T> void permute(vector<T>& values, vector<T>& scratch);
+        typedef void (Particles::*UpdateKernel)(int begin, int end);
+        typedef void (Particles::*MeshKernel)(ofMesh& mesh, int begin, int end);
+        template<unsigned int flags> void updateAgeAndMargins(int begin, int end);
+        template<unsigned int flags> static void addUpdateKernels(vector<UpdateKernel>& kernels);
+        static vector<UpdateKernel> getUpdateKernels();
+        template<unsigned int flags> void buildMeshRange(ofMesh& mesh, int begin, int end);
+        template<unsigned int flags> static void addMeshKernels(vector<MeshKernel>& kernels);
+        static vector<MeshKernel> getMeshKernels();
+        template<unsigned int flags> ofFloatColor getDrawColor(int i, const ofFloatColor& systemColor);
+        void addTrail(ofMesh& mesh, vector<ofVec2f>& points, int i, float px, float py, float width, const ofFloatColor& color);
+        //--------------------------------------------------------------
+        int numParticles;                   // Number of living particles
+        int capacity;                       // Size of the pool
+        unsigned int layoutVersion;         // Changes when particles are added, removed or moved
+        //--------------------------------------------------------------
+        vector<unsigned int> slot;          // Handle slot of each particle
+        vector<unsigned int> slotGeneration;// Generation of each slot
+        vector<int> slotIndex;              // Particle index of each slot
+        vector<unsigned int> freeSlots;     // Stack of unused slots
+        //--------------------------------------------------------------
+        int trailLength;                    // Positions kept for the trail of each particle (0 no trails)
+        vector<float> trailX, trailY;       // Ring of the last positions, trailLength for each slot
+        vector<unsigned short> trailHead;   // Where the next position goes in the ring of each slot
+        vector<unsigned short> trailCount;  // Positions in the ring of each slot
+        //--------------------------------------------------------------
+        vector<uint32_t> mortonKeys, sortedKeys;    // Z-order of each particle, scratch of the sort
+        vector<int> mortonOrder, sortedOrder;       // Particle that goes in each position after the sort
+        vector<float> scratchFloats;                // Previous values of an array while it is permuted
+        vector<unsigned char> scratchBytes;
+        vector<unsigned int> scratchSlots;
+};
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "ParticleBenchmark.h"
+
+#define BENCHMARK_SPACING 5         // Distance between particles at the benchmark density (px)
+#define BENCHMARK_SEED 1234         // Seed of the particles and of the input (unless CREA_SEED is set)
+#define BENCHMARK_DT (1.0/60.0)     // Time step of the updates
+#define BENCHMARK_MARKERS 4         // Number of synthetic markers
+#define BENCHMARK_VERTICES 200      // Vertices of each synthetic silhouette
+#define MAX_WARMUP_FRAMES 30
+#define MAX_MEASURED_FRAMES 200
+#define KERNEL_CHECK_PARTICLES 20000    // Particles of each mode to compare the kernels
+#define KERNEL_CHECK_FRAMES 30          // Frames to compare the kernels
+
+static const char* phaseNames[NUM_UPDATE_PHASES] = {"prepare", "interaction", "emission", "neighbors", "integration"};
+
+static string getModeName(ParticleMode mode){
+    if(mode == EMITTER) return "emitter";
+    if(mode == GRID) return "grid";
+    if(mode == BOIDS) return "boids";
+    if(mode == ANIMATIONS) return "snow";
+    return "random";
+}
+
+ParticleBenchmark::ParticleBenchmark(){
+    particleCounts.push_back(1000);
+    particleCounts.push_back(10000);
+    particleCounts.push_back(100000);
+    particleCounts.push_back(1000000);
+
+    // 1, 2, 4... and all the cores
+    int cores = MAX((int)thread::hardware_concurrency(), 1);
+    for(int t = 1; t < cores; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(cores);
+
+    warmupFrames    = 2;
+    measuredFrames  = 3;
+
+    // same seed as the app with CREA_SEED=<seed>
+    const char* seedVariable = getenv("CREA_SEED");
+    randomSeed      = (seedVariable != NULL) ? strtoull(seedVariable, NULL, 10) : BENCHMARK_SEED;
+}
+
+void ParticleBenchmark::setup(){
+    ParticleMode modes[] = {EMITTER, GRID, BOIDS, ANIMATIONS};
+
+    vector<KernelCheck> checks = checkKernels();
+    for(unsigned int k = 0; k < checks.size(); k++){
+        if(checks[k].same) ofLogNotice("ParticleBenchmark") << checks[k].name << " kernels: same particles as C++";
+        else ofLogError("ParticleBenchmark") << checks[k].name << " kernels: different particles than C++";
+    }
+
+    vector<Result> results;
+    for(int m = 0; m < 4; m++){
+        for(unsigned int n = 0; n < particleCounts.size(); n++){
+            for(unsigned int t = 0; t < threadCounts.size(); t++){
+                for(int reorder = 1; reorder >= 0; reorder--){
+                    Result result = run(modes[m], particleCounts[n], threadCounts[t], reorder);
+                    ofLogNotice("ParticleBenchmark") << result.mode << " " << result.numParticles << " particles, "
+                                                     << result.numThreads << " threads" << (reorder ? "" : ", unsorted") << ": "
+                                                     << result.totalNs << " ns/particle";
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    ofDirectory dir;
+    dir.allowExt("particles");
+    int numRecordings = dir.listDir("recordings");
+    dir.sort();
+    for(int r = 0; r < numRecordings; r++){
+        Result result;
+        if(replay(dir.getPath(r), result)){
+            ofLogNotice("ParticleBenchmark") << result.recording << ": " << result.totalNs << " ns/particle"
+                                             << (result.exact ? "" : ", not the recorded state");
+            results.push_back(result);
+        }
+        else ofLogWarning("ParticleBenchmark") << "Could not replay " << dir.getName(r);
+    }
+
+    string json = toJson(results, checks);
+    cout << json << endl;
+    ofBuffer buffer(json.c_str(), json.size());
+    ofBufferToFile("benchmark.json", buffer);
+
+    ofExit();
+}
+
+ParticleBenchmark::Result ParticleBenchmark::run(ParticleMode mode, int numParticles, int numThreads, bool reorder){
+    ThreadPool threadPool;
+    threadPool.setup(numThreads);
+    int width, height;
+    ParticleSystem* ps = create(mode, numParticles, threadPool, width, height);
+    if(!reorder){
+        ps->reorderUpdates = 0;
+        ps->reorderDisorder = 0;
+    }
+
+    // (3) run it, more frames when there are less particles
+    int scale = MAX(1000000/numParticles, 1);
+    int warmup = MIN(warmupFrames*scale, MAX_WARMUP_FRAMES);
+    int measured = MIN(measuredFrames*scale, MAX_MEASURED_FRAMES);
+
+    double phaseMs[NUM_UPDATE_PHASES] = {0};
+    double totalMs = 0;
+    double particles = 0;
+    double awake = 0;
+    for(int f = 0; f < warmup + measured; f++){
+        updateInput((f+1)*BENCHMARK_DT, width, height);
+        ps->update(BENCHMARK_DT, markers, contour, fluid);
+        if(f < warmup) continue;
+
+        for(int p = 0; p < NUM_UPDATE_PHASES; p++) phaseMs[p] += ps->phaseTime[p];
+        totalMs += ps->updateTime;
+        particles += ps->particles.size();
+        awake += ps->numAwake;
+    }
+
+    Result result;
+    result.exact = true;
+    result.mode = getModeName(mode);
+    result.numParticles = numParticles;
+    result.numThreads = numThreads;
+    result.reorder = reorder;
+    result.width = width;
+    result.height = height;
+    result.frames = measured;
+    result.meanParticles = particles/measured;
+    result.meanAwake = awake/measured;
+    for(int p = 0; p < NUM_UPDATE_PHASES; p++) result.phaseNs[p] = (particles > 0) ? phaseMs[p]*1e6/particles : 0;
+    result.totalNs = (particles > 0) ? totalMs*1e6/particles : 0;
+    result.frameMs = totalMs/measured;
+
+    delete ps;
+    contour.threadPool = NULL;
+    return result;
+}
+
+// Replay a recording from its first snapshot with all its steps measured
+bool ParticleBenchmark::replay(const string path, Result& result){
+    ParticleRecording recording;
+    if(!recording.load(path) || recording.getNumSteps() == 0) return false;
+
+    ThreadPool threadPool;
+    threadPool.setup(recording.numThreads);
+
+    contour.width = recording.width;
+    contour.height = recording.height;
+    contour.threadPool = &threadPool;
+    contour.distanceField.setup(recording.width, recording.height, 2.0); // same cells as Contour::setup
+
+    ParticleSystem* ps = new ParticleSystem();
+    ps->setup(recording.particleMode, recording.width, recording.height);
+    ps->threadPool = &threadPool;
+
+    bool replayed = recording.restart(*ps);
+    double phaseMs[NUM_UPDATE_PHASES] = {0};
+    double totalMs = 0;
+    double particles = 0;
+    double awake = 0;
+    int steps = 0;
+    while(replayed && steps < recording.getNumSteps()){
+        replayed = recording.replayStep(steps, *ps, markers, contour, fluid);
+        for(int p = 0; p < NUM_UPDATE_PHASES; p++) phaseMs[p] += ps->phaseTime[p];
+        totalMs += ps->updateTime;
+        particles += ps->particles.size();
+        awake += ps->numAwake;
+        steps++;
+    }
+
+    if(replayed){
+        result.recording = ofFilePath::getFileName(path);
+        result.exact = recording.matchesEnd(*ps);
+        result.mode = getModeName(recording.particleMode);
+        result.numParticles = ps->particles.size();
+        result.numThreads = recording.numThreads;
+        result.reorder = ps->reorderUpdates > 0 || ps->reorderDisorder > 0;
+        result.width = recording.width;
+        result.height = recording.height;
+        result.frames = steps;
+        result.meanParticles = particles/steps;
+        result.meanAwake = awake/steps;
+        for(int p = 0; p < NUM_UPDATE_PHASES; p++) result.phaseNs[p] = (particles > 0) ? phaseMs[p]*1e6/particles : 0;
+        result.totalNs = (particles > 0) ? totalMs*1e6/particles : 0;
+        result.frameMs = totalMs/steps;
+    }
+
+    delete ps;
+    contour.threadPool = NULL;
+    return replayed;
+}
+
+// Runs every mode with each of the kernels the CPU supports and compares the
+// particles with the ones of the plain C++ kernels, which have to be the same
+vector<ParticleBenchmark::KernelCheck> ParticleBenchmark::checkKernels(){
+    ParticleMode modes[] = {EMITTER, GRID, BOIDS, ANIMATIONS};
+    ThreadPool threadPool;
+    threadPool.setup(threadCounts.back());
+
+    vector<KernelCheck> checks;
+    const vector<ParticleKernels>& kernels = ParticleKernels::getSupported();
+    for(unsigned int k = 0; k < kernels.size(); k++){
+        ParticleKernels::select(k);
+        uint64_t hash = 14695981039346656037ULL; // FNV-1a of the snapshots of all the modes
+        for(int m = 0; m < 4; m++){
+            int width, height;
+            ParticleSystem* ps = create(modes[m], KERNEL_CHECK_PARTICLES, threadPool, width, height);
+            for(int f = 0; f < KERNEL_CHECK_FRAMES; f++){
+                updateInput((f+1)*BENCHMARK_DT, width, height);
+                ps->update(BENCHMARK_DT, markers, contour, fluid);
+            }
+            ofBuffer snapshot;
+            ps->saveSnapshot(snapshot);
+            const unsigned char* bytes = (const unsigned char*)snapshot.getData();
+            for(size_t b = 0; b < snapshot.size(); b++) hash = (hash ^ bytes[b]) * 1099511628211ULL;
+            delete ps;
+        }
+
+        KernelCheck check;
+        check.name = kernels[k].name;
+        check.hash = hash;
+        check.same = checks.empty() || hash == checks[0].hash;
+        checks.push_back(check);
+    }
+    ParticleKernels::select(-1);
+    return checks;
+}
+
+// System of the mode in a space with the same density for any number of
+// particles, with the same particles and input for every thread count
+ParticleSystem* ParticleBenchmark::create(ParticleMode mode, int numParticles, ThreadPool& threadPool, int& width, int& height){
+    int cols = MAX((int)round(sqrt(numParticles*4.0/3.0)), 1);
+    int rows = MAX((int)round((float)numParticles/cols), 1);
+    width = cols*BENCHMARK_SPACING;
+    height = rows*BENCHMARK_SPACING;
+
+    contour.width = width;
+    contour.height = height;
+    contour.threadPool = &threadPool;
+    contour.distanceField.setup(width, height, MAX(2.0, 2.0*width/640.0)); // same cells as the app
+
+    ofSeedRandom(randomSeed);
+    markers.clear();
+    updateInput(0, width, height);
+
+    ParticleSystem* ps = new ParticleSystem();
+    configure(*ps, mode, numParticles, width, height);
+    ps->threadPool = &threadPool;
+    return ps;
+}
+
+// Settings of each mode with all the input on
+void ParticleBenchmark::configure(ParticleSystem& ps, ParticleMode mode, int numParticles, int width, int height){
+    // (1) what the setup reads
+    ps.maxParticles = numParticles + numParticles/20;  // some room for the emitter
+    ps.nParticles = numParticles;                       // boids
+    ps.gridRes = BENCHMARK_SPACING;                     // grid
+    ps.setAnimation(SNOW);
+    ps.setup(mode, width, height);
+    ps.setSeed(randomSeed);
+
+    // (2) active without the fade in, which would set it up again
+    ps.isActive = true;
+    ps.activeStarted = true;
+    ps.opacity = ps.maxOpacity;
+
+    // (3) input
+    ps.interact = true;
+    ps.markersInput = (mode != ANIMATIONS);
+    ps.contourInput = true;
+    if(mode == ANIMATIONS) ps.bounceInteraction = true; // snow lands on the silhouettes
+    else ps.repulseInteraction = true;
+
+    // (4) the emitter and the snow start full, with particles that outlive the
+    // benchmark and are spread over all the space (snow is born above it)
+    if(mode == EMITTER || mode == ANIMATIONS){
+        ps.lifetime = 1000.0;
+        ps.lifetimeRnd = 0.0;
+        ps.addParticles(numParticles);
+        Particles& p = ps.particles;
+        for(int i = 0; i < p.size(); i++){
+            p.y[i] = p.prevY[i] = p.iniY[i] = ps.getRandom().uniform(height);
+        }
+    }
+}
+
+// Markers on Lissajous curves and two silhouettes that move and wobble
+void ParticleBenchmark::updateInput(float t, int width, int height){
+    markers.resize(BENCHMARK_MARKERS);
+    for(int m = 0; m < BENCHMARK_MARKERS; m++){
+        float fx = 0.3 + 0.1*m;
+        float fy = 0.4 + 0.07*m;
+        ofPoint pos(width*(0.5 + 0.4*sin(TWO_PI*fx*t + m*1.3)), height*(0.5 + 0.4*sin(TWO_PI*fy*t)));
+        irMarker& marker = markers[m];
+        marker.previousPos = marker.hasDisappeared ? pos : marker.smoothPos;
+        marker.currentPos = pos;
+        marker.smoothPos = pos;
+        marker.velocity = marker.smoothPos - marker.previousPos;
+        marker.hasDisappeared = false;
+    }
+
+    silhouettes.resize(2);
+    for(int s = 0; s < 2; s++){
+        ofPolyline& silhouette = silhouettes[s];
+        silhouette.clear();
+        float cx = width*(0.3 + 0.4*s + 0.1*sin(0.5*t + s));
+        float cy = height*0.55;
+        float rx = height*0.12;
+        float ry = height*0.3;
+        for(int k = 0; k < BENCHMARK_VERTICES; k++){
+            float a = TWO_PI*k/BENCHMARK_VERTICES;
+            float wobble = 1.0 + 0.15*sin(5*a + 2*t + s) + 0.1*sin(3*a - t);
+            silhouette.addVertex(cx + rx*wobble*cos(a), cy + ry*wobble*sin(a));
+        }
+        silhouette.close();
+    }
+    contour.setContours(silhouettes);
+}
+
+string ParticleBenchmark::toJson(const vector<Result>& results, const vector<KernelCheck>& checks) const{
+    string json = "{\n";
+    json += "  \"phases\": [";
+    for(int p = 0; p < NUM_UPDATE_PHASES; p++){
+        json += string(p > 0 ? ", " : "") + "\"" + phaseNames[p] + "\"";
+    }
+    json += "],\n";
+    json += "  \"kernels\": [";
+    for(unsigned int k = 0; k < checks.size(); k++){
+        json += string(k > 0 ? ", " : "") + "{\"name\": \"" + checks[k].name + "\", \"hash\": \"" + ofToHex(checks[k].hash)
+              + "\", \"same\": " + (checks[k].same ? "true" : "false") + "}";
+    }
+    json += "],\n";
+    json += "  \"results\": [\n";
+    for(unsigned int i = 0; i < results.size(); i++){
+        const Result& r = results[i];
+
+        // speedup over the same case with one thread, and over the same case unsorted
+        float speedup = 1.0;
+        float reorderSpeedup = 1.0;
+        for(unsigned int j = 0; j < results.size(); j++){
+            const Result& base = results[j];
+            if(!base.recording.empty() || base.mode != r.mode || base.numParticles != r.numParticles || r.frameMs <= 0) continue;
+            if(base.numThreads == 1 && base.reorder == r.reorder) speedup = base.frameMs / r.frameMs;
+            if(base.numThreads == r.numThreads && !base.reorder) reorderSpeedup = base.frameMs / r.frameMs;
+        }
+
+        json += "    {";
+        if(!r.recording.empty()) json += "\"recording\": \"" + r.recording + "\", \"exact\": " + (r.exact ? "true" : "false") + ", ";
+        json += "\"mode\": \"" + r.mode + "\", \"particles\": " + ofToString(r.numParticles)
+              + ", \"threads\": " + ofToString(r.numThreads) + ", \"reorder\": " + (r.reorder ? "true" : "false")
+              + ", \"width\": " + ofToString(r.width) + ", \"height\": " + ofToString(r.height)
+              + ", \"frames\": " + ofToString(r.frames)
+              + ", \"living\": " + ofToString(r.meanParticles, 0) + ", \"awake\": " + ofToString(r.meanAwake, 0)
+              + ",\n     \"ns_per_particle\": {";
+        for(int p = 0; p < NUM_UPDATE_PHASES; p++){
+            json += "\"" + string(phaseNames[p]) + "\": " + ofToString(r.phaseNs[p], 2) + ", ";
+        }
+        json += "\"total\": " + ofToString(r.totalNs, 2) + "}"
+              + ", \"ms_per_frame\": " + ofToString(r.frameMs, 3)
+              + ", \"speedup\": " + ofToString(speedup, 2);
+        if(r.recording.empty()) json += ", \"reorder_speedup\": " + ofToString(reorderSpeedup, 2);
+        json += "}";
+        json += (i+1 < results.size()) ? ",\n" : "\n";
+    }
+    json += "  ]\n}";
+    return json;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include "ParticleSystem.h"
+#include "ParticleRecording.h"
+#include "ThreadPool.h"
+#include "ParticleKernels.h"
+#include "irMarker.h"
+#include "Contour.h"
+#include "Fluid.h"
+
+// Update of the particle systems without the Kinect, the image sequences or
+// the rest of the app. Built instead of the app with CREA_BENCHMARK defined
+// (make CREA_BENCHMARK=1).
+//
+// Every particle mode (emitter, grid, boids and snow) runs with 1k, 10k, 100k
+// and 1M particles, driven by markers moving on Lissajous curves and by two
+// wobbling silhouettes. The space grows with the number of particles so the
+// density, and the work of each particle, stays the same. Each case runs with
+// 1, 2, 4... threads up to the number of cores, with the particles sorted in
+// memory in Z-order from time to time (as in the app) and without it.
+//
+// The recordings made in the app (data/recordings/*.particles) are replayed
+// too, with the threads they were recorded with, to reproduce a slow moment of
+// a show. A replay is exact when it ends in the same state as the recording.
+//
+// Before timing anything, every mode runs with each of the SIMD kernels the
+// CPU supports, to check that they give the same particles as plain C++.
+//
+// The result is the time per particle of each phase of the update, the
+// speedup of every thread count over one thread and the speedup of the sorted
+// particles over the unsorted ones, with the hash of the particles of each
+// kernel. It is written as JSON to the
+// standard output and to data/benchmark.json.
+class ParticleBenchmark : public ofBaseApp
+{
+    public:
+        ParticleBenchmark();
+
+        void setup();
+
+    protected:
+        struct Result{
+            string recording;       // File of the replayed recording (empty for the synthetic cases)
+            bool exact;             // Replay ended in the recorded state?
+            string mode;            // Particle mode
+            int numParticles;       // Particles asked for
+            int numThreads;         // Threads of the pool
+            bool reorder;           // Particles sorted in memory in Z-order?
+            int width, height;      // Size of the space
+            int frames;             // Frames measured
+            float meanParticles;    // Average living particles in the measured frames
+            float meanAwake;        // Average particles updated in the measured frames
+            float phaseNs[NUM_UPDATE_PHASES];   // Time of each phase per particle (ns)
+            float totalNs;          // Time of the whole update per particle (ns)
+            float frameMs;          // Time of the whole update per frame (ms)
+        };
+
+        struct KernelCheck{
+            string name;            // Instruction set of the kernels
+            uint64_t hash;          // Hash of the particles of every mode after the check
+            bool same;              // Same particles as the plain C++ kernels?
+        };
+
+        Result run(ParticleMode mode, int numParticles, int numThreads, bool reorder);
+        vector<KernelCheck> checkKernels();
+        ParticleSystem* create(ParticleMode mode, int numParticles, ThreadPool& threadPool, int& width, int& height);
+        bool replay(const string path, Result& result);
+        void configure(ParticleSystem& ps, ParticleMode mode, int numParticles, int width, int height);
+        void updateInput(float t, int width, int height);
+        string toJson(const vector<Result>& results, const vector<KernelCheck>& checks) const;
+        //--------------------------------------------------------------
+        vector<int> particleCounts;     // Number of particles of each case
+        vector<int> threadCounts;       // Number of threads of each case
+        int warmupFrames;               // Frames run before measuring with 1M particles (more with less)
+        int measuredFrames;             // Frames measured with 1M particles (more with less)
+        uint64_t randomSeed;            // Seed of the particles and of the input
+        //--------------------------------------------------------------
+        vector<irMarker> markers;       // Synthetic markers
+        Contour contour;                // Synthetic silhouettes
+        Fluid fluid;                    // Not simulated, the particles only read it
+        vector<ofPolyline> silhouettes;
+};
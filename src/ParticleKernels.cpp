@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "ParticleKernels.h"
+#include "Particle.h"
+#include <atomic>
+
+#if !defined(CREA_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CREA_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+//--------------------------------------------------------------
+// Plain C++ kernels, also used for the particles left after the last full vector
+
+static void integrateScalar(Particles& p, int begin, int end, float dt){
+    float friction = p.params.friction;
+    float maxSpeedSqrd = p.params.maxSpeed*p.params.maxSpeed;
+    for(int i = begin; i < end; i++){
+        float invMass = 1.0f/p.mass[i];
+        p.vx[i] += p.fx[i]*invMass*dt;  // Newton's second law F = m*a and Euler's method
+        p.vy[i] += p.fy[i]*invMass*dt;
+        p.vx[i] *= friction;            // Decay velocity
+        p.vy[i] *= friction;
+        if(p.params.limitSpeed){
+            float speedSqrd = p.vx[i]*p.vx[i] + p.vy[i]*p.vy[i];
+            if(speedSqrd > maxSpeedSqrd){
+                float scale = p.params.maxSpeed / sqrtf(speedSqrd);
+                p.vx[i] *= scale;
+                p.vy[i] *= scale;
+            }
+        }
+        p.x[i] += p.vx[i]*dt;
+        p.y[i] += p.vy[i]*dt;
+        p.fx[i] = 0;                    // Restart force
+        p.fy[i] = 0;
+        p.age[i] += dt;
+    }
+}
+
+static void addGravityScalar(Particles& p, int begin, int end, float gx, float gy){
+    for(int i = begin; i < end; i++){
+        p.fx[i] += gx*p.mass[i];
+        p.fy[i] += gy*p.mass[i];
+    }
+}
+
+static void returnToOriginScalar(Particles& p, int begin, int end, float radiusSqrd, float scale){
+    for(int i = begin; i < end; i++){
+        // (1) calculate the direction to origin position and distance
+        float dx = p.iniX[i] - p.x[i];
+        float dy = p.iniY[i] - p.y[i];
+        float distSqrd = dx*dx + dy*dy;
+        if(distSqrd == 0) continue;
+
+        // (2) set force depending on the distance
+        float pct = 1;
+        if(distSqrd < radiusSqrd){
+            pct = distSqrd / radiusSqrd; // decrease force when closer to origin
+        }
+
+        // (3) update force
+        float F = scale * pct / sqrtf(distSqrd);
+        p.fx[i] += dx * F;
+        p.fy[i] += dy * F;
+    }
+}
+
+#ifdef CREA_X86_KERNELS
+//--------------------------------------------------------------
+// SSE2 kernels, 4 particles at a time
+
+__attribute__((target("sse2")))
+static void integrateSSE(Particles& p, int begin, int end, float dt){
+    float *x = p.x.data(), *y = p.y.data(), *vx = p.vx.data(), *vy = p.vy.data();
+    float *fx = p.fx.data(), *fy = p.fy.data(), *age = p.age.data();
+    const float *mass = p.mass.data();
+
+    __m128 vdt = _mm_set1_ps(dt);
+    __m128 friction = _mm_set1_ps(p.params.friction);
+    __m128 maxSpeed = _mm_set1_ps(p.params.maxSpeed);
+    __m128 maxSpeedSqrd = _mm_set1_ps(p.params.maxSpeed*p.params.maxSpeed);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    int i = begin;
+    for(; i+4 <= end; i += 4){
+        __m128 invMass = _mm_div_ps(one, _mm_loadu_ps(mass+i));
+        __m128 velX = _mm_add_ps(_mm_loadu_ps(vx+i), _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(fx+i), invMass), vdt));
+        __m128 velY = _mm_add_ps(_mm_loadu_ps(vy+i), _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(fy+i), invMass), vdt));
+        velX = _mm_mul_ps(velX, friction);
+        velY = _mm_mul_ps(velY, friction);
+        if(p.params.limitSpeed){
+            __m128 speedSqrd = _mm_add_ps(_mm_mul_ps(velX, velX), _mm_mul_ps(velY, velY));
+            __m128 tooFast = _mm_cmpgt_ps(speedSqrd, maxSpeedSqrd);
+            __m128 scale = _mm_div_ps(maxSpeed, _mm_sqrt_ps(speedSqrd));
+            scale = _mm_or_ps(_mm_and_ps(tooFast, scale), _mm_andnot_ps(tooFast, one));
+            velX = _mm_mul_ps(velX, scale);
+            velY = _mm_mul_ps(velY, scale);
+        }
+        _mm_storeu_ps(vx+i, velX);
+        _mm_storeu_ps(vy+i, velY);
+        _mm_storeu_ps(x+i, _mm_add_ps(_mm_loadu_ps(x+i), _mm_mul_ps(velX, vdt)));
+        _mm_storeu_ps(y+i, _mm_add_ps(_mm_loadu_ps(y+i), _mm_mul_ps(velY, vdt)));
+        _mm_storeu_ps(fx+i, zero);
+        _mm_storeu_ps(fy+i, zero);
+        _mm_storeu_ps(age+i, _mm_add_ps(_mm_loadu_ps(age+i), vdt));
+    }
+    integrateScalar(p, i, end, dt);
+}
+
+__attribute__((target("sse2")))
+static void addGravitySSE(Particles& p, int begin, int end, float gx, float gy){
+    float *fx = p.fx.data(), *fy = p.fy.data();
+    const float *mass = p.mass.data();
+    __m128 vgx = _mm_set1_ps(gx);
+    __m128 vgy = _mm_set1_ps(gy);
+
+    int i = begin;
+    for(; i+4 <= end; i += 4){
+        __m128 m = _mm_loadu_ps(mass+i);
+        _mm_storeu_ps(fx+i, _mm_add_ps(_mm_loadu_ps(fx+i), _mm_mul_ps(vgx, m)));
+        _mm_storeu_ps(fy+i, _mm_add_ps(_mm_loadu_ps(fy+i), _mm_mul_ps(vgy, m)));
+    }
+    addGravityScalar(p, i, end, gx, gy);
+}
+
+__attribute__((target("sse2")))
+static void returnToOriginSSE(Particles& p, int begin, int end, float radiusSqrd, float scale){
+    const float *x = p.x.data(), *y = p.y.data(), *iniX = p.iniX.data(), *iniY = p.iniY.data();
+    float *fx = p.fx.data(), *fy = p.fy.data();
+    __m128 vradiusSqrd = _mm_set1_ps(radiusSqrd);
+    __m128 vscale = _mm_set1_ps(scale);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    int i = begin;
+    for(; i+4 <= end; i += 4){
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(iniX+i), _mm_loadu_ps(x+i));
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(iniY+i), _mm_loadu_ps(y+i));
+        __m128 distSqrd = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 close = _mm_cmplt_ps(distSqrd, vradiusSqrd);
+        __m128 pct = _mm_or_ps(_mm_and_ps(close, _mm_div_ps(distSqrd, vradiusSqrd)), _mm_andnot_ps(close, one));
+        __m128 F = _mm_div_ps(_mm_mul_ps(vscale, pct), _mm_sqrt_ps(distSqrd));
+        F = _mm_and_ps(F, _mm_cmpneq_ps(distSqrd, zero)); // particles at the origin get no force
+        _mm_storeu_ps(fx+i, _mm_add_ps(_mm_loadu_ps(fx+i), _mm_mul_ps(dx, F)));
+        _mm_storeu_ps(fy+i, _mm_add_ps(_mm_loadu_ps(fy+i), _mm_mul_ps(dy, F)));
+    }
+    returnToOriginScalar(p, i, end, radiusSqrd, scale);
+}
+
+//--------------------------------------------------------------
+// AVX2 kernels, 8 particles at a time. Compiled for AVX2 only in these
+// functions so the rest of the app still runs on older CPUs
+
+__attribute__((target("avx2")))
+static void integrateAVX2(Particles& p, int begin, int end, float dt){
+    float *x = p.x.data(), *y = p.y.data(), *vx = p.vx.data(), *vy = p.vy.data();
+    float *fx = p.fx.data(), *fy = p.fy.data(), *age = p.age.data();
+    const float *mass = p.mass.data();
+
+    __m256 vdt = _mm256_set1_ps(dt);
+    __m256 friction = _mm256_set1_ps(p.params.friction);
+    __m256 maxSpeed = _mm256_set1_ps(p.params.maxSpeed);
+    __m256 maxSpeedSqrd = _mm256_set1_ps(p.params.maxSpeed*p.params.maxSpeed);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+
+    int i = begin;
+    for(; i+8 <= end; i += 8){
+        __m256 invMass = _mm256_div_ps(one, _mm256_loadu_ps(mass+i));
+        __m256 velX = _mm256_add_ps(_mm256_loadu_ps(vx+i), _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(fx+i), invMass), vdt));
+        __m256 velY = _mm256_add_ps(_mm256_loadu_ps(vy+i), _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(fy+i), invMass), vdt));
+        velX = _mm256_mul_ps(velX, friction);
+        velY = _mm256_mul_ps(velY, friction);
+        if(p.params.limitSpeed){
+            __m256 speedSqrd = _mm256_add_ps(_mm256_mul_ps(velX, velX), _mm256_mul_ps(velY, velY));
+            __m256 tooFast = _mm256_cmp_ps(speedSqrd, maxSpeedSqrd, _CMP_GT_OQ);
+            __m256 scale = _mm256_div_ps(maxSpeed, _mm256_sqrt_ps(speedSqrd));
+            scale = _mm256_blendv_ps(one, scale, tooFast);
+            velX = _mm256_mul_ps(velX, scale);
+            velY = _mm256_mul_ps(velY, scale);
+        }
+        _mm256_storeu_ps(vx+i, velX);
+        _mm256_storeu_ps(vy+i, velY);
+        _mm256_storeu_ps(x+i, _mm256_add_ps(_mm256_loadu_ps(x+i), _mm256_mul_ps(velX, vdt)));
+        _mm256_storeu_ps(y+i, _mm256_add_ps(_mm256_loadu_ps(y+i), _mm256_mul_ps(velY, vdt)));
+        _mm256_storeu_ps(fx+i, zero);
+        _mm256_storeu_ps(fy+i, zero);
+        _mm256_storeu_ps(age+i, _mm256_add_ps(_mm256_loadu_ps(age+i), vdt));
+    }
+    integrateScalar(p, i, end, dt);
+}
+
+__attribute__((target("avx2")))
+static void addGravityAVX2(Particles& p, int begin, int end, float gx, float gy){
+    float *fx = p.fx.data(), *fy = p.fy.data();
+    const float *mass = p.mass.data();
+    __m256 vgx = _mm256_set1_ps(gx);
+    __m256 vgy = _mm256_set1_ps(gy);
+
+    int i = begin;
+    for(; i+8 <= end; i += 8){
+        __m256 m = _mm256_loadu_ps(mass+i);
+        _mm256_storeu_ps(fx+i, _mm256_add_ps(_mm256_loadu_ps(fx+i), _mm256_mul_ps(vgx, m)));
+        _mm256_storeu_ps(fy+i, _mm256_add_ps(_mm256_loadu_ps(fy+i), _mm256_mul_ps(vgy, m)));
+    }
+    addGravityScalar(p, i, end, gx, gy);
+}
+
+__attribute__((target("avx2")))
+static void returnToOriginAVX2(Particles& p, int begin, int end, float radiusSqrd, float scale){
+    const float *x = p.x.data(), *y = p.y.data(), *iniX = p.iniX.data(), *iniY = p.iniY.data();
+    float *fx = p.fx.data(), *fy = p.fy.data();
+    __m256 vradiusSqrd = _mm256_set1_ps(radiusSqrd);
+    __m256 vscale = _mm256_set1_ps(scale);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+
+    int i = begin;
+    for(; i+8 <= end; i += 8){
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(iniX+i), _mm256_loadu_ps(x+i));
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(iniY+i), _mm256_loadu_ps(y+i));
+        __m256 distSqrd = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 close = _mm256_cmp_ps(distSqrd, vradiusSqrd, _CMP_LT_OQ);
+        __m256 pct = _mm256_blendv_ps(one, _mm256_div_ps(distSqrd, vradiusSqrd), close);
+        __m256 F = _mm256_div_ps(_mm256_mul_ps(vscale, pct), _mm256_sqrt_ps(distSqrd));
+        F = _mm256_and_ps(F, _mm256_cmp_ps(distSqrd, zero, _CMP_NEQ_UQ)); // particles at the origin get no force
+        _mm256_storeu_ps(fx+i, _mm256_add_ps(_mm256_loadu_ps(fx+i), _mm256_mul_ps(dx, F)));
+        _mm256_storeu_ps(fy+i, _mm256_add_ps(_mm256_loadu_ps(fy+i), _mm256_mul_ps(dy, F)));
+    }
+    returnToOriginScalar(p, i, end, radiusSqrd, scale);
+}
+#endif
+
+//--------------------------------------------------------------
+ParticleKernels::ParticleKernels(){
+    name            = "C++";
+    integrate       = integrateScalar;
+    addGravity      = addGravityScalar;
+    returnToOrigin  = returnToOriginScalar;
+}
+
+vector<ParticleKernels> ParticleKernels::findSupported(){
+    vector<ParticleKernels> supported;
+    supported.push_back(ParticleKernels());
+#ifdef CREA_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")){
+        ParticleKernels kernels;
+        kernels.name            = "SSE2";
+        kernels.integrate       = integrateSSE;
+        kernels.addGravity      = addGravitySSE;
+        kernels.returnToOrigin  = returnToOriginSSE;
+        supported.push_back(kernels);
+    }
+    if(__builtin_cpu_supports("avx2")){
+        ParticleKernels kernels;
+        kernels.name            = "AVX2";
+        kernels.integrate       = integrateAVX2;
+        kernels.addGravity      = addGravityAVX2;
+        kernels.returnToOrigin  = returnToOriginAVX2;
+        supported.push_back(kernels);
+    }
+#endif
+    return supported;
+}
+
+static atomic<int> selectedKernels(-1);   // Index of the kernels in use, -1 for the fastest
+
+const ParticleKernels& ParticleKernels::get(){
+    const vector<ParticleKernels>& supported = getSupported();
+    int i = selectedKernels;
+    return (i >= 0 && i < (int)supported.size()) ? supported[i] : supported.back();
+}
+
+const vector<ParticleKernels>& ParticleKernels::getSupported(){
+    static const vector<ParticleKernels> supported = findSupported();
+    return supported;
+}
+
+void ParticleKernels::select(int i){
+    selectedKernels = i;
+}
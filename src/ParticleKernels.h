@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+
+class Particles;
+
+// Disable the SIMD kernels and always use the plain C++ loops
+//#define CREA_NO_SIMD
+
+// Loops over the packed particle arrays that run for every particle every
+// frame. The first call to get() checks the CPU and picks AVX2 (8 particles
+// per instruction), SSE2 (4 particles) or plain C++. All versions do the same
+// operations in the same order, so they give exactly the same result (the
+// benchmark checks it).
+class ParticleKernels
+{
+    public:
+        static const ParticleKernels& get();
+        // Kernels this CPU can run, plain C++ first and the fastest last
+        static const vector<ParticleKernels>& getSupported();
+        // Use the supported kernels i from now on (-1 for the fastest), to compare them
+        static void select(int i);
+
+        string name;    // Instruction set of the kernels
+
+        // Euler step: apply force and friction, limit speed, move and reset force
+        void (*integrate)(Particles& p, int begin, int end, float dt);
+        // Force proportional to the mass of each particle
+        void (*addGravity)(Particles& p, int begin, int end, float gx, float gy);
+        // Force towards the initial position of each particle
+        void (*returnToOrigin)(Particles& p, int begin, int end, float radiusSqrd, float scale);
+
+    protected:
+        ParticleKernels();
+        static vector<ParticleKernels> findSupported();
+};
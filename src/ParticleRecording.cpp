@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "ParticleRecording.h"
+
+#define RECORDING_MAGIC 0x52505243  // "CRPR" at the start of the recordings
+#define RECORDING_VERSION 2         // Changes when the recording format changes
+
+ParticleRecording::ParticleRecording(){
+    isRecording     = false;
+    isFull          = false;
+    maxBytes        = 256*1024*1024;    // Four systems recording are at most 1 GB
+    recordedBytes   = 0;
+    particleMode    = EMITTER;
+    width           = 0;
+    height          = 0;
+    numThreads      = 1;
+}
+
+void ParticleRecording::start(ParticleSystem& ps, int numThreads){
+    particleMode = ps.particleMode;
+    width = ps.width;
+    height = ps.height;
+    this->numThreads = numThreads;
+
+    ps.saveSnapshot(startSnapshot);
+    endSnapshot.clear();
+    steps.clear();
+    recordedBytes = 0;
+    isFull = false;
+    isRecording = true;
+}
+
+// Called before each update of the system with what the update is given.
+// When the steps reach maxBytes the recording ends there, with the state
+// before this update, and the next steps are not kept until stop()
+void ParticleRecording::record(ParticleSystem& ps, float dt, vector<irMarker>& markers, Contour& contour, Fluid& fluid){
+    if(!isRecording || isFull) return;
+    if(recordedBytes >= maxBytes){
+        ps.saveSnapshot(endSnapshot);
+        isFull = true;
+        ofLogWarning("ParticleRecording") << "Recording cut after " << steps.size() << " steps, it reached " << maxBytes/(1024*1024) << " MB";
+        return;
+    }
+    steps.push_back(ofBuffer());
+    SnapshotArchive archive(steps.back(), false);
+    transferInput(archive, ps, dt, markers, contour, fluid);
+    recordedBytes += steps.back().size();
+}
+
+void ParticleRecording::stop(ParticleSystem& ps){
+    if(!isRecording) return;
+    if(!isFull) ps.saveSnapshot(endSnapshot);
+    isRecording = false;
+}
+
+bool ParticleRecording::save(const string path){
+    ofBuffer buffer;
+    SnapshotArchive archive(buffer, false);
+    transferHeader(archive);
+    uint32_t numSteps = steps.size();
+    archive.transfer(numSteps);
+    for(uint32_t s = 0; s < numSteps; s++) archive.transfer(steps[s]);
+    return ofBufferToFile(path, buffer, true);
+}
+
+bool ParticleRecording::load(const string path){
+    ofBuffer buffer = ofBufferFromFile(path, true);
+    SnapshotArchive archive(buffer, true);
+    transferHeader(archive);
+    uint32_t numSteps = 0;
+    archive.transfer(numSteps);
+    if(!archive.hasBytes((size_t)numSteps*sizeof(uint64_t))) archive.setInvalid(); // each step starts with its size
+    if(archive.isValid()){
+        steps.assign(numSteps, ofBuffer());
+        for(uint32_t s = 0; s < numSteps; s++) archive.transfer(steps[s]);
+    }
+
+    if(!archive.isValid()){
+        ofLogWarning("ParticleRecording") << path << " is not a particles recording or it is broken";
+        steps.clear();
+        return false;
+    }
+    isRecording = false;
+    return true;
+}
+
+bool ParticleRecording::restart(ParticleSystem& ps){
+    return ps.loadSnapshot(startSnapshot);
+}
+
+bool ParticleRecording::replayStep(int step, ParticleSystem& ps, vector<irMarker>& markers, Contour& contour, Fluid& fluid){
+    if(step < 0 || step >= (int)steps.size()) return false;
+    SnapshotArchive archive(steps[step], true);
+    float dt = 0;
+    transferInput(archive, ps, dt, markers, contour, fluid);
+    if(!archive.isValid()) return false;
+    ps.update(dt, markers, contour, fluid);
+    return true;
+}
+
+bool ParticleRecording::matchesEnd(ParticleSystem& ps){
+    ofBuffer current;
+    ps.saveSnapshot(current);
+    return current.size() == endSnapshot.size() && memcmp(current.getData(), endSnapshot.getData(), current.size()) == 0;
+}
+
+void ParticleRecording::transferHeader(SnapshotArchive& archive){
+    uint32_t magic = RECORDING_MAGIC;
+    uint32_t version = RECORDING_VERSION;
+    int32_t mode = particleMode;
+    archive.transfer(magic);
+    archive.transfer(version);
+    archive.transfer(mode);
+    archive.transfer(width);
+    archive.transfer(height);
+    archive.transfer(numThreads);
+    if(magic != RECORDING_MAGIC || version != RECORDING_VERSION) archive.setInvalid();
+    if(!archive.isValid()) return;
+    particleMode = (ParticleMode)mode;
+    archive.transfer(startSnapshot);
+    archive.transfer(endSnapshot);
+}
+
+// Writes the input of an update or reads it into the system, the markers,
+// the contour and the fluid
+void ParticleRecording::transferInput(SnapshotArchive& archive, ParticleSystem& ps, float& dt, vector<irMarker>& markers, Contour& contour, Fluid& fluid){
+    // (1) settings and step
+    ps.transferSettings(archive);
+    archive.transfer(dt);
+
+    // (2) markers, only what the particles read
+    uint32_t numMarkers = markers.size();
+    archive.transfer(numMarkers);
+    if(archive.isReading()){
+        if(!archive.hasBytes((size_t)numMarkers*4*sizeof(ofPoint))) archive.setInvalid();
+        if(!archive.isValid()) return;
+        markers.resize(numMarkers);
+    }
+    for(uint32_t m = 0; m < numMarkers; m++){
+        irMarker& marker = markers[m];
+        archive.transfer(marker.currentPos);
+        archive.transfer(marker.previousPos);
+        archive.transfer(marker.smoothPos);
+        archive.transfer(marker.velocity);
+        archive.transfer(marker.hasDisappeared);
+    }
+
+    // (3) silhouettes. Their boxes come from the depth image and not from the
+    // polylines, so they are kept too
+    vector<ofPolyline> vMaskContours = contour.vMaskContours;
+    archive.transfer(contour.contours);
+    archive.transfer(vMaskContours);
+    uint32_t numRects = contour.boundingRects.size();
+    archive.transfer(numRects);
+    if(archive.isReading()){
+        if(!archive.hasBytes((size_t)numRects*4*sizeof(float))) archive.setInvalid();
+        if(!archive.isValid()) return;
+    }
+    vector<ofRectangle> boundingRects(numRects);
+    for(uint32_t r = 0; r < numRects; r++){
+        ofRectangle& rect = archive.isReading() ? boundingRects[r] : contour.boundingRects[r];
+        float x = rect.x, y = rect.y, w = rect.width, h = rect.height;
+        archive.transfer(x);
+        archive.transfer(y);
+        archive.transfer(w);
+        archive.transfer(h);
+        rect.set(x, y, w, h);
+    }
+    if(archive.isReading() && archive.isValid()){
+        contour.setContours(contour.contours);
+        contour.vMaskContours = vMaskContours;
+        contour.boundingRects = boundingRects;
+    }
+
+    // (4) optical flow and fluid velocities, only when the system reads them
+    uint8_t hasFlow = ps.contourInput && (ps.flowInteraction || ps.emit);
+    uint8_t hasFluid = ps.fluidInteraction;
+    archive.transfer(hasFlow);
+    archive.transfer(hasFluid);
+    if(hasFlow){
+        float scaleFactor = contour.scaleFactor;
+        archive.transfer(scaleFactor);
+        if(archive.isReading()){
+            ofFloatPixels flow;
+            archive.transfer(flow);
+            if(archive.isValid()) contour.setFlowPixels(flow, scaleFactor);
+        }
+        else archive.transfer(contour.getFlowPixels());
+    }
+    if(hasFluid){
+        float scaleFactor = fluid.scaleFactor;
+        archive.transfer(scaleFactor);
+        if(archive.isReading()){
+            ofFloatPixels velocities;
+            archive.transfer(velocities);
+            if(archive.isValid()) fluid.setFluidVelocities(velocities, scaleFactor);
+        }
+        else archive.transfer(fluid.getFluidVelocities());
+    }
+}
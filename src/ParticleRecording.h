@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include "ParticleSystem.h"
+#include "SnapshotArchive.h"
+#include "irMarker.h"
+#include "Contour.h"
+#include "Fluid.h"
+
+// Input of a particle system recorded update by update, to replay it later
+// and get exactly the same particles, for example to run a slow moment of a
+// show again in the benchmark.
+//
+// It starts with a snapshot of the system and keeps, for every update, the
+// settings, the step, the markers and the silhouettes. The optical flow and
+// the fluid velocities are most of the size, so they are only kept when the
+// system reads them, and the recording is cut when the steps reach maxBytes.
+// The snapshot at the end lets the replay check that it got to the same
+// state. The result does not depend on the number of threads, the threads of
+// the recording are kept to replay it in the same conditions.
+class ParticleRecording
+{
+    public:
+        ParticleRecording();
+
+        void start(ParticleSystem& ps, int numThreads);
+        void record(ParticleSystem& ps, float dt, vector<irMarker>& markers, Contour& contour, Fluid& fluid);
+        void stop(ParticleSystem& ps);
+
+        bool save(const string path);
+        bool load(const string path);
+
+        // Replay: restart takes the system to the first snapshot, replayStep
+        // gives it the input of a step and updates it, and matchesEnd compares
+        // it with the last snapshot. The contour needs its distance field setup
+        bool restart(ParticleSystem& ps);
+        bool replayStep(int step, ParticleSystem& ps, vector<irMarker>& markers, Contour& contour, Fluid& fluid);
+        bool matchesEnd(ParticleSystem& ps);
+
+        int getNumSteps() const {return steps.size();}
+        //--------------------------------------------------------------
+        bool isRecording;           // Keep the steps given to record()?
+        bool isFull;                // Reached maxBytes, the steps until stop() are not kept
+        size_t maxBytes;            // Size of the steps where the recording is cut
+        ParticleMode particleMode;  // Mode of the recorded system
+        int width, height;          // Size of the recorded system
+        int numThreads;             // Threads of the update while recording
+
+    protected:
+        void transferHeader(SnapshotArchive& archive);
+        void transferInput(SnapshotArchive& archive, ParticleSystem& ps, float& dt, vector<irMarker>& markers, Contour& contour, Fluid& fluid);
+        //--------------------------------------------------------------
+        ofBuffer startSnapshot;     // State when the recording started
+        ofBuffer endSnapshot;       // State when the recording stopped
+        vector<ofBuffer> steps;     // Settings and input of each update
+        size_t recordedBytes;       // Size of the steps
+};
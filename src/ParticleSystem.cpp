@@ -19,9 +19,20 @@
 
 #include "ParticleSystem.h"
 
-bool comparisonFunction(Particle * a, Particle * b) {
-    return a->pos.x < b->pos.x;
-}
+#define SLEEP_CELL_SIZE 16.0        // Size of the areas woken together
+#define SLEEP_DISTANCE 0.5          // Particles closer than this to their origin
+#define SLEEP_SPEED 0.5             // and slower than this (px/s) fall asleep
+#define AWAKE_RANGE_SIZE 1024       // Maximum particles of an awake range
+#define SNAPSHOT_MAGIC 0x53505243   // "CRPS" at the start of the snapshots
+#define SNAPSHOT_VERSION 3          // Changes when the snapshot format changes
+#define REORDER_CELL_SIZE 8.0       // Particles in the same cell are not sorted among them
+#define REORDER_CHECK_UPDATES 10    // Updates between checks of the disorder
+#define BORN_RATE_FPS 60.0          // bornRate is the number born per frame at this frame rate
+
+// Inputs and behaviors compiled into the interaction kernels, a kernel for each combination.
+// The two marker interactions never go together, so kernels with both are not built
+enum InteractFlags {INTERACT_CLOSEST_MARKER = 1, INTERACT_MARKERS_GRAVITY = 2, INTERACT_CONTOUR = 4,
+                    INTERACT_FLUID = 8, INTERACT_SNOW = 16, NUM_INTERACT_KERNELS = 32};
 
 ParticleSystem::ParticleSystem(){
     isActive            = false;        // Particle system is active?
@@ -50,7 +61,7 @@ ParticleSystem::ParticleSystem(){
     
     // Specific properties
     nParticles          = 300;          // Number of particles born from the beginning
-    bornRate            = 5.0;          // Number of particles born per frame
+    bornRate            = 5.0;          // Number of particles born per frame (at 60 fps)
 
     // Emitter
     emitterSize         = 3.0;          // Size of the emitter area
@@ -61,6 +72,7 @@ ParticleSystem::ParticleSystem(){
 
     // Grid
     gridRes             = 10;           // Resolution of the grid
+    sleepAtRest         = true;         // Skip the particles resting at their origin?
 
     // Flocking
     lowThresh           = 0.1333;       // If dist. ratio lower than lowThresh separate
@@ -80,9 +92,12 @@ ParticleSystem::ParticleSystem(){
     drawLine            = false;        // Draw a line instead of a circle for the particle?
     drawStroke          = false;        // Draw stroke line around particle?
     strokeWidth         = 1.2;          // Stroke line width
+    drawTrails          = false;        // Draw a fading trail behind the particle?
+    trailLength         = 16;           // Positions in the trail (one per simulation step)
     drawConnections     = false;        // Draw a connecting line between close particles?
     connectDist         = 15.0;         // Maximum distance to connect particles with line
     connectWidth        = 1.0;          // Connected line width
+    maxConnections      = 10;           // Maximum number of connected lines per particle
 
     // Physics
     friction            = 5.0;          // Friction to velocity 0~100
@@ -124,15 +139,26 @@ ParticleSystem::ParticleSystem(){
     useFlowRegion       = false;        // Use optical flow region to get the motion velocity?
     useContourArea      = false;        // Use contour area to interact with particles?
     useContourVel       = false;        // Use contour velocities to interact with particles?
-}
 
-ParticleSystem::~ParticleSystem(){
-    // Delete all the particles
-    for (int i = 0; i < particles.size(); i++) {
-        delete particles.at(i);
-        particles.at(i) = NULL;
-    }
-    particles.clear();
+    numParticles        = 0;
+    maxParticles        = 50000;        // Capacity of the particle pool
+    numAwake            = 0;
+
+    particlesRadius     = -1;
+    sleepGridVersion    = -1;           // Build it in the first update
+    sleeping            = false;
+
+    threadPool          = NULL;         // Update everything in the calling thread
+    updateTime          = 0.0;
+    for(int p = 0; p < NUM_UPDATE_PHASES; p++) phaseTime[p] = 0.0;
+    drawTime            = 0.0;
+    loadScale           = 1.0;          // Full load until the frame governor says otherwise
+    interpolation       = 1.0;          // Draw the last update
+    time                = 0.0;
+    reorderUpdates      = 120;          // Sort the particles in memory every 2 seconds
+    reorderDisorder     = 0.2;          // or before, when 20% of them are out of order
+    updatesSinceReorder = 0;
+    bornFraction        = 0.0;
 }
 
 
@@ -143,6 +169,30 @@ void ParticleSystem::setup(ParticleMode particleMode, int width , int height){
     this->width = width;
     this->height = height;
 
+    particles.setup(width, height);
+    particles.reserve(maxParticles);
+    neighborGrid.setup(width, height);
+    connectionsGrid.setup(width, height);
+    markersGrid.setup(width, height);
+    sleepGrid.setup(width, height);
+    spawnSampler.setup(2.0);
+    connectionsMesh.setMode(OF_PRIMITIVE_LINES);
+    connectionsMesh.setUsage(GL_STREAM_DRAW);
+    particlesMesh.setMode(OF_PRIMITIVE_TRIANGLES);
+    particlesMesh.setUsage(GL_STREAM_DRAW);
+    turbulenceField.setup(width, height, 16, 16, 4);
+    if(particleMode == ANIMATIONS){
+        windField.setup(width, height, 16, 16);
+        gustXField.setup(width, height, width, 4, 8);     // only changes with y
+        gustYField.setup(width, height, 16, height, 8);   // only changes with x
+    }
+    particles.params.limitSpeed = (particleMode == BOIDS);
+    particles.params.bounceTop = (particleMode != ANIMATIONS);
+    if(particleMode == ANIMATIONS){
+        if(animation == SNOW) particles.params.damping = 0.05;
+        else particles.params.damping = 0.2;
+    }
+
     if(particleMode == EMITTER){
         emit = true;
         sizeAge             = true;        // Decrease size when particles get older?
@@ -226,7 +276,15 @@ void ParticleSystem::setup(ParticleMode particleMode, int width , int height){
 }
 
 void ParticleSystem::update(float dt, vector<irMarker>& markers, Contour& contour, Fluid& fluid){
-    
+    uint64_t startTime = ofGetElapsedTimeMicros();
+    uint64_t phaseStartTime = startTime;
+    auto endPhase = [&](UpdatePhase phase){
+        uint64_t now = ofGetElapsedTimeMicros();
+        phaseTime[phase] = (now - phaseStartTime) / 1000.0f;
+        phaseStartTime = now;
+    };
+    for(int p = 0; p < NUM_UPDATE_PHASES; p++) phaseTime[p] = 0.0;
+
     // if is active or we are fading out, update particles
     if(isActive || isFadingOut){
         // if it is the first frame where isActive is true and we are not fading out (hack to fix switching all time)
@@ -239,148 +297,96 @@ void ParticleSystem::update(float dt, vector<irMarker>& markers, Contour& contou
             startFadeOut = false;
             opacity = 0.0;
             bornParticles();
+            if(startSnapshot.size() > 0) loadSnapshot(startSnapshot); // settled state of the cue
         }
         
         if(isFadingIn) fadeIn(dt);
         else if(isFadingOut && !isActive) fadeOut(dt); // if it is not active and it is fading out, fade out
         else opacity = maxOpacity;
         
-        // sort particles so it is more effective to do particle/particle interactions
-        sort(particles.begin(), particles.end(), comparisonFunction);
-        
-        // compute radius squareds so we just do it once
-        float interactionRadiusSqrd = interactionRadius*interactionRadius;
+        // compute radius squareds so we just do it once. The frame governor
+        // can make the radii smaller to have less neighbors to look at
+        float flockingRadius = this->flockingRadius * getRadiusScale();
         float flockingRadiusSqrd = flockingRadius * flockingRadius;
 
+        // With more than one thread the particles are split in chunks among the
+        // threads of the pool. Random numbers inside these phases come from
+        // particles.random(), which does not depend on how they are split
+        bool parallel = threadPool != NULL && threadPool->getNumThreads() > 1;
+        time += dt; // not the clock, so a replay sees the same noise
+        particles.params.randomKey = random.next64();
+        updateNoiseFields();
+
         // ---------- (1) Delete inactive particles
-        int i = 0;
-        while (i < particles.size()){
-            if (!particles[i]->isAlive){
-                delete particles.at(i);
-                particles.erase(particles.begin() + i);
-                numParticles--;
-            }
-            else{
-                i++;
-            }
-        }
+        particles.removeDead();
+        numParticles = particles.size();
+        reorderParticles();
 
         // ---------- (2) Calculate specific particle system behavior
-        for(int i = 0; i < particles.size(); i++){
-            if(interact){ // Interact particles with input
-                if(markersInput){
-                    irMarker* closestMarker;
-                    if(particleMode == BOIDS) // get closest marker to particle
-                        closestMarker = getClosestMarker(*particles[i], markers);
-                    else // get closest marker to particle only if particle is inside interaction area
-                        closestMarker = getClosestMarker(*particles[i], markers, interactionRadiusSqrd);
-
-                    // Get direction vector to closest marker
-                    // dir = closestMarker->smoothPos - particles[i]->pos;
-                    // dir.normalize();
-
-                    if(closestMarker != NULL){
-                        if(flowInteraction){
-                            float markerDistSqrd = particles[i]->pos.squareDistance(closestMarker->smoothPos);
-                            float pct = 1 - (markerDistSqrd / interactionRadiusSqrd); // stronger on the inside
-                            particles[i]->addForce(closestMarker->velocity*pct*interactionForce);
-                        }
-                        else if(repulseInteraction) particles[i]->addRepulsionForce(closestMarker->smoothPos, interactionRadiusSqrd, interactionForce);
-                        else if(attractInteraction) particles[i]->addAttractionForce(closestMarker->smoothPos, interactionRadiusSqrd, interactionForce);
-                        else if(seekInteraction){
-                            particles[i]->seek(closestMarker->smoothPos, interactionRadiusSqrd, interactionForce*10.0);
-                        }
-                        else if(gravityInteraction){
-                            particles[i]->addForce(ofPoint(ofRandom(-100, 100), 500.0)*particles[i]->mass);
-                            particles[i]->isTouched = true;
-                        }
-                        else if(bounceInteraction){
-                            unsigned int contourIdx = -1;
-                            ofPoint closestPointInContour = getClosestPointInContour(*particles[i], contour, true, &contourIdx);
-                            if(closestPointInContour != ofPoint(-1, -1)){
-                                if(contourIdx != -1) particles[i]->contourBounce(contour.contours[contourIdx]);
-                            }
-                        }
+        bool returnParticles = returnToOrigin && particleMode == GRID && !gravityInteraction;
+        bool markersContacts = interact && markersInput && particleMode != BOIDS;
+
+        // particles resting at their origin are skipped until some input wakes them
+        bool sleep = canSleep();
+        if(sleep) wakeParticles(markers, contour, fluid);
+        buildAwakeRanges(sleep);
+        endPhase(PHASE_PREPARE);
+
+        if(markersContacts) gatherMarkerContacts(markers);
+        InteractKernel interactKernel = getInteractKernel();
+        forEachAwakeRange(parallel, [&](int begin, int end){
+            (this->*interactKernel)(begin, end, markers, contour, fluid);
+            if(returnParticles) particles.returnToOrigin(begin, end, 100, returnToOriginForce);
+        });
+        if(markersContacts){
+            if(parallel){ // each contact is a different particle
+                threadPool->parallelFor(markerContacts.size(), [&](int begin, int end){
+                    for(int k = begin; k < end; k++){
+                        const MarkerContact& c = markerContacts[k];
+                        interactMarker(c.particle, markers[c.marker], c.distSqrd, contour);
                     }
-                    else if(gravityInteraction && particles[i]->isTouched){
-                        particles[i]->addForce(ofPoint(0, 500.0)*particles[i]->mass);
-                    }
-                }
-                if(contourInput){
-                    unsigned int contourIdx = -1;
-                    ofPoint closestPointInContour;
-                    if(particleMode == BOIDS && seekInteraction) // get closest point to particle
-                        closestPointInContour = getClosestPointInContour(*particles[i], contour, false, &contourIdx);
-                    else // get closest point to particle only if particle is inside contour
-                        closestPointInContour = getClosestPointInContour(*particles[i], contour, true, &contourIdx);
-                    
-                    if(flowInteraction){
-                        ofPoint frc = contour.getFlowOffset(particles[i]->pos);
-                        particles[i]->addForce(frc*interactionForce);
-                    }
-
-                    if(closestPointInContour != ofPoint(-1, -1)){
-                        if(repulseInteraction){ // it is an attractForce but result is more logical saying repulse
-                            particles[i]->addAttractionForce(closestPointInContour, interactionRadiusSqrd, interactionForce);
-                        }
-                        else if(attractInteraction){
-                            particles[i]->addRepulsionForce(closestPointInContour, interactionRadiusSqrd, interactionForce);
-                        }
-                        else if(seekInteraction){
-                            particles[i]->seek(closestPointInContour, interactionRadiusSqrd, interactionForce*10.0);
-                        }
-                        else if(gravityInteraction){
-                            particles[i]->addForce(ofPoint(ofRandom(-100, 100), 500.0)*particles[i]->mass);
-                            particles[i]->isTouched = true;
-                        }
-                        else if(bounceInteraction){
-                            if(contourIdx != -1) particles[i]->contourBounce(contour.contours[contourIdx]);
-                        }
-                    }
-                    else if(gravityInteraction && particles[i]->isTouched){
-                        particles[i]->addForce(ofPoint(0.0, 500.0)*particles[i]->mass);
-                    }
-                }
-                if(fluidInteraction){
-                    ofPoint frc = fluid.getFluidOffset(particles[i]->pos);
-                    particles[i]->addForce(frc*interactionForce);
+                }, 64);
+            }
+            else{
+                for(unsigned int k = 0; k < markerContacts.size(); k++){
+                    const MarkerContact& c = markerContacts[k];
+                    interactMarker(c.particle, markers[c.marker], c.distSqrd, contour);
                 }
             }
+        }
 
-            if(flock){ // Flocking behavior
-                particles[i]->flockingRadiusSqrd    =   flockingRadiusSqrd;
-
-                particles[i]->separationStrength    =   separationStrength;
-                particles[i]->alignmentStrength     =   alignmentStrength;
-                particles[i]->attractionStrength    =   attractionStrength;
+        // leave the index clean for the next frame
+        for(unsigned int k = 0; k < markerContacts.size(); k++){
+            markerContactIndex[markerContacts[k].particle] = -1;
+        }
+        markerContacts.clear();
 
-                particles[i]->lowThresh             =   lowThresh;
-                particles[i]->highThresh            =   highThresh;
-                particles[i]->maxSpeed              =   maxSpeed;
-            }
+        if(flock){ // Flocking behavior
+            ParticleParams& params          =   particles.params;
+            params.flockingRadiusSqrd       =   flockingRadiusSqrd;
 
-            if(returnToOrigin && particleMode == GRID && !gravityInteraction) particles[i]->returnToOrigin(100, returnToOriginForce);
+            params.separationStrength       =   separationStrength;
+            params.alignmentStrength        =   alignmentStrength;
+            params.attractionStrength       =   attractionStrength;
 
-            if(particleMode == ANIMATIONS && animation == SNOW){
-                float windX = ofSignedNoise(particles[i]->pos.x * 0.003, particles[i]->pos.y * 0.006, ofGetElapsedTimef() * 0.1) * 3.0;
-                ofPoint frc;
-                frc.x = windX + ofSignedNoise(particles[i]->id, particles[i]->pos.y * 0.04) * 8.0;
-                frc.y = ofSignedNoise(particles[i]->id, particles[i]->pos.x * 0.006, ofGetElapsedTimef() * 0.2) * 3.0;
-                particles[i]->addForce(frc*particles[i]->mass);
-            }
+            params.lowThresh                =   lowThresh;
+            params.highThresh               =   highThresh;
+            params.maxSpeed                 =   maxSpeed;
         }
+        endPhase(PHASE_INTERACTION);
 
+        int numBeforeBorn = particles.size();
         if(emit){ // Born new particles
             if(markersInput){
                 for(unsigned int i = 0; i < markers.size(); i++){
                     if (!markers[i].hasDisappeared){
                         if(emitInMovement){
                             float n = ofMap(markers[i].velocity.lengthSquared(), 0.5, 300.0, 0.0, bornRate, true);
-                            addParticles(n, markers[i]);
+                            addParticles(spawnCount(n, dt), markers[i]);
                         }
                         else{
                             float range = ofMap(bornRate, 0, 150, 0, 20);
-                            if(bornRate > 0.1) addParticles(ofRandom(bornRate-range, bornRate+range), markers[i]);
+                            if(bornRate > 0.1) addParticles(spawnCount(random.uniform(bornRate-range, bornRate+range), dt), markers[i]);
                         }
                     }
                 }
@@ -390,13 +396,13 @@ void ParticleSystem::update(float dt, vector<irMarker>& markers, Contour& contou
                     for(unsigned int i = 0; i < contour.vMaskContours.size(); i++){
                         // born more particles if bigger area
                         float bornNum = bornRate * abs(contour.vMaskContours[i].getArea())/1500.0;
-                        addParticles(bornNum, contour.vMaskContours[i], contour);
+                        addParticles(spawnCount(bornNum, dt), contour.vMaskContours[i], contour);
                     }
                 }
                 else{
                     for(unsigned int i = 0; i < contour.contours.size(); i++){
                         float range = ofMap(bornRate, 0, 150, 0, 30);
-                        addParticles(ofRandom(bornRate-range, bornRate+range), contour.contours[i], contour);
+                        addParticles(spawnCount(random.uniform(bornRate-range, bornRate+range), dt), contour.contours[i], contour);
                     }
                 }
             }
@@ -405,39 +411,51 @@ void ParticleSystem::update(float dt, vector<irMarker>& markers, Contour& contou
         // Keep adding particles if it is an animation (unless it is an explosion)
         if(particleMode == ANIMATIONS && animation != EXPLOSION){
             float range = ofMap(bornRate, 0, 60, 0, 15);
-            addParticles(ofRandom(bornRate-range, bornRate+range));
+            addParticles(spawnCount(random.uniform(bornRate-range, bornRate+range), dt));
+        }
+        addAwakeRange(numBeforeBorn, particles.size()); // newborn particles are awake
+        endPhase(PHASE_EMISSION);
+
+        // build the neighbor grid so particle/particle interactions only look at close particles
+        if(flock || repulse){
+            float cellSize = MAX(flock ? flockingRadius : 0, repulse ? repulseDist*getRadiusScale() : 0);
+            neighborGrid.update(particles.x, particles.y, particles.size(), cellSize);
         }
 
-        if(flock) flockParticles();
-        if(repulse) repulseParticles();
+        if(flock) flockParticles(parallel);
+        if(repulse) repulseParticles(parallel);
+        endPhase(PHASE_NEIGHBORS);
 
         // ---------- (3) Add some general behavior and update the particles
-        for(int i = 0; i < particles.size(); i++){
-            particles[i]->addForce(gravity*particles[i]->mass);
-            particles[i]->addNoise(turbulence);
-            
-            particles[i]->opacity           = opacity;
-            particles[i]->friction          = 1-friction/1000;
-            particles[i]->bounces           = bounce;
-            particles[i]->bounceDamping     = bounceDamping;
-            particles[i]->steers            = steer;
-            particles[i]->infiniteWalls     = infiniteWalls;
-            
-            // update attributes also from immortal particle systems like GRID and BOIDS
-            if(immortal){
-                if(particleMode != BOIDS)
-                    particles[i]->radius    = radius;
-                particles[i]->color         = ofColor(red, green, blue);
-                particles[i]->isEmpty       = isEmpty;
-                particles[i]->drawLine      = drawLine;
-                particles[i]->drawStroke    = drawStroke;
-                particles[i]->strokeWidth   = strokeWidth;
+        ParticleParams& params      = particles.params;
+        params.friction             = 1-friction/1000;
+        params.bounces              = bounce || gravityInteraction;
+        params.bounceDamping        = bounceDamping;
+        params.steers               = steer;
+        params.infiniteWalls        = infiniteWalls;
+        params.sizeAge              = sizeAge;
+        particles.setTrailLength(drawTrails ? trailLength : 0);
+
+        // immortal particle systems like GRID follow the radius of the system,
+        // the particles are only changed when it changes
+        if(immortal && particleMode != BOIDS){
+            if(radius != particlesRadius){
+                for(int i = 0; i < particles.size(); i++) particles.radius[i] = radius;
+                particlesRadius = radius;
             }
-            
-            if(gravityInteraction) particles[i]->bounces = true;
-
-            particles[i]->update(dt);
         }
+        else particlesRadius = -1;
+
+        // silhouettes are solid when bouncing
+        bool collide = interact && contourInput && bounceInteraction;
+        forEachAwakeRange(parallel, [&](int begin, int end){
+            particles.addGravity(begin, end, gravity);
+            if(turbulence != 0) particles.addNoise(begin, end, turbulence, turbulenceField);
+            particles.update(begin, end, dt);
+            if(collide) particles.contourCollide(begin, end, contour.contourBVH);
+            if(sleep) sleepParticles(begin, end);
+        });
+        endPhase(PHASE_INTEGRATION);
     }
     else if(activeStarted){
         activeStarted = false;
@@ -447,93 +465,138 @@ void ParticleSystem::update(float dt, vector<irMarker>& markers, Contour& contou
         startFadeOut = true;
         killParticles();
     }
+
+    updateTime = (ofGetElapsedTimeMicros() - startTime) / 1000.0f;
 }
 
 void ParticleSystem::draw(){
+    uint64_t startTime = ofGetElapsedTimeMicros();
     if(isActive || isFadingOut){
+        ParticleDrawParams& drawParams  = particles.drawParams;
+        drawParams.color                = ofColor(red, green, blue);
+        drawParams.opacity              = opacity;
+        drawParams.opacityAge           = opacityAge;
+        drawParams.flickersAge          = flickersAge;
+        drawParams.colorAge             = colorAge;
+        drawParams.isEmpty              = isEmpty;
+        drawParams.drawLine             = drawLine;
+        drawParams.drawStroke           = drawStroke;
+        drawParams.strokeWidth          = strokeWidth;
+        drawParams.interpolation        = interpolation;
+
+
         ofPushStyle();
         //Draw lines between near points
         if(drawConnections){
             ofPushStyle();
-            float connectDistSqrd = connectDist*connectDist;
             ofSetColor(ofColor(red, green, blue), opacity);
             ofSetLineWidth(connectWidth);
-            for(int i = 0; i < particles.size(); i++){
-                for(int j = i-1; j >= 0; j--){
-//                    if (fabs(particles[i]->pos.x - particles[j]->pos.x) > connectDist) break; // to speed the loop
-                    if(particles[i]->pos.squareDistance(particles[j]->pos) < connectDistSqrd){
-                        ofDrawLine(particles[i]->pos, particles[j]->pos);
-                    }
-                }
-            }
+            updateConnections();
+            connectionsMesh.draw();
             ofPopStyle();
         }
         // Draw particles
-        for(int i = 0; i < particles.size(); i++){
-            particles[i]->draw();
-        }
+        particles.buildMesh(particlesMesh, 0, particles.size());
+        particlesMesh.draw();
         ofPopStyle();
     }
+    drawTime = (ofGetElapsedTimeMicros() - startTime) / 1000.0f;
 }
 
-void ParticleSystem::addParticle(ofPoint pos, ofPoint vel, ofColor color, float radius, float lifetime){
-    Particle * newParticle = new Particle();
-    float id = totalParticlesCreated;
+// Fill the connections mesh with a segment for every pair of particles closer than connectDist
+void ParticleSystem::updateConnections(){
+    connectionsMesh.clear();
+    float connectDist = this->connectDist*getRadiusScale();
+    particles.getDrawPositions(drawX, drawY); // connect the particles where they are drawn
+    connectionsGrid.update(drawX, drawY, particles.size(), connectDist);
+    numConnections.assign(particles.size(), 0);
+
+    float connectDistSqrd = connectDist*connectDist;
+    vector<float>& x = drawX;
+    vector<float>& y = drawY;
+    vector<int>& connections = numConnections;
+    ofVboMesh& mesh = connectionsMesh;
+    int maxConnections = this->maxConnections;
+
+    connectionsGrid.forEachPair([&](int i, int j){
+        if(connections[i] >= maxConnections || connections[j] >= maxConnections) return;
+        float dx = x[i] - x[j];
+        float dy = y[i] - y[j];
+        if(dx*dx + dy*dy < connectDistSqrd){
+            mesh.addVertex(ofPoint(x[i], y[i]));
+            mesh.addVertex(ofPoint(x[j], y[j]));
+            connections[i]++;
+            connections[j]++;
+        }
+    });
+}
 
-    newParticle->sizeAge        = sizeAge;
-    newParticle->opacityAge     = opacityAge;
-    newParticle->flickersAge    = flickersAge;
-    newParticle->colorAge       = colorAge;
-    newParticle->isEmpty        = isEmpty;
-    newParticle->drawLine       = drawLine;
-    newParticle->drawStroke     = drawStroke;
-    newParticle->strokeWidth    = strokeWidth;
-    
-    newParticle->friction       = 1 - friction/1000;
+ParticleHandle ParticleSystem::addParticle(ofPoint pos, ofPoint vel, ofColor color, float radius, float lifetime){
+    ParticleHandle handle = particles.add(pos, vel, color, radius, lifetime);
+    if(handle == INVALID_PARTICLE_HANDLE) return handle; // pool is full
 
-    newParticle->width = width;
-    newParticle->height = height;
-    
-    if(particleMode == GRID){
-        newParticle->immortal = true;
+    int i = particles.size()-1;
+    if(particleMode == GRID || particleMode == BOIDS){
+        particles.immortal[i] = true;
     }
-    else if(particleMode == BOIDS){
-        newParticle->limitSpeed = true;
-        newParticle->immortal = true;
-    }
-    else if(particleMode == ANIMATIONS){
-        if(animation == SNOW) newParticle->damping = 0.05;
-        else newParticle->damping = 0.2;
-        newParticle->bounceTop = false;
+    if(immortal && particleMode != BOIDS){
+        particles.radius[i] = this->radius; // same radius as the rest of the particles
     }
 
-    newParticle->setup(id, pos, vel, color, radius, lifetime);
-    particles.push_back(newParticle);
-
-    numParticles++;
-    totalParticlesCreated++;
+    numParticles = particles.size();
+    return handle;
 }
 
 void ParticleSystem::addParticles(int n){
+    if(n <= 0) return;
+
+    // (1) get all the random numbers of the burst at once
+    spawnRandom.resize(7*n);
+    float* posX         = &spawnRandom[0];
+    float* posY         = posX + n;
+    float* dirX         = posY + n;
+    float* dirY         = dirX + n;
+    float* speed        = dirY + n;
+    float* radii        = speed + n;
+    float* lifetimes    = radii + n;
+
+    float minY = 0;
+    float maxY = height;
+    if(particleMode == ANIMATIONS && (animation == RAIN || animation == SNOW)){
+        minY = -5*radius;
+        maxY = -10*radius;
+    }
+    else if(particleMode == ANIMATIONS && animation == EXPLOSION){
+        minY = height;
+        maxY = height+radius*15;
+    }
+    random.fillUniform(posX, n, 0, width);
+    random.fillUniform(posY, n, minY, maxY);
+    random.fillUnitVectors(dirX, dirY, n);
+    fillRandomRange(speed, n, velocityRnd, velocity);
+    fillRandomRange(radii, n, radiusRnd, radius);
+    fillRandomRange(lifetimes, n, lifetimeRnd, lifetime);
+
+    // (2) create the particles
+    ofColor color(red, green, blue);
     for(int i = 0; i < n; i++){
-        ofPoint pos = ofPoint(ofRandom(width), ofRandom(height));
-        ofPoint vel = randomVector()*(velocity+randomRange(velocityRnd, velocity));
+        ofPoint pos(posX[i], posY[i]);
+        float v = velocity + speed[i];
+        ofPoint vel(dirX[i]*v, dirY[i]*v);
 
         if(particleMode == ANIMATIONS && (animation == RAIN || animation == SNOW)){
-            pos = ofPoint(ofRandom(width), ofRandom(-5*radius, -10*radius));
             vel.x = 0;
-            vel.y = velocity+randomRange(velocityRnd, velocity); // make particles all be going down when born
+            vel.y = v;  // make particles all be going down when born
         }
         else if(particleMode == ANIMATIONS && animation == EXPLOSION){
-            pos = ofPoint(ofRandom(width), ofRandom(height, height+radius*15));
             vel.x = 0;
-            vel.y = -velocity-randomRange(velocityRnd, velocity); // make particles all be going up when born
+            vel.y = -v; // make particles all be going up when born
         }
 
-        float initialRadius = radius + randomRange(radiusRnd, radius);
-        float lifetime = this->lifetime + randomRange(lifetimeRnd, this->lifetime);
+        float initialRadius = radius + radii[i];
+        float lifetime = this->lifetime + lifetimes[i];
 
-        addParticle(pos, vel, ofColor(red, green, blue), initialRadius, lifetime);
+        addParticle(pos, vel, color, initialRadius, lifetime);
     }
 }
 
@@ -541,7 +604,7 @@ void ParticleSystem::addParticles(int n, const irMarker& marker){
     for(int i = 0; i < n; i++){
         ofPoint pos;
         if(emitAllTimeInside || emitInMovement){
-            pos = marker.smoothPos + randomVector()*ofRandom(0, emitterSize);
+            pos = marker.smoothPos + randomVector()*random.uniform(0, emitterSize);
         }
         else if(emitAllTimeContour){
             pos = marker.smoothPos + randomVector()*emitterSize;
@@ -558,29 +621,30 @@ void ParticleSystem::addParticles(int n, const irMarker& marker){
 }
 
 void ParticleSystem::addParticles(int n, const ofPolyline& contour, Contour& flow){
+    if(n <= 0) return;
+
+    // Positions come from the sampler, built once for all the particles of the contour.
+    // In movement the particles are born where the optical flow is stronger
+    bool inside = emitAllTimeInside || emitInMovement;
+    if(inside) spawnSampler.setArea(contour, emitInMovement ? &flow : NULL);
+    else if(emitAllTimeContour) spawnSampler.setContour(contour);
+
     for(int i = 0; i < n; i++){
 
         ofPoint pos, randomVel, motionVel, vel;
 
         // Create random particles inside contour polyline
-        if(emitAllTimeInside || emitInMovement){
-            ofRectangle box = contour.getBoundingBox(); // so it is easier that the particles are born inside contour
-            ofPoint center = box.getCenter();
-            pos.x = center.x + (ofRandom(1.0f) - 0.5f) * box.getWidth();
-            pos.y = center.y + (ofRandom(1.0f) - 0.5f) * box.getHeight();
-
-            while(!contour.inside(pos)){
-                pos.x = center.x + (ofRandom(1.0f) - 0.5f) * box.getWidth();
-                pos.y = center.y + (ofRandom(1.0f) - 0.5f) * box.getHeight();
-            }
+        if(inside){
+            if(!spawnSampler.sampleArea(random, pos)) return; // contour without area
 
             // set velocity to random vector direction with 'velocity' as magnitude
             randomVel = randomVector()*(velocity+randomRange(velocityRnd, velocity));
         }
 
-        // Create particles only on the contour polyline
+        // Create particles only on the contour polyline, uniform in length
         else if(emitAllTimeContour){
-            float indexInterpolated = ofRandom(0, contour.size());
+            float indexInterpolated = spawnSampler.sampleContour(random);
+            if(indexInterpolated < 0) return; // contour without length
             pos = contour.getPointAtIndexInterpolated(indexInterpolated);
 
             // Use normal vector in surface as vel. direction so particle moves out of the contour
@@ -604,6 +668,7 @@ void ParticleSystem::addParticles(int n, const ofPolyline& contour, Contour& flo
 }
 
 void ParticleSystem::createParticleGrid(int width, int height){
+    particles.reserve(particles.size() + (width/gridRes)*(height/gridRes));
     for(int y = 0; y < height/gridRes; y++){
         for(int x = 0; x < width/gridRes; x++){
             int xi = (x + 0.5f) * gridRes;
@@ -623,30 +688,29 @@ void ParticleSystem::createParticleGrid(int width, int height){
 void ParticleSystem::removeParticles(int n){
     n = MIN(particles.size(), n);
     for(int i = 0; i < n; i++){
-        particles[i]->immortal = false;
+        particles.immortal[i] = false;
+        particles.isAsleep[i] = false;
     }
 }
 
 void ParticleSystem::killParticles(){
     for(int i = 0; i < particles.size(); i++){
-        particles[i]->immortal = false;
+        particles.immortal[i] = false;
+        particles.isAsleep[i] = false; // sleeping particles would never get old
     }
 }
 
 void ParticleSystem::resetTouchedParticles(){
     for(int i = 0; i < particles.size(); i++){
-        particles[i]->isTouched = false;
+        particles.isTouched[i] = false;
     }
 }
 
 void ParticleSystem::bornParticles(){
-    // Kill all the remaining particles before creating new ones
-    if(!particles.empty()){
-        for(int i = 0; i < particles.size(); i++){
-            particles[i]->isAlive = false;
-        }
-    }
-    
+    // Remove all the remaining particles before creating new ones, so they
+    // give their place in the pool back
+    particles.clear();
+
     setup(particleMode, width, height); // resets the settings to default
 
 //    if(particleMode == GRID){
@@ -661,43 +725,585 @@ void ParticleSystem::setAnimation(Animation animation){
     this->animation = animation;
 }
 
-void ParticleSystem::repulseParticles(){
-    float repulseDistSqrd = repulseDist*repulseDist;
-    for(int i = 1; i < particles.size(); i++){
-        for(int j = i-1; j >= 0; j--){
-            if (fabs(particles[i]->pos.x - particles[j]->pos.x) > repulseDist) break; // to speed the loop
-            particles[i]->addRepulsionForce( *particles[j], repulseDistSqrd, 8.0);
-//            particles[i]->addRepulsionForce( *particles[j], 30.0);
+// Forces from the input and the animations. Each particle only changes itself,
+// so different ranges can be computed at the same time
+// The inputs and behaviors are template flags, so each combination is a loop
+// without the branches of the others. The optical flow and the kind of
+// contour interaction are still checked in the silhouettes branch
+template<unsigned int flags> void ParticleSystem::interactParticles(int begin, int end, vector<irMarker>& markers, Contour& contour, Fluid& fluid){
+    float interactionRadiusSqrd = interactionRadius*interactionRadius;
+
+    for(int i = begin; i < end; i++){
+        ofPoint pos = particles.getPos(i);
+        // Interact particles with input
+        if(flags & INTERACT_CLOSEST_MARKER){ // get closest marker to particle
+            irMarker* closestMarker = getClosestMarker(pos, markers);
+            if(closestMarker != NULL){
+                interactMarker(i, *closestMarker, pos.squareDistance(closestMarker->smoothPos), contour);
+            }
+            else if(gravityInteraction && particles.isTouched[i]){
+                particles.addForce(i, ofPoint(0, 500.0)*particles.mass[i]);
+            }
+        }
+        // particles inside the area of a marker are in markerContacts
+        if(flags & INTERACT_MARKERS_GRAVITY){
+            if(particles.isTouched[i] && markerContactIndex[i] == -1){
+                particles.addForce(i, ofPoint(0, 500.0)*particles.mass[i]);
+            }
+        }
+        if(flags & INTERACT_CONTOUR){
+            unsigned int contourIdx = (unsigned int)-1;
+            ofVec2f normal;
+            ofPoint closestPointInContour;
+            if(particleMode == BOIDS && seekInteraction) // get closest point to particle
+                closestPointInContour = getClosestPointInContour(pos, contour, false, &contourIdx, &normal);
+            else // get closest point to particle only if particle is inside contour
+                closestPointInContour = getClosestPointInContour(pos, contour, true, &contourIdx, &normal);
+
+            if(flowInteraction){
+                ofPoint frc = contour.getFlowOffset(pos);
+                particles.addForce(i, frc*interactionForce);
+            }
+
+            if(closestPointInContour != ofPoint(-1, -1)){
+                if(repulseInteraction){ // it is an attractForce but result is more logical saying repulse
+                    particles.addAttractionForce(i, closestPointInContour, interactionRadiusSqrd, interactionForce);
+                }
+                else if(attractInteraction){
+                    particles.addRepulsionForce(i, closestPointInContour, interactionRadiusSqrd, interactionForce);
+                }
+                else if(seekInteraction){
+                    particles.seek(i, closestPointInContour, interactionRadiusSqrd, interactionForce*10.0);
+                }
+                else if(gravityInteraction){
+                    particles.addForce(i, ofPoint(particles.random(i, RANDOM_GRAVITY_INTERACTION, -100, 100), 500.0)*particles.mass[i]);
+                    particles.isTouched[i] = true;
+                }
+                else if(bounceInteraction){
+                    if(contourIdx != (unsigned int)-1) particles.contourBounce(i, normal);
+                }
+            }
+            else if(gravityInteraction && particles.isTouched[i]){
+                particles.addForce(i, ofPoint(0.0, 500.0)*particles.mass[i]);
+            }
+        }
+        if(flags & INTERACT_FLUID){
+            ofPoint frc = fluid.getFluidOffset(pos);
+            particles.addForce(i, frc*interactionForce);
+        }
+
+        if(flags & INTERACT_SNOW){
+            int layer = (int)particles.seed[i] % gustXField.getNumLayers();
+            ofPoint frc;
+            frc.x = windField.sample(pos.x, pos.y) + gustXField.sample(pos.x, pos.y, layer);
+            frc.y = gustYField.sample(pos.x, pos.y, layer);
+            particles.addForce(i, frc*particles.mass[i]);
         }
     }
 }
 
-void ParticleSystem::flockParticles(){
-    for(int i = 0; i < particles.size(); i++){
-        for(int j = i-1; j >= 0; j--){
-            if (fabs(particles[i]->pos.x - particles[j]->pos.x) > flockingRadius) break;
-            particles[i]->addFlockingForces(*particles[j]);
+// Table with the kernel of every combination of flags, the flags are the index.
+// Combinations that can't happen get NULL and their kernel is never compiled
+template<unsigned int flags> ParticleSystem::InteractKernel ParticleSystem::makeInteractKernel(std::true_type){
+    return &ParticleSystem::interactParticles<flags>;
+}
+
+template<unsigned int flags> ParticleSystem::InteractKernel ParticleSystem::makeInteractKernel(std::false_type){
+    return NULL;
+}
+
+template<unsigned int flags> void ParticleSystem::addInteractKernels(vector<InteractKernel>& kernels){
+    addInteractKernels<flags-1>(kernels);
+    const bool reachable = !((flags & INTERACT_CLOSEST_MARKER) && (flags & INTERACT_MARKERS_GRAVITY));
+    kernels.push_back(makeInteractKernel<flags>(std::integral_constant<bool, reachable>()));
+}
+
+template<> void ParticleSystem::addInteractKernels<0>(vector<InteractKernel>& kernels){
+    kernels.push_back(&ParticleSystem::interactParticles<0>);
+}
+
+vector<ParticleSystem::InteractKernel> ParticleSystem::getInteractKernels(){
+    vector<InteractKernel> kernels;
+    addInteractKernels<NUM_INTERACT_KERNELS-1>(kernels);
+    return kernels;
+}
+
+// Kernel for the inputs and behaviors of this frame
+ParticleSystem::InteractKernel ParticleSystem::getInteractKernel() const{
+    static const vector<InteractKernel> kernels = getInteractKernels();
+
+    unsigned int flags = 0;
+    if(interact){
+        if(markersInput && particleMode == BOIDS) flags |= INTERACT_CLOSEST_MARKER;
+        if(markersInput && particleMode != BOIDS && gravityInteraction) flags |= INTERACT_MARKERS_GRAVITY;
+        if(contourInput) flags |= INTERACT_CONTOUR;
+        if(fluidInteraction) flags |= INTERACT_FLUID;
+    }
+    if(particleMode == ANIMATIONS && animation == SNOW) flags |= INTERACT_SNOW;
+    return kernels[flags];
+}
+
+// Find the particles inside the interaction area of the markers. Each marker
+// only looks at the cells around it, so particles far from every marker cost
+// nothing. A particle close to several markers belongs to the closest one
+void ParticleSystem::gatherMarkerContacts(vector<irMarker>& markers){
+    float interactionRadiusSqrd = interactionRadius*interactionRadius;
+    if((int)markerContactIndex.size() < particles.size()) markerContactIndex.resize(particles.size(), -1);
+    markerContacts.clear();
+    if(interactionRadius <= 0) return;
+
+    int m = 0;
+    float mx = 0, my = 0;
+    auto touch = [&](int i){
+        float dx = particles.x[i] - mx;
+        float dy = particles.y[i] - my;
+        float distSqrd = dx*dx + dy*dy;
+        if(distSqrd >= interactionRadiusSqrd) return;
+
+        int k = markerContactIndex[i];
+        if(k == -1){
+            markerContactIndex[i] = markerContacts.size();
+            MarkerContact contact = {i, m, distSqrd};
+            markerContacts.push_back(contact);
+        }
+        else if(distSqrd < markerContacts[k].distSqrd){ // closer than its previous marker
+            markerContacts[k].marker = m;
+            markerContacts[k].distSqrd = distSqrd;
+        }
+    };
+
+    // the markers have woken every particle they reach, so when the particles
+    // sleep only the awake ones are checked instead of indexing all of them
+    if(!sleeping) markersGrid.update(particles.x, particles.y, particles.size(), interactionRadius);
+
+    for(m = 0; m < (int)markers.size(); m++){
+        if(markers[m].hasDisappeared) continue;
+        mx = markers[m].smoothPos.x;
+        my = markers[m].smoothPos.y;
+        if(sleeping){
+            for(unsigned int r = 0; r < awakeRanges.size(); r++){
+                for(int i = awakeRanges[r].first; i < awakeRanges[r].second; i++) touch(i);
+            }
+        }
+        else markersGrid.forEachInSquare(mx, my, interactionRadius, touch);
+    }
+}
+
+// Interaction of particle i with its closest marker
+void ParticleSystem::interactMarker(int i, irMarker& marker, float markerDistSqrd, Contour& contour){
+    float interactionRadiusSqrd = interactionRadius*interactionRadius;
+
+    if(flowInteraction){
+        float pct = 1 - (markerDistSqrd / interactionRadiusSqrd); // stronger on the inside
+        particles.addForce(i, marker.velocity*pct*interactionForce);
+    }
+    else if(repulseInteraction) particles.addRepulsionForce(i, marker.smoothPos, interactionRadiusSqrd, interactionForce);
+    else if(attractInteraction) particles.addAttractionForce(i, marker.smoothPos, interactionRadiusSqrd, interactionForce);
+    else if(seekInteraction){
+        particles.seek(i, marker.smoothPos, interactionRadiusSqrd, interactionForce*10.0);
+    }
+    else if(gravityInteraction){
+        particles.addForce(i, ofPoint(particles.random(i, RANDOM_GRAVITY_INTERACTION, -100, 100), 500.0)*particles.mass[i]);
+        particles.isTouched[i] = true;
+    }
+    else if(bounceInteraction){
+        unsigned int contourIdx = (unsigned int)-1;
+        ofVec2f normal;
+        ofPoint closestPointInContour = getClosestPointInContour(particles.getPos(i), contour, true, &contourIdx, &normal);
+        if(closestPointInContour != ofPoint(-1, -1)){
+            if(contourIdx != (unsigned int)-1) particles.contourBounce(i, normal);
+        }
+    }
+}
+
+// Evaluate the noise of this frame on the grids of the fields, the particles
+// only interpolate it. Layers are offset in the first dimension of the noise
+// like the seeds of the particles were before
+void ParticleSystem::updateNoiseFields(){
+    float t = time;
+    if(turbulence != 0){
+        turbulenceField.update([t](float x, float y, int layer){
+            return ofSignedNoise(layer*10.0f, x*0.005f, y*0.005f, t*0.1f);
+        }, threadPool);
+    }
+    if(particleMode == ANIMATIONS && animation == SNOW){
+        windField.update([t](float x, float y, int){
+            return ofSignedNoise(x*0.003f, y*0.006f, t*0.1f) * 3.0f;
+        }, threadPool);
+        gustXField.update([](float, float y, int layer){
+            return ofSignedNoise(layer*10.0f + 0.5f, y*0.04f) * 8.0f;
+        }, threadPool);
+        gustYField.update([t](float x, float, int layer){
+            return ofSignedNoise(layer*10.0f + 0.5f, x*0.006f, t*0.2f) * 3.0f;
+        }, threadPool);
+    }
+}
+
+// loadScale only limits the particles that are born and the radii of the
+// particle/particle interactions. The grid and the boids are created all at
+// once in setup, so without those they cost the same at any load
+bool ParticleSystem::canReduceLoad() const{
+    if(emit || (particleMode == ANIMATIONS && animation != EXPLOSION)) return true;
+    return flock || repulse || drawConnections;
+}
+
+// Particles can only sleep in the grid, where they rest at their origin, and
+// while nothing moves them when there is no input around
+bool ParticleSystem::canSleep() const{
+    if(!sleepAtRest || particleMode != GRID) return false;
+    if(!returnToOrigin || gravityInteraction) return false;
+    if(gravity != ofPoint(0, 0) || turbulence != 0 || repulse || flock) return false;
+    // sleeping particles do not get older, so they can't show their age
+    if(sizeAge || opacityAge || colorAge || flickersAge) return false;
+    return true;
+}
+
+// Wake the sleeping particles of the areas that the input can reach this
+// frame. Markers and silhouettes wake the cells they overlap, the optical flow
+// and the fluid wake the cells where their force is strong enough to move the
+// particles further than where they fall asleep
+void ParticleSystem::wakeParticles(vector<irMarker>& markers, Contour& contour, Fluid& fluid){
+    // (1) group the particles by their origin again only if they have changed
+    if(sleepGridVersion != particles.getLayoutVersion()){
+        sleepGrid.update(particles.iniX, particles.iniY, particles.size(), SLEEP_CELL_SIZE);
+        sleepGridVersion = particles.getLayoutVersion();
+    }
+    wokenCells.assign(sleepGrid.getNumCells(), false);
+    if(!interact) return;
+
+    vector<unsigned char>& isAsleep = particles.isAsleep;
+    auto wakeCell = [&](int c){
+        if(wokenCells[c]) return;
+        wokenCells[c] = true;
+        for(int b = sleepGrid.cellStart[c]; b < sleepGrid.cellStart[c+1]; b++) isAsleep[sleepGrid.cellParticles[b]] = false;
+    };
+    auto wakeRect = [&](float x0, float y0, float x1, float y1){
+        for(int cy = sleepGrid.getCellY(y0); cy <= sleepGrid.getCellY(y1); cy++){
+            for(int cx = sleepGrid.getCellX(x0); cx <= sleepGrid.getCellX(x1); cx++) wakeCell(cy*sleepGrid.cols + cx);
+        }
+    };
+
+    // (2) around the markers
+    if(markersInput){
+        for(unsigned int m = 0; m < markers.size(); m++){
+            if(markers[m].hasDisappeared) continue;
+            const ofPoint& pos = markers[m].smoothPos;
+            wakeRect(pos.x - interactionRadius, pos.y - interactionRadius, pos.x + interactionRadius, pos.y + interactionRadius);
+        }
+    }
+
+    // (3) over the silhouettes
+    if(contourInput){
+        for(unsigned int i = 0; i < contour.boundingRects.size(); i++){
+            const ofRectangle& rect = contour.boundingRects[i];
+            wakeRect(rect.getMinX() - interactionRadius, rect.getMinY() - interactionRadius,
+                     rect.getMaxX() + interactionRadius, rect.getMaxY() + interactionRadius);
+        }
+    }
+
+    // (4) where the flow or the fluid push, looking at the corners of the cells.
+    // Under this force the return to origin keeps the particles closer than
+    // SLEEP_DISTANCE (it is scale*dist^2/100 near the origin)
+    bool flowForce = contourInput && flowInteraction;
+    if(flowForce || fluidInteraction){
+        float wakeForce = returnToOriginForce*SLEEP_DISTANCE*SLEEP_DISTANCE/100.0;
+        float cellSize = sleepGrid.cellSize;
+        for(int cy = 0; cy < sleepGrid.rows; cy++){
+            for(int cx = 0; cx < sleepGrid.cols; cx++){
+                int c = cy*sleepGrid.cols + cx;
+                if(wokenCells[c] || sleepGrid.cellStart[c] == sleepGrid.cellStart[c+1]) continue;
+
+                float maxForce = 0;
+                for(int k = 0; k < 4; k++){
+                    ofPoint corner((cx + k%2)*cellSize, (cy + k/2)*cellSize);
+                    ofVec2f frc(0, 0);
+                    if(flowForce) frc += contour.getFlowOffset(corner);
+                    if(fluidInteraction) frc += fluid.getFluidOffset(corner);
+                    float force = frc.length()*interactionForce;
+                    if(force > maxForce) maxForce = force;
+                }
+                if(maxForce > wakeForce) wakeCell(c);
+            }
         }
     }
 }
 
+// Particles at rest fall asleep, unless some input has reached their cell this
+// frame. Otherwise a soft push would be undone every frame
+void ParticleSystem::sleepParticles(int begin, int end){
+    if(sleepGridVersion != particles.getLayoutVersion()) return; // cells are not up to date
+    float maxDistSqrd = SLEEP_DISTANCE*SLEEP_DISTANCE;
+    float maxSpeedSqrd = SLEEP_SPEED*SLEEP_SPEED;
+    for(int i = begin; i < end; i++){
+        if(!particles.immortal[i] || wokenCells[sleepGrid.particleCell[i]]) continue;
+        if(particles.isAtRest(i, maxDistSqrd, maxSpeedSqrd)) particles.fallAsleep(i);
+    }
+}
+
+// Ranges of consecutive awake particles. Without sleep it is all of them
+void ParticleSystem::buildAwakeRanges(bool sleep){
+    int n = particles.size();
+    unsigned char* isAsleep = particles.isAsleep.data();
+    awakeRanges.clear();
+    numAwake = 0;
+
+    if(!sleep){
+        if(sleeping) memset(isAsleep, 0, n); // wake everybody up
+        sleeping = false;
+        addAwakeRange(0, n);
+        return;
+    }
+
+    sleeping = true;
+    int i = 0;
+    while(i < n){
+        const unsigned char* first = (const unsigned char*)memchr(isAsleep+i, 0, n-i);
+        if(first == NULL) break;
+        int begin = first - isAsleep;
+        const unsigned char* last = (const unsigned char*)memchr(isAsleep+begin, 1, n-begin);
+        int end = (last == NULL) ? n : last - isAsleep;
+        addAwakeRange(begin, end);
+        i = end;
+    }
+}
+
+// Long ranges are cut so the threads can share them
+void ParticleSystem::addAwakeRange(int begin, int end){
+    for(int b = begin; b < end; b += AWAKE_RANGE_SIZE){
+        awakeRanges.push_back(make_pair(b, MIN(b + AWAKE_RANGE_SIZE, end)));
+    }
+    if(end > begin) numAwake += end - begin;
+}
+
+// Call f(begin, end) for every awake range, among the threads if parallel
+void ParticleSystem::forEachAwakeRange(bool parallel, const function<void(int, int)>& f){
+    if(parallel && numAwake > AWAKE_RANGE_SIZE){
+        threadPool->parallelFor(awakeRanges.size(), [&](int first, int last){
+            for(int r = first; r < last; r++) f(awakeRanges[r].first, awakeRanges[r].second);
+        }, 1);
+    }
+    else{
+        for(unsigned int r = 0; r < awakeRanges.size(); r++) f(awakeRanges[r].first, awakeRanges[r].second);
+    }
+}
+
+// Sort the particles in memory in Z-order from time to time, so the particles
+// that are close in space are close in memory too: the grids, the fields, the
+// mesh and the awake ranges of sleeping systems walk the arrays almost in order.
+// Newborn particles go to the end and dead ones are replaced by the last one,
+// so the order gets lost little by little
+void ParticleSystem::reorderParticles(){
+    updatesSinceReorder++;
+    bool reorder = reorderUpdates > 0 && updatesSinceReorder >= reorderUpdates;
+    // the first update checks too, so systems born out of order are sorted at once
+    if(!reorder && reorderDisorder > 0 && updatesSinceReorder % REORDER_CHECK_UPDATES == 1){
+        reorder = particles.getMortonDisorder(REORDER_CELL_SIZE) > reorderDisorder;
+    }
+    if(!reorder) return;
+    particles.sortByMorton(REORDER_CELL_SIZE);
+    updatesSinceReorder = 0;
+}
+
+// Each particle adds up the forces of all its neighbors, so a thread only
+// writes the forces of its own particles. The order of the sums only depends
+// on the grid, so one thread or many give the same result. Particles are taken
+// in grid order so each thread works on a compact region
+void ParticleSystem::repulseParticles(bool parallel){
+    float repulseDist = this->repulseDist*getRadiusScale();
+    float repulseDistSqrd = repulseDist*repulseDist;
+    Particles& p = particles;
+    const NeighborGrid& grid = neighborGrid;
+    auto repulse = [&p, &grid, repulseDistSqrd](int begin, int end){
+        for(int a = begin; a < end; a++){
+            int i = grid.cellParticles[a];
+            grid.forEachNeighbor(i, [&p, i, repulseDistSqrd](int j){
+                p.addRepulsionForceFrom(i, j, repulseDistSqrd, 8.0);
+            });
+        }
+    };
+    if(parallel) threadPool->parallelFor(p.size(), repulse);
+    else repulse(0, p.size());
+}
+
+void ParticleSystem::flockParticles(bool parallel){
+    Particles& p = particles;
+    const NeighborGrid& grid = neighborGrid;
+    auto flock = [&p, &grid](int begin, int end){
+        for(int a = begin; a < end; a++){
+            int i = grid.cellParticles[a];
+            grid.forEachNeighbor(i, [&p, i](int j){
+                p.addFlockingForceFrom(i, j);
+            });
+        }
+    };
+    if(parallel) threadPool->parallelFor(p.size(), flock);
+    else flock(0, p.size());
+}
+
 ofPoint ParticleSystem::randomVector(){
-    float angle = ofRandom((float)M_PI * 2.0f);
-    return ofPoint(cos(angle), sin(angle));
+    return random.unitVector();
+}
+
+// Number of particles to born out of n per frame in an update of dt, reduced
+// by the frame governor and limited so the system does not go over its share
+// of the pool. What is left of a particle is born in the next updates, so the
+// same number is born per second with any simulation rate
+int ParticleSystem::spawnCount(float n, float dt){
+    float count = MAX(n, 0)*loadScale*dt*BORN_RATE_FPS + bornFraction;
+    int born = count;
+    bornFraction = count - born;
+    int room = maxParticles*loadScale - particles.size();
+    if(born > room){
+        born = MAX(room, 0);
+        bornFraction = 0.0;
+    }
+    return born;
 }
 
 float ParticleSystem::randomRange(float percentage, float value){
-    return ofRandom(value-(percentage/100)*value, value+(percentage/100)*value);
+    return random.uniform(value-(percentage/100)*value, value+(percentage/100)*value);
+}
+
+void ParticleSystem::fillRandomRange(float* out, int n, float percentage, float value){
+    random.fillUniform(out, n, value-(percentage/100)*value, value+(percentage/100)*value);
+}
+
+// Same seed gives the same particles, each system uses its own stream
+void ParticleSystem::setSeed(uint64_t seed){
+    random.seed(seed, particleMode);
+}
+
+void ParticleSystem::saveSnapshot(ofBuffer& buffer){
+    buffer.clear();
+    SnapshotArchive archive(buffer, false);
+    transferState(archive);
+}
+
+bool ParticleSystem::loadSnapshot(ofBuffer& buffer){
+    SnapshotArchive archive(buffer, true);
+    if(!transferState(archive)){
+        ofLogWarning("ParticleSystem") << "Snapshot is not of this particle system or it is broken";
+        return false;
+    }
+    return true;
+}
+
+bool ParticleSystem::transferState(SnapshotArchive& archive){
+    // (1) only snapshots of the same mode and size
+    uint32_t magic = SNAPSHOT_MAGIC;
+    uint32_t version = SNAPSHOT_VERSION;
+    int32_t mode = particleMode;
+    int32_t snapshotWidth = width;
+    int32_t snapshotHeight = height;
+    archive.transfer(magic);
+    archive.transfer(version);
+    archive.transfer(mode);
+    archive.transfer(snapshotWidth);
+    archive.transfer(snapshotHeight);
+    if(!archive.isValid() || magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) return false;
+    if(mode != particleMode || snapshotWidth != width || snapshotHeight != height) return false;
+
+    // (2) where the random numbers and the noise are
+    uint32_t randomState[4];
+    random.getState(randomState);
+    for(int k = 0; k < 4; k++) archive.transfer(randomState[k]);
+    float snapshotTime = time;
+    float snapshotRadius = particlesRadius;
+    int32_t snapshotReorder = updatesSinceReorder;
+    float snapshotBornFraction = bornFraction;
+    archive.transfer(snapshotTime);
+    archive.transfer(snapshotRadius);
+    archive.transfer(snapshotReorder);
+    archive.transfer(snapshotBornFraction);
+
+    // parameters that are not set in every update are part of the state too
+    ParticleParams params = particles.params;
+    archive.transfer(params.limitSpeed);
+    archive.transfer(params.maxSpeed);
+    archive.transfer(params.bounceTop);
+    archive.transfer(params.damping);
+
+    if(!archive.isReading()){
+        particles.transfer(archive);
+        return true;
+    }
+
+    // (3) read the particles apart, a broken snapshot leaves them as they were
+    Particles restored;
+    restored.params = params;
+    restored.drawParams = particles.drawParams;
+    restored.transfer(archive);
+    if(!archive.isValid()) return false;
+
+    particles = std::move(restored);
+    particles.reserve(maxParticles);
+    numParticles = particles.size();
+    random.setState(randomState);
+    time = snapshotTime;
+    particlesRadius = snapshotRadius;
+    updatesSinceReorder = snapshotReorder;
+    bornFraction = snapshotBornFraction;
+    sleepGridVersion = -1; // particles are not where the grid has them
+    sleeping = true;       // so the restored sleepers are woken if they can't sleep now
+    return true;
 }
 
-irMarker* ParticleSystem::getClosestMarker(const Particle &particle, vector<irMarker> &markers, float interactionRadiusSqrd){
+// Everything the GUI and the cues change that the update reads, to replay
+// the updates with the same settings
+void ParticleSystem::transferSettings(SnapshotArchive& archive){
+    archive.transfer(isActive);
+    archive.transfer(activeStarted);    archive.transfer(isFadingIn);       archive.transfer(isFadingOut);
+    archive.transfer(startFadeIn);      archive.transfer(startFadeOut);
+    archive.transfer(elapsedFadeTime);  archive.transfer(fadeTime);
+    archive.transfer(opacity);          archive.transfer(maxOpacity);
+    archive.transfer(maxParticles);     archive.transfer(loadScale);
+    archive.transfer(animation);
+    // General
+    archive.transfer(immortal);         archive.transfer(velocity);         archive.transfer(radius);
+    archive.transfer(lifetime);
+    archive.transfer(red);              archive.transfer(green);            archive.transfer(blue);
+    archive.transfer(nParticles);       archive.transfer(bornRate);
+    // Emitter and grid
+    archive.transfer(emitterSize);      archive.transfer(velocityRnd);      archive.transfer(velocityMotion);
+    archive.transfer(lifetimeRnd);      archive.transfer(radiusRnd);
+    archive.transfer(gridRes);          archive.transfer(sleepAtRest);
+    // Flocking
+    archive.transfer(lowThresh);        archive.transfer(highThresh);
+    archive.transfer(separationStrength);   archive.transfer(attractionStrength);   archive.transfer(alignmentStrength);
+    archive.transfer(maxSpeed);         archive.transfer(flockingRadius);
+    // Graphic output
+    archive.transfer(sizeAge);          archive.transfer(opacityAge);       archive.transfer(colorAge);
+    archive.transfer(flickersAge);      archive.transfer(isEmpty);          archive.transfer(drawLine);
+    archive.transfer(drawStroke);       archive.transfer(strokeWidth);
+    archive.transfer(drawTrails);       archive.transfer(trailLength);
+    archive.transfer(drawConnections);  archive.transfer(connectDist);      archive.transfer(connectWidth);
+    archive.transfer(maxConnections);
+    // Physics
+    archive.transfer(friction);         archive.transfer(gravity);          archive.transfer(turbulence);
+    archive.transfer(bounce);           archive.transfer(steer);            archive.transfer(infiniteWalls);
+    archive.transfer(bounceDamping);    archive.transfer(repulse);          archive.transfer(repulseDist);
+    archive.transfer(returnToOriginForce);
+    // Behavior
+    archive.transfer(interact);         archive.transfer(emit);             archive.transfer(flock);
+    archive.transfer(flowInteraction);  archive.transfer(fluidInteraction); archive.transfer(repulseInteraction);
+    archive.transfer(attractInteraction);   archive.transfer(seekInteraction);  archive.transfer(gravityInteraction);
+    archive.transfer(bounceInteraction);    archive.transfer(returnToOrigin);
+    // Input
+    archive.transfer(markersInput);     archive.transfer(contourInput);
+    archive.transfer(interactionForce); archive.transfer(interactionRadius);
+    archive.transfer(emitInMovement);   archive.transfer(emitAllTimeInside);    archive.transfer(emitAllTimeContour);
+    archive.transfer(useFlow);          archive.transfer(useFlowRegion);
+    archive.transfer(useContourArea);   archive.transfer(useContourVel);
+}
+
+irMarker* ParticleSystem::getClosestMarker(const ofPoint& pos, vector<irMarker> &markers, float interactionRadiusSqrd){
     irMarker* closestMarker = NULL;
     float minDistSqrd = interactionRadiusSqrd;
     
     // Get closest marker to particle
     for(int markerIndex = 0; markerIndex < markers.size(); markerIndex++){
         if (!markers[markerIndex].hasDisappeared){
-            float markerDistSqrd = particle.pos.squareDistance(markers[markerIndex].smoothPos);
+            float markerDistSqrd = pos.squareDistance(markers[markerIndex].smoothPos);
             if(markerDistSqrd < minDistSqrd){
                 minDistSqrd = markerDistSqrd;
                 closestMarker = &markers[markerIndex];
@@ -708,14 +1314,14 @@ irMarker* ParticleSystem::getClosestMarker(const Particle &particle, vector<irMa
 }
 
 // Closest marker without distance limit
-irMarker* ParticleSystem::getClosestMarker(const Particle &particle, vector<irMarker> &markers){
+irMarker* ParticleSystem::getClosestMarker(const ofPoint& pos, vector<irMarker> &markers){
     irMarker* closestMarker = NULL;
     float minDistSqrd = 999999999;
     
     // Get closest marker to particle
     for(int markerIndex = 0; markerIndex < markers.size(); markerIndex++){
         if (!markers[markerIndex].hasDisappeared){
-            float markerDistSqrd = particle.pos.squareDistance(markers[markerIndex].smoothPos);
+            float markerDistSqrd = pos.squareDistance(markers[markerIndex].smoothPos);
             if(markerDistSqrd < minDistSqrd){
                 minDistSqrd = markerDistSqrd;
                 closestMarker = &markers[markerIndex];
@@ -725,22 +1331,12 @@ irMarker* ParticleSystem::getClosestMarker(const Particle &particle, vector<irMa
     return closestMarker;
 }
 
-ofPoint ParticleSystem::getClosestPointInContour(const Particle& particle, const Contour& contour, bool onlyInside, unsigned int* contourIdx){
+// Closest point of the silhouettes from the distance field of the contour, a
+// lookup instead of checking every vertex of every contour
+ofPoint ParticleSystem::getClosestPointInContour(const ofPoint& pos, const Contour& contour, bool onlyInside, unsigned int* contourIdx, ofVec2f* normal){
     ofPoint closestPoint(-1, -1);
-    float minDistSqrd = 999999999;
-
-    // Get closest point to particle from the different contours
-    for(unsigned int i = 0; i < contour.contours.size(); i++){
-        if(!onlyInside || contour.contours[i].inside(particle.pos)){
-            ofPoint candidatePoint = contour.contours[i].getClosestPoint(particle.pos);
-            float pointDistSqrd = particle.pos.squareDistance(candidatePoint);
-            if(pointDistSqrd < minDistSqrd){
-                minDistSqrd = pointDistSqrd;
-                closestPoint = candidatePoint;
-                if(contourIdx != NULL) *contourIdx = i; // save contour index
-            }
-        }
-    }
+    int idx = contour.distanceField.getClosestPoint(pos, onlyInside, &closestPoint, normal);
+    if(idx != -1 && contourIdx != NULL) *contourIdx = idx; // save contour index
     return closestPoint;
 }
 
@@ -20,6 +20,11 @@
 #pragma once
 #include "ofMain.h"
 #include "Particle.h"
+#include "NeighborGrid.h"
+#include "ThreadPool.h"
+#include "RandomStream.h"
+#include "NoiseField.h"
+#include "SpawnSampler.h"
 #include "irMarker.h"
 #include "Contour.h"
 #include "Fluid.h"
@@ -27,18 +32,25 @@
 enum ParticleMode {EMITTER, BOIDS, GRID, RANDOM, ANIMATIONS};
 enum InputSource {MARKERS, CONTOUR};
 enum Animation {SNOW, RAIN, EXPLOSION};
+enum UpdatePhase {PHASE_PREPARE, PHASE_INTERACTION, PHASE_EMISSION, PHASE_NEIGHBORS, PHASE_INTEGRATION, NUM_UPDATE_PHASES};
+
+// Particle inside the interaction area of a marker
+struct MarkerContact{
+    int particle;           // Index of the particle
+    int marker;             // Index of its closest marker
+    float distSqrd;         // Squared distance to the marker
+};
 
 class ParticleSystem
 {
     public:
         ParticleSystem();
-        ~ParticleSystem();
 
         void setup(ParticleMode particleMode, int width, int height);
         void update(float dt, vector<irMarker>& markers, Contour& contour, Fluid& fluid);
         void draw();
 
-        void addParticle(ofPoint pos, ofPoint vel, ofColor color, float radius, float lifetime);
+        ParticleHandle addParticle(ofPoint pos, ofPoint vel, ofColor color, float radius, float lifetime);
         void addParticles(int n);
         void addParticles(int n, const irMarker& marker);
         void addParticles(int n, const ofPolyline& contour, Contour& flow);
@@ -51,6 +63,15 @@ class ParticleSystem
         void resetTouchedParticles();
 
         void setAnimation(Animation animation);
+        void setSeed(uint64_t seed);
+        RandomStream& getRandom() {return random;}  // Random numbers of the system, to place particles from outside
+        bool canReduceLoad() const;                 // Does loadScale change anything this system does?
+
+        // Snapshot of the particles, the random stream and the simulation time.
+        // The settings are not in it, they come from the cue
+        void saveSnapshot(ofBuffer& buffer);
+        bool loadSnapshot(ofBuffer& buffer);
+        void transferSettings(SnapshotArchive& archive);
 
         //--------------------------------------------------------------
         bool isActive;          // Particle system active
@@ -69,10 +90,21 @@ class ParticleSystem
         float opacity;
         float maxOpacity;   
         //--------------------------------------------------------------
-        vector<Particle *> particles;
+        Particles particles;
         //--------------------------------------------------------------
-        int numParticles;
-        int totalParticlesCreated;
+        int numParticles;           // Number of living particles
+        int maxParticles;           // Capacity of the particle pool
+        int numAwake;               // Number of particles updated in the last frame
+        //--------------------------------------------------------------
+        ThreadPool* threadPool;     // Threads to split the update (NULL to update in the calling thread)
+        float updateTime;           // Time spent in the last update (ms)
+        float phaseTime[NUM_UPDATE_PHASES]; // Time spent in each phase of the last update (ms)
+        float drawTime;             // Time spent in the last draw (ms)
+        float loadScale;            // Fraction of the load allowed by the frame governor (1 = all)
+        float interpolation;        // Fraction of the next simulation step already elapsed, to draw in between
+        ofBuffer startSnapshot;     // State to start from when it becomes active instead of new particles (empty for new ones)
+        int reorderUpdates;         // Sort the particles in memory in Z-order every this many updates (0 never)
+        float reorderDisorder;      // or before, when this fraction of them is out of order (0 never)
         //--------------------------------------------------------------
         ParticleMode particleMode;
         //--------------------------------------------------------------
@@ -87,7 +119,7 @@ class ParticleSystem
         //--------------------------------------------------------------
         // Specific properties
         int nParticles;             // Number of particles born in the beginning
-        float bornRate;             // Number of particles born per frame
+        float bornRate;             // Number of particles born per frame (at 60 fps)
         //--------------------------------------------------------------
         // Emitter
         float emitterSize;          // Size of the emitter area
@@ -98,6 +130,7 @@ class ParticleSystem
         //--------------------------------------------------------------
         // Grid
         int gridRes;                // Resolution of the grid
+        bool sleepAtRest;           // Particles resting at their origin are not updated until some input gets close?
         //--------------------------------------------------------------
         // Flocking
         float lowThresh;            // If dist. ratio lower than lowThresh separate
@@ -117,9 +150,12 @@ class ParticleSystem
         bool drawLine;              // Draw a line instead of a circle for the particle?
         bool drawStroke;            // Draw stroke line around particle?
         float strokeWidth;          // Stroke line width
+        bool drawTrails;            // Draw a fading trail behind the particle?
+        int trailLength;            // Positions in the trail (one per simulation step)
         bool drawConnections;       // Draw a connecting line between close particles?
         float connectDist;          // Maximum distance to connect particles with line
         float connectWidth;         // Connected line width
+        int maxConnections;         // Maximum number of connected lines per particle
         //--------------------------------------------------------------
         // Physics
         float friction;             // Friction to velocity 0~100
@@ -163,13 +199,61 @@ class ParticleSystem
         // Helper functions
         ofPoint randomVector();
         float randomRange(float percentage, float value);
-        irMarker* getClosestMarker(const Particle& particle, vector<irMarker>& markers, float interactionRadiusSqrd);
-        irMarker* getClosestMarker(const Particle &particle, vector<irMarker>& markers);
-        ofPoint getClosestPointInContour(const Particle& particle, const Contour& contour, bool onlyInside = true, unsigned int* contourIdx = NULL);
+        void fillRandomRange(float* out, int n, float percentage, float value);
+        int spawnCount(float n, float dt);
+        float getRadiusScale() const {return 0.5f + 0.5f*loadScale;}
+        irMarker* getClosestMarker(const ofPoint& pos, vector<irMarker>& markers, float interactionRadiusSqrd);
+        irMarker* getClosestMarker(const ofPoint& pos, vector<irMarker>& markers);
+        ofPoint getClosestPointInContour(const ofPoint& pos, const Contour& contour, bool onlyInside = true, unsigned int* contourIdx = NULL, ofVec2f* normal = NULL);
     
         void fadeIn(float dt);
         void fadeOut(float dt);
     
-        void repulseParticles();
-        void flockParticles();
+        typedef void (ParticleSystem::*InteractKernel)(int begin, int end, vector<irMarker>& markers, Contour& contour, Fluid& fluid);
+        template<unsigned int flags> void interactParticles(int begin, int end, vector<irMarker>& markers, Contour& contour, Fluid& fluid);
+        template<unsigned int flags> static InteractKernel makeInteractKernel(std::true_type);
+        template<unsigned int flags> static InteractKernel makeInteractKernel(std::false_type);
+        template<unsigned int flags> static void addInteractKernels(vector<InteractKernel>& kernels);
+        static vector<InteractKernel> getInteractKernels();
+        InteractKernel getInteractKernel() const;
+        void gatherMarkerContacts(vector<irMarker>& markers);
+        void interactMarker(int i, irMarker& marker, float markerDistSqrd, Contour& contour);
+        void repulseParticles(bool parallel);
+        void flockParticles(bool parallel);
+        void updateConnections();
+        void updateNoiseFields();
+        bool canSleep() const;
+        void wakeParticles(vector<irMarker>& markers, Contour& contour, Fluid& fluid);
+        void sleepParticles(int begin, int end);
+        void buildAwakeRanges(bool sleep);
+        void reorderParticles();
+        void addAwakeRange(int begin, int end);
+        void forEachAwakeRange(bool parallel, const function<void(int, int)>& f);
+        bool transferState(SnapshotArchive& archive);
+        //--------------------------------------------------------------
+        NeighborGrid neighborGrid;  // Spatial index for particle/particle interactions
+        NeighborGrid connectionsGrid;   // Spatial index to find the particles to connect
+        NeighborGrid markersGrid;       // Spatial index to find the particles around the markers
+        NeighborGrid sleepGrid;         // Particles grouped by their origin, to wake them by areas
+        unsigned int sleepGridVersion;  // Layout of the particles when sleepGrid was built
+        vector<unsigned char> wokenCells;   // Cells of sleepGrid reached by some input this frame
+        bool sleeping;                  // Could the particles sleep in the last update?
+        vector< pair<int, int> > awakeRanges;   // Ranges [begin, end) of the particles updated this frame
+        vector<MarkerContact> markerContacts;   // Particles touched by a marker this frame
+        vector<int> markerContactIndex; // Position of each particle in markerContacts (-1 if none)
+        vector<int> numConnections;     // Number of connected lines of each particle
+        vector<float> drawX, drawY;     // Interpolated positions to connect
+        ofVboMesh connectionsMesh;      // All the connected lines drawn in one call
+        ofVboMesh particlesMesh;        // All the particles drawn in one call
+        float time;                     // Simulation time, the sum of the steps of the updates
+        float particlesRadius;          // Radius given to the particles of immortal systems (-1 if none)
+        int updatesSinceReorder;        // Updates since the particles were sorted in memory
+        float bornFraction;             // Part of a particle left to be born in the next updates
+        RandomStream random;            // Random numbers of this system
+        vector<float> spawnRandom;      // Random numbers of a spawn burst
+        SpawnSampler spawnSampler;      // Spawn positions inside and along the contours
+        NoiseField turbulenceField;     // Angle of the turbulence
+        NoiseField windField;           // Horizontal wind of the snow
+        NoiseField gustXField;          // Horizontal gusts of the snow, changing with y
+        NoiseField gustYField;          // Vertical gusts of the snow, changing with x
 };
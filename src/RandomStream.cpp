@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "RandomStream.h"
+
+// splitmix64 step, used to expand the seeds and to hash the counters
+static inline uint64_t splitMix(uint64_t x){
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static inline uint32_t rotl(uint32_t x, int k){
+    return (x << k) | (x >> (32 - k));
+}
+
+// 24 random bits to a float in [0, 1)
+static inline float toUniform(uint32_t bits){
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+RandomStream::RandomStream(uint64_t seed, uint64_t stream){
+    this->seed(seed, stream);
+}
+
+// Different streams of the same seed give independent sequences
+void RandomStream::seed(uint64_t seed, uint64_t stream){
+    uint64_t a = splitMix(seed ^ splitMix(stream));
+    uint64_t b = splitMix(a);
+    state[0] = (uint32_t)a;
+    state[1] = (uint32_t)(a >> 32);
+    state[2] = (uint32_t)b;
+    state[3] = (uint32_t)(b >> 32);
+    if((state[0] | state[1] | state[2] | state[3]) == 0) state[0] = 1; // all zero state never changes
+}
+
+void RandomStream::getState(uint32_t state[4]) const{
+    for(int k = 0; k < 4; k++) state[k] = this->state[k];
+}
+
+void RandomStream::setState(const uint32_t state[4]){
+    for(int k = 0; k < 4; k++) this->state[k] = state[k];
+    if((this->state[0] | this->state[1] | this->state[2] | this->state[3]) == 0) this->state[0] = 1;
+}
+
+uint32_t RandomStream::next(){
+    uint32_t result = rotl(state[1] * 5, 7) * 9;
+    uint32_t t = state[1] << 9;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 11);
+
+    return result;
+}
+
+uint64_t RandomStream::next64(){
+    uint64_t high = next();
+    return (high << 32) | next();
+}
+
+float RandomStream::uniform(){
+    return toUniform(next());
+}
+
+float RandomStream::uniform(float max){
+    return uniform() * max;
+}
+
+float RandomStream::uniform(float min, float max){
+    return min + uniform() * (max - min);
+}
+
+float RandomStream::signedUniform(){
+    return uniform() * 2.0f - 1.0f;
+}
+
+ofPoint RandomStream::unitVector(){
+    float angle = uniform() * (float)TWO_PI;
+    return ofPoint(cos(angle), sin(angle));
+}
+
+void RandomStream::fillUniform(float* out, int n, float min, float max){
+    float range = max - min;
+    for(int i = 0; i < n; i++){
+        out[i] = min + toUniform(next()) * range;
+    }
+}
+
+void RandomStream::fillUnitVectors(float* outX, float* outY, int n){
+    for(int i = 0; i < n; i++){
+        float angle = toUniform(next()) * (float)TWO_PI;
+        outX[i] = cos(angle);
+        outY[i] = sin(angle);
+    }
+}
+
+float RandomStream::hashUniform(uint64_t key, uint64_t counter){
+    return toUniform((uint32_t)(splitMix(key ^ splitMix(counter)) >> 32));
+}
+
+float RandomStream::hashUniform(uint64_t key, uint64_t counter, float min, float max){
+    return min + hashUniform(key, counter) * (max - min);
+}
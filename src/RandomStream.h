@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+
+// Seedable random number generator (xoshiro128**). Unlike ofRandom it has no
+// global state: each particle system has its own stream, so the sequence of a
+// system only depends on its seed and not on what the others do.
+//
+// For work that is split among threads there are also counter-based numbers:
+// hashUniform(key, counter) always gives the same value for the same key and
+// counter, no matter which thread asks or in which order.
+class RandomStream
+{
+    public:
+        RandomStream(uint64_t seed = 0, uint64_t stream = 0);
+
+        void seed(uint64_t seed, uint64_t stream = 0);
+
+        // Whole state of the stream, to save it and continue it later
+        void getState(uint32_t state[4]) const;
+        void setState(const uint32_t state[4]);
+
+        uint32_t next();
+        uint64_t next64();
+
+        float uniform();                        // [0, 1)
+        float uniform(float max);               // [0, max)
+        float uniform(float min, float max);    // [min, max)
+        float signedUniform();                  // [-1, 1)
+        ofPoint unitVector();                   // Random direction of length 1
+
+        // Batch versions, to generate all the numbers of a spawn burst at once
+        void fillUniform(float* out, int n, float min, float max);
+        void fillUnitVectors(float* outX, float* outY, int n);
+
+        static float hashUniform(uint64_t key, uint64_t counter);
+        static float hashUniform(uint64_t key, uint64_t counter, float min, float max);
+
+    protected:
+        uint32_t state[4];
+};
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#pragma once
+#include "ofMain.h"
+
+// Even-odd scanline fill of a closed contour, in rows of height cellSize with
+// their centers at (r + 0.5)*cellSize. Calls f(r, x0, x1) for every span
+// [x0, x1) of the row r inside the contour, for the rows in [minRow, maxRow].
+// crossings is work memory, kept by the caller so it is not allocated again
+template<typename F> void forEachScanlineSpan(const ofPolyline& contour, float cellSize, int minRow, int maxRow, vector< pair<int, float> >& crossings, F f){
+    const vector<ofPoint>& points = contour.getVertices();
+    int n = points.size();
+
+    // (1) x where each edge crosses the centers of the rows
+    crossings.clear();
+    for(int j = 0; j < n && n > 2; j++){
+        const ofPoint& a = points[j];
+        const ofPoint& b = points[(j+1) % n];
+        if(a.y == b.y) continue;
+        // rows with the center in [minY, maxY)
+        int firstRow = MAX((int)ceil(MIN(a.y, b.y)/cellSize - 0.5f), minRow);
+        int lastRow = MIN((int)ceil(MAX(a.y, b.y)/cellSize - 0.5f) - 1, maxRow);
+        for(int r = firstRow; r <= lastRow; r++){
+            float y = (r + 0.5f) * cellSize;
+            crossings.push_back(make_pair(r, a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y)));
+        }
+    }
+
+    // (2) spans between each pair of crossings of a row
+    sort(crossings.begin(), crossings.end());
+    for(unsigned int k = 0; k+1 < crossings.size(); k += 2){
+        int r = crossings[k].first;
+        if(crossings[k+1].first != r){ // should not happen, resync
+            k--;
+            continue;
+        }
+        f(r, crossings[k].second, crossings[k+1].second);
+    }
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+
+// Binary archive of the particle snapshots and recordings. The same function
+// writes and reads the values (archive.transfer(value)), so they are always
+// read in the order they were written. Only for plain values stored in the
+// native layout, the files are meant to be read on the same machine.
+//
+// Reading past the end of the buffer leaves the values untouched and makes the
+// archive invalid, so a truncated file is detected and not half loaded.
+class SnapshotArchive
+{
+    public:
+        SnapshotArchive(ofBuffer& buffer, bool reading);
+
+        bool isReading() const {return reading;}
+        bool isValid() const {return valid;}
+        bool hasBytes(size_t size) const {return !reading || offset + size <= buffer.size();}
+        void setInvalid() {valid = false;}
+
+        template<typename T> void transfer(T& value);
+        template<typename T> void transfer(vector<T>& values, int n);   // First n values, the vector must be large enough to read them
+        template<typename T> void transfer(vector<T>& values);          // Size and values
+        void transfer(ofBuffer& data);
+        void transfer(ofPolyline& polyline);
+        void transfer(vector<ofPolyline>& polylines);
+        void transfer(ofFloatPixels& pixels);
+
+    protected:
+        void write(const void* data, size_t size);
+        void read(void* data, size_t size);
+        //--------------------------------------------------------------
+        ofBuffer& buffer;
+        bool reading;           // Reading or writing?
+        bool valid;             // Everything could be read?
+        size_t offset;          // Next byte to read
+};
+
+inline SnapshotArchive::SnapshotArchive(ofBuffer& buffer, bool reading) : buffer(buffer){
+    this->reading = reading;
+    valid = true;
+    offset = 0;
+}
+
+inline void SnapshotArchive::write(const void* data, size_t size){
+    buffer.append((const char*)data, size);
+}
+
+inline void SnapshotArchive::read(void* data, size_t size){
+    if(!valid || offset + size > buffer.size()){
+        valid = false;
+        return;
+    }
+    memcpy(data, buffer.getData() + offset, size);
+    offset += size;
+}
+
+template<typename T> void SnapshotArchive::transfer(T& value){
+    if(reading) read(&value, sizeof(T));
+    else write(&value, sizeof(T));
+}
+
+template<typename T> void SnapshotArchive::transfer(vector<T>& values, int n){
+    if(n <= 0) return;
+    if(reading){
+        if((int)values.size() < n) valid = false;
+        else read(values.data(), n*sizeof(T));
+    }
+    else write(values.data(), n*sizeof(T));
+}
+
+template<typename T> void SnapshotArchive::transfer(vector<T>& values){
+    uint32_t n = values.size();
+    transfer(n);
+    if(reading){
+        if(!valid || offset + (size_t)n*sizeof(T) > buffer.size()){ // do not allocate for a broken size
+            valid = false;
+            return;
+        }
+        values.resize(n);
+    }
+    transfer(values, n);
+}
+
+inline void SnapshotArchive::transfer(ofBuffer& data){
+    uint64_t size = data.size();
+    transfer(size);
+    if(!reading){
+        write(data.getData(), size);
+        return;
+    }
+    if(!valid || offset + size > buffer.size()){
+        valid = false;
+        return;
+    }
+    data.set(buffer.getData() + offset, size);
+    offset += size;
+}
+
+inline void SnapshotArchive::transfer(ofPolyline& polyline){
+    vector<ofPoint> vertices;
+    uint8_t closed = 0;
+    if(!reading){
+        vertices = polyline.getVertices();
+        closed = polyline.isClosed();
+    }
+    transfer(vertices);
+    transfer(closed);
+    if(reading && valid){
+        polyline.clear();
+        polyline.addVertices(vertices);
+        polyline.setClosed(closed);
+    }
+}
+
+inline void SnapshotArchive::transfer(vector<ofPolyline>& polylines){
+    uint32_t n = polylines.size();
+    transfer(n);
+    if(reading){
+        if(!valid) return;
+        polylines.resize(n);
+    }
+    for(uint32_t i = 0; i < n && valid; i++) transfer(polylines[i]);
+}
+
+inline void SnapshotArchive::transfer(ofFloatPixels& pixels){
+    int32_t width = pixels.getWidth();
+    int32_t height = pixels.getHeight();
+    int32_t channels = pixels.getNumChannels();
+    transfer(width);
+    transfer(height);
+    transfer(channels);
+    if(!valid) return;
+
+    size_t size = (size_t)MAX(width, 0)*MAX(height, 0)*MAX(channels, 0)*sizeof(float);
+    if(reading){
+        if(offset + size > buffer.size()){ // do not allocate for a broken size
+            valid = false;
+            return;
+        }
+        if(size == 0) pixels.clear();
+        else{
+            pixels.allocate(width, height, channels);
+            read(pixels.getData(), size);
+        }
+    }
+    else if(size > 0) write(pixels.getData(), size);
+}
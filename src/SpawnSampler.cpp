@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "SpawnSampler.h"
+#include "Scanline.h"
+#include <climits>
+
+SpawnSampler::SpawnSampler(){
+    cellSize = 2.0;
+}
+
+void SpawnSampler::setup(float cellSize){
+    this->cellSize = MAX(cellSize, 1.0f);
+}
+
+void SpawnSampler::setArea(const ofPolyline& contour, Contour* flow){
+    spanY.clear();
+    spanX.clear();
+    spanWidth.clear();
+    segments.clear();
+    weights.clear();
+
+    // spans of the scanline fill. With flow the spans are cut in cells so each
+    // one gets the flow where it is
+    float totalWeight = 0;
+    forEachScanlineSpan(contour, cellSize, INT_MIN, INT_MAX, crossings, [&](int r, float x0, float x1){
+        if(x1 <= x0) return;
+        float y = r * cellSize;
+
+        if(flow == NULL){
+            spanY.push_back(y);
+            spanX.push_back(x0);
+            spanWidth.push_back(x1 - x0);
+            weights.push_back(x1 - x0);
+        }
+        else{
+            for(float x = x0; x < x1; x += cellSize){
+                float w = MIN(cellSize, x1 - x);
+                float weight = flow->getFlowOffset(ofPoint(x + w*0.5f, y + cellSize*0.5f)).length() * w;
+                spanY.push_back(y);
+                spanX.push_back(x);
+                spanWidth.push_back(w);
+                weights.push_back(weight);
+                totalWeight += weight;
+            }
+        }
+    });
+
+    // no movement at all, be uniform in area
+    if(flow != NULL && totalWeight <= 0){
+        for(unsigned int k = 0; k < weights.size(); k++) weights[k] = spanWidth[k];
+    }
+
+    buildAliasTable();
+}
+
+void SpawnSampler::setContour(const ofPolyline& contour){
+    spanY.clear();
+    spanX.clear();
+    spanWidth.clear();
+    segments.clear();
+    weights.clear();
+
+    const vector<ofPoint>& points = contour.getVertices();
+    int n = points.size();
+    int numSegments = contour.isClosed() ? n : n-1;
+    for(int j = 0; j < numSegments; j++){
+        float length = points[j].distance(points[(j+1) % n]);
+        if(length <= 0) continue;
+        segments.push_back(j);
+        weights.push_back(length);
+    }
+
+    buildAliasTable();
+}
+
+bool SpawnSampler::sampleArea(RandomStream& random, ofPoint& pos) const{
+    if(spanWidth.empty()) return false;
+    int k = sampleAliasTable(random);
+    pos.x = spanX[k] + random.uniform() * spanWidth[k];
+    pos.y = spanY[k] + random.uniform() * cellSize;
+    return true;
+}
+
+float SpawnSampler::sampleContour(RandomStream& random) const{
+    if(segments.empty()) return -1;
+    int k = sampleAliasTable(random);
+    return segments[k] + random.uniform();
+}
+
+// Alias table (Vose) over the weights: every item is split between its own
+// slot and the slot of an item that had too much, so a sample is one uniform
+// number to pick a slot and another to pick between the two
+void SpawnSampler::buildAliasTable(){
+    int n = weights.size();
+    probability.resize(n);
+    alias.resize(n);
+    if(n == 0) return;
+
+    double total = 0;
+    for(int i = 0; i < n; i++) total += weights[i];
+
+    // (1) scale the weights so the average is 1
+    smallItems.clear();
+    largeItems.clear();
+    for(int i = 0; i < n; i++){
+        probability[i] = (total > 0) ? weights[i] * n / total : 1.0f;
+        alias[i] = i;
+        if(probability[i] < 1.0f) smallItems.push_back(i);
+        else largeItems.push_back(i);
+    }
+
+    // (2) fill the slots with too little with the ones with too much
+    while(!smallItems.empty() && !largeItems.empty()){
+        int s = smallItems.back(); smallItems.pop_back();
+        int l = largeItems.back();
+        alias[s] = l;
+        probability[l] -= 1.0f - probability[s];
+        if(probability[l] < 1.0f){
+            largeItems.pop_back();
+            smallItems.push_back(l);
+        }
+    }
+
+    // (3) what is left is 1 (up to rounding errors)
+    for(unsigned int i = 0; i < largeItems.size(); i++) probability[largeItems[i]] = 1.0f;
+    for(unsigned int i = 0; i < smallItems.size(); i++) probability[smallItems[i]] = 1.0f;
+}
+
+int SpawnSampler::sampleAliasTable(RandomStream& random) const{
+    int n = probability.size();
+    int i = (int)(random.uniform() * n);
+    if(i >= n) i = n-1;
+    return (random.uniform() < probability[i]) ? i : alias[i];
+}
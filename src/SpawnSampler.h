@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include "RandomStream.h"
+#include "Contour.h"
+
+// Random spawn positions inside or along a contour, without rejection sampling.
+//
+// The inside of the contour is cut in horizontal spans (scanline fill) and the
+// spans are picked with an alias table, so every sample costs the same no
+// matter how thin the shape is. The spans can be weighted by their area or by
+// the optical flow on them. Along the contour the segments are weighted by
+// their length, so the samples are uniform in arc length.
+class SpawnSampler
+{
+    public:
+        SpawnSampler();
+
+        void setup(float cellSize = 2.0);
+
+        // Prepare to sample the inside of the contour, uniform in area or, if
+        // flow is given, proportional to the magnitude of the optical flow
+        void setArea(const ofPolyline& contour, Contour* flow = NULL);
+
+        // Prepare to sample along the contour, uniform in length
+        void setContour(const ofPolyline& contour);
+
+        // Random point inside the contour given to setArea (false if it has no area)
+        bool sampleArea(RandomStream& random, ofPoint& pos) const;
+
+        // Random interpolated index along the contour given to setContour (-1 if it has no length)
+        float sampleContour(RandomStream& random) const;
+        //--------------------------------------------------------------
+        float cellSize;             // Height of the spans (and width of the flow cells)
+
+    protected:
+        void buildAliasTable();
+        int sampleAliasTable(RandomStream& random) const;
+        //--------------------------------------------------------------
+        vector<float> spanY;        // Top of each span
+        vector<float> spanX;        // Left of each span
+        vector<float> spanWidth;    // Width of each span
+        vector<int> segments;       // Index of the first vertex of each segment
+        vector<float> weights;      // Weight of each span or segment
+        //--------------------------------------------------------------
+        vector<float> probability;  // Alias table: keep the item with this probability
+        vector<int> alias;          // or take this one instead
+        vector<int> smallItems, largeItems;   // Work lists to build the table
+        vector< pair<int, float> > crossings; // Rows and x where the contour crosses the row centers
+};
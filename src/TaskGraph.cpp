@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#include "TaskGraph.h"
+
+TaskGraph::TaskGraph(){
+    unfinishedTasks     = 0;
+    quit                = false;
+    totalTime           = 0.0;
+    sequentialTime      = 0.0;
+    criticalPathTime    = 0.0;
+    criticalPathEnd     = -1;
+}
+
+TaskGraph::~TaskGraph(){
+    setup(0);
+}
+
+void TaskGraph::setup(int numWorkers){
+    numWorkers = MAX(numWorkers, 0);
+    if(numWorkers == (int)workers.size()) return;
+
+    {
+        lock_guard<mutex> lock(queueMutex);
+        quit = true;
+    }
+    taskReady.notify_all();
+    for(unsigned int w = 0; w < workers.size(); w++){
+        workers[w].join();
+    }
+    workers.clear();
+
+    quit = false;
+    for(int w = 0; w < numWorkers; w++){
+        workers.push_back(thread(&TaskGraph::workerLoop, this));
+    }
+}
+
+void TaskGraph::clear(){
+    tasks.clear();
+    accesses.clear();
+}
+
+int TaskGraph::addTask(const string& name, const vector<const void*>& reads, const vector<const void*>& writes,
+                       const function<void()>& f, bool mainThread){
+    int t = tasks.size();
+    Task task;
+    task.name = name;
+    task.f = f;
+    task.mainThread = mainThread;
+    task.pending = 0;
+    task.time = 0;
+    task.pathTime = 0;
+    task.pathPrevious = -1;
+    tasks.push_back(task);
+
+    // (1) reading waits for the last writer
+    for(unsigned int k = 0; k < reads.size(); k++){
+        Access& access = accesses.insert(make_pair(reads[k], Access{-1, vector<int>()})).first->second;
+        if(access.lastWriter != -1) addDependency(t, access.lastWriter);
+        access.readers.push_back(t);
+    }
+
+    // (2) writing waits for the last writer and for everybody reading since
+    for(unsigned int k = 0; k < writes.size(); k++){
+        Access& access = accesses.insert(make_pair(writes[k], Access{-1, vector<int>()})).first->second;
+        if(access.lastWriter != -1) addDependency(t, access.lastWriter);
+        for(unsigned int r = 0; r < access.readers.size(); r++){
+            if(access.readers[r] != t) addDependency(t, access.readers[r]);
+        }
+        access.lastWriter = t;
+        access.readers.clear();
+    }
+    return t;
+}
+
+void TaskGraph::addDependency(int task, int dependency){
+    vector<int>& dependencies = tasks[task].dependencies;
+    if(find(dependencies.begin(), dependencies.end(), dependency) != dependencies.end()) return;
+    dependencies.push_back(dependency);
+    tasks[dependency].successors.push_back(task);
+}
+
+void TaskGraph::run(){
+    uint64_t startTime = ofGetElapsedTimeMicros();
+
+    // (1) the tasks without dependencies are ready
+    {
+        lock_guard<mutex> lock(queueMutex);
+        unfinishedTasks = tasks.size();
+        for(unsigned int t = 0; t < tasks.size(); t++){
+            tasks[t].pending = tasks[t].dependencies.size();
+            if(tasks[t].pending > 0) continue;
+            if(tasks[t].mainThread || workers.empty()) readyMainTasks.push_back(t);
+            else readyTasks.push_back(t);
+        }
+    }
+    taskReady.notify_all();
+
+    // (2) run the tasks of this thread, and the others while there are none
+    while(true){
+        int t;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            while(unfinishedTasks > 0 && readyMainTasks.empty() && readyTasks.empty()) mainReady.wait(lock);
+            if(unfinishedTasks == 0) break;
+            deque<int>& queue = readyMainTasks.empty() ? readyTasks : readyMainTasks;
+            t = queue.front();
+            queue.pop_front();
+        }
+        execute(t);
+    }
+
+    // (3) times, the dependencies are always added before the task
+    totalTime = (ofGetElapsedTimeMicros() - startTime) / 1000.0f;
+    sequentialTime = 0;
+    criticalPathTime = 0;
+    criticalPathEnd = -1;
+    for(unsigned int t = 0; t < tasks.size(); t++){
+        Task& task = tasks[t];
+        task.pathTime = task.time;
+        task.pathPrevious = -1;
+        for(unsigned int d = 0; d < task.dependencies.size(); d++){
+            const Task& dependency = tasks[task.dependencies[d]];
+            if(dependency.pathTime + task.time > task.pathTime){
+                task.pathTime = dependency.pathTime + task.time;
+                task.pathPrevious = task.dependencies[d];
+            }
+        }
+        sequentialTime += task.time;
+        if(task.pathTime >= criticalPathTime){
+            criticalPathTime = task.pathTime;
+            criticalPathEnd = t;
+        }
+    }
+}
+
+// Run a task and make ready the ones that were only waiting for it
+void TaskGraph::execute(int t){
+    Task& task = tasks[t];
+    uint64_t startTime = ofGetElapsedTimeMicros();
+    task.f();
+    task.time = (ofGetElapsedTimeMicros() - startTime) / 1000.0f;
+
+    bool workerTasks = false;
+    {
+        lock_guard<mutex> lock(queueMutex);
+        for(unsigned int s = 0; s < task.successors.size(); s++){
+            int successor = task.successors[s];
+            if(--tasks[successor].pending > 0) continue;
+            if(tasks[successor].mainThread || workers.empty()) readyMainTasks.push_back(successor);
+            else{
+                readyTasks.push_back(successor);
+                workerTasks = true;
+            }
+        }
+        unfinishedTasks--;
+    }
+    if(workerTasks) taskReady.notify_all();
+    mainReady.notify_one();
+}
+
+void TaskGraph::workerLoop(){
+    while(true){
+        int t;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            while(!quit && readyTasks.empty()) taskReady.wait(lock);
+            if(quit) return;
+            t = readyTasks.front();
+            readyTasks.pop_front();
+        }
+        execute(t);
+    }
+}
+
+string TaskGraph::getCriticalPath() const{
+    string path;
+    for(int t = criticalPathEnd; t != -1; t = tasks[t].pathPrevious){
+        path = tasks[t].name + (path.empty() ? "" : " > ") + path;
+    }
+    return path;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#pragma once
+#include "ofMain.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Work of a frame as a graph of tasks. Each task says which data it reads and
+// which data it writes (any address that identifies it). A task waits for the
+// tasks added before it that write what it reads, and for the ones that read
+// or write what it writes. So running the graph gives the same result as
+// running the tasks in the order they were added, but tasks that do not share
+// data run at the same time, and the frame takes the time of the longest chain
+// of dependent tasks (the critical path) instead of the sum of all of them.
+//
+// Tasks that use OpenGL have to run in the thread that calls run(), which
+// also takes the other tasks while it has nothing of its own to do.
+class TaskGraph
+{
+    public:
+        TaskGraph();
+        ~TaskGraph();
+
+        // Worker threads besides the calling one (0 runs everything in the calling thread)
+        void setup(int numWorkers);
+        int  getNumWorkers() const {return workers.size();}
+
+        void clear();
+        int  addTask(const string& name, const vector<const void*>& reads, const vector<const void*>& writes,
+                     const function<void()>& f, bool mainThread = false);
+        void run();
+
+        // Times of the last run (ms)
+        float getTotalTime() const {return totalTime;}              // From the start to the end of the graph
+        float getSequentialTime() const {return sequentialTime;}    // Sum of the times of all the tasks
+        float getCriticalPathTime() const {return criticalPathTime;}// Longest chain of dependent tasks
+        string getCriticalPath() const;                             // Names of the tasks of that chain
+
+    protected:
+        struct Task{
+            string name;
+            function<void()> f;
+            bool mainThread;            // Has to run in the thread that calls run()?
+            vector<int> dependencies;   // Tasks it waits for (added before it)
+            vector<int> successors;     // Tasks waiting for it
+            int pending;                // Dependencies not finished yet in this run
+            float time;                 // Time it took in the last run (ms)
+            float pathTime;             // Longest chain of dependencies ending with this task (ms)
+            int pathPrevious;           // Previous task of that chain (-1 if none)
+        };
+        struct Access{
+            int lastWriter;             // Last task added that writes it (-1 if none)
+            vector<int> readers;        // Tasks added after lastWriter that read it
+        };
+
+        void addDependency(int task, int dependency);
+        void execute(int task);
+        void workerLoop();
+        //--------------------------------------------------------------
+        vector<Task> tasks;
+        map<const void*, Access> accesses;  // Who accessed each data so far, while adding tasks
+        //--------------------------------------------------------------
+        vector<thread> workers;
+        mutex queueMutex;
+        condition_variable taskReady;       // Workers wait here for tasks
+        condition_variable mainReady;       // Calling thread waits here for its tasks or the end
+        deque<int> readyTasks;              // Tasks any thread can run
+        deque<int> readyMainTasks;          // Tasks for the calling thread
+        int unfinishedTasks;
+        bool quit;
+        //--------------------------------------------------------------
+        float totalTime;
+        float sequentialTime;
+        float criticalPathTime;
+        int criticalPathEnd;                // Last task of the critical path (-1 if none)
+};
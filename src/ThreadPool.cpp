@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(){
+    numThreads      = 1;
+    job             = NULL;
+    jobSize         = 0;
+    jobChunks       = 0;
+    pendingChunks   = 0;
+    jobGeneration   = 0;
+    quit            = false;
+}
+
+ThreadPool::~ThreadPool(){
+    stop();
+}
+
+void ThreadPool::setup(int numThreads){
+    numThreads = MAX(numThreads, 1);
+    if(numThreads == this->numThreads && (int)workers.size() == numThreads-1) return;
+
+    stop();
+
+    this->numThreads = numThreads;
+    quit = false;
+    for(int w = 1; w < numThreads; w++){
+        workers.push_back(thread(&ThreadPool::workerLoop, this, w, jobGeneration));
+    }
+}
+
+void ThreadPool::stop(){
+    {
+        lock_guard<mutex> lock(jobMutex);
+        quit = true;
+    }
+    jobStarted.notify_all();
+    for(unsigned int w = 0; w < workers.size(); w++){
+        workers[w].join();
+    }
+    workers.clear();
+    numThreads = 1;
+}
+
+void ThreadPool::parallelFor(int n, const function<void(int, int)>& f, int minChunk){
+    if(n <= 0) return;
+
+    int chunks = MIN(numThreads, (n + minChunk - 1) / MAX(minChunk, 1));
+    if(chunks <= 1){
+        f(0, n);
+        return;
+    }
+
+    // (1) publish the job and wake up the workers
+    lock_guard<mutex> call(callMutex);
+    {
+        lock_guard<mutex> lock(jobMutex);
+        job = &f;
+        jobSize = n;
+        jobChunks = chunks;
+        pendingChunks = chunks-1;
+        jobGeneration++;
+    }
+    jobStarted.notify_all();
+
+    // (2) first chunk is done by the calling thread
+    runChunk(0);
+
+    // (3) wait for the rest
+    unique_lock<mutex> lock(jobMutex);
+    while(pendingChunks > 0) jobFinished.wait(lock);
+    job = NULL;
+}
+
+// lastGeneration is the job generation when the worker was created, so a job
+// published before the thread gets to run is not missed
+void ThreadPool::workerLoop(int worker, unsigned int lastGeneration){
+    while(true){
+        {
+            unique_lock<mutex> lock(jobMutex);
+            while(!quit && jobGeneration == lastGeneration) jobStarted.wait(lock);
+            if(quit) return;
+            lastGeneration = jobGeneration;
+            if(worker >= jobChunks) continue; // job is too small to need this worker
+        }
+
+        runChunk(worker);
+
+        bool lastChunk;
+        {
+            lock_guard<mutex> lock(jobMutex);
+            lastChunk = (--pendingChunks == 0);
+        }
+        if(lastChunk) jobFinished.notify_one();
+    }
+}
+
+void ThreadPool::runChunk(int chunk){
+    int begin = (int)((long long)jobSize * chunk / jobChunks);
+    int end = (int)((long long)jobSize * (chunk+1) / jobChunks);
+    if(begin < end) (*job)(begin, end);
+}
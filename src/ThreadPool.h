@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 Fabia Serra Arrizabalaga
+ *
+ * This file is part of Crea
+ *
+ * Crea is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation (FSF), either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the Affero GNU General Public License
+ * version 3 along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+#pragma once
+#include "ofMain.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Fixed set of worker threads to split index ranges. The calling thread also
+// does one of the chunks, so a pool of N threads starts N-1 workers. Chunks
+// are contiguous and always split the same way for the same size and number
+// of threads, so the work done by each thread does not depend on timing.
+// Several threads can share a pool, their jobs run one after the other.
+class ThreadPool
+{
+    public:
+        ThreadPool();
+        ~ThreadPool();
+
+        void setup(int numThreads);
+        int  getNumThreads() const {return numThreads;}
+
+        // Call f(begin, end) for contiguous chunks covering [0, n) and wait
+        // until all of them are done. Ranges smaller than minChunk per thread
+        // are not worth waking the workers and run in the calling thread.
+        void parallelFor(int n, const function<void(int, int)>& f, int minChunk = 256);
+
+    protected:
+        void stop();
+        void workerLoop(int worker, unsigned int lastGeneration);
+        void runChunk(int chunk);
+        //--------------------------------------------------------------
+        int numThreads;                     // Threads working, including the caller
+        vector<thread> workers;
+        //--------------------------------------------------------------
+        mutex callMutex;                    // Held while a job runs, so callers from other threads wait their turn
+        mutex jobMutex;
+        condition_variable jobStarted;      // Workers wait here for a new job
+        condition_variable jobFinished;     // Caller waits here until the workers are done
+        const function<void(int, int)>* job;
+        int jobSize;                        // Number of elements of the job
+        int jobChunks;                      // Number of chunks the job is split in
+        int pendingChunks;                  // Chunks the workers still have to finish
+        unsigned int jobGeneration;         // Increased for every job so workers know there is a new one
+        bool quit;
+};
@@ -28,17 +28,17 @@ irMarker::irMarker(){
     hasDisappeared  = true;
 }
 
-void irMarker::setup(const cv::Rect& track){
+void irMarker::setup(const cv::Point2f& track){
     color.setHsb(ofRandom(0, 255), 255, 255);
-    currentPos = toOf(track).getCenter();
+    currentPos = toOf(track);
     smoothPos = currentPos;
     previousPos = currentPos;
     all.curveTo(smoothPos); // necessary duplicate first point for control point
     hasDisappeared  = false;
 }
 
-void irMarker::update(const cv::Rect& track){
-    currentPos = toOf(track).getCenter();
+void irMarker::update(const cv::Point2f& track){
+    currentPos = toOf(track);
     smoothPos.interpolate(currentPos, .5);
     all.curveTo(smoothPos);
     velocity = smoothPos - previousPos;
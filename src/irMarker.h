@@ -21,12 +21,12 @@
 #include "ofMain.h"
 #include "ofxCv.h"
 
-class irMarker : public ofxCv::RectFollower{
+class irMarker : public ofxCv::PointFollower{
     public:
         irMarker();
 
-        void setup(const cv::Rect& track);
-        void update(const cv::Rect& track);
+        void setup(const cv::Point2f& track);
+        void update(const cv::Point2f& track);
         void updateLabels(vector<unsigned int> deadLabels, vector<unsigned int> currentLabels);
         void draw();
         void drawPath();
@@ -20,9 +20,23 @@
 #include "ofMain.h"
 #include "ofApp.h"
 #include "ofAppGlutWindow.h"
+#ifdef CREA_BENCHMARK
+#include "ParticleBenchmark.h"
+#endif
 
 //========================================================================
 int main( ){
+    #ifdef CREA_BENCHMARK
+        // Hidden window, the optical flow and the fluid create their shaders
+        // when they are constructed so they need an OpenGL context
+        ofGLFWWindowSettings settings;
+        settings.width = 320;
+        settings.height = 240;
+        settings.visible = false;
+        ofCreateWindow(settings);
+        ofRunApp(new ParticleBenchmark());
+    #else
+
     ofAppGLFWWindow window;
     ofSetupOpenGL(&window, 1024, 768, OF_WINDOW);
 //    ofSetupOpenGL(1024,768, OF_WINDOW);			// <-------- setup the GL context
@@ -32,4 +46,5 @@ int main( ){
     // pass in width and height too:
     ofRunApp( new ofApp() );
     
+    #endif
 }
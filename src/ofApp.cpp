@@ -22,6 +22,9 @@
 using namespace ofxCv;
 using namespace cv;
 
+// Names of the particle modes in the snapshot and recording files
+static const char* particleModeFiles[] = {"emitter", "boids", "grid", "random", "animations"};
+
 //--------------------------------------------------------------
 void ofApp::setup(){
 
@@ -103,6 +106,16 @@ void ofApp::setup(){
 
     time0 = ofGetElapsedTimef();
 
+    // FIXED SIMULATION STEP
+    simulationRate = 60.0;
+    simulationLag = 0.0;
+
+    // FRAME TIMES
+    contourTime = 0.0;
+    fluidTime = 0.0;
+    updateWorkTime = 0.0;
+    drawWorkTime = 0.0;
+
     // BACKGROUND COLOR
     red = 0; green = 0; blue = 0;
     bgGradient = false;
@@ -110,15 +123,12 @@ void ofApp::setup(){
     // ALLOCATE IMAGES
     depthImage.allocate(kinect.width, kinect.height, OF_IMAGE_GRAYSCALE);
     depthOriginal.allocate(kinect.width, kinect.height, OF_IMAGE_GRAYSCALE);
-    grayThreshNear.allocate(kinect.width, kinect.height, OF_IMAGE_GRAYSCALE);
-    grayThreshFar.allocate(kinect.width, kinect.height, OF_IMAGE_GRAYSCALE);
     irImage.allocate(kinect.width, kinect.height, OF_IMAGE_GRAYSCALE);
     irOriginal.allocate(kinect.width, kinect.height, OF_IMAGE_GRAYSCALE);
     
-    // ALLOCATE CROPPING MASKS
-    depthCroppingMask = Mat::ones(kinect.height, kinect.width, CV_8UC1);
-    irCroppingMask    = Mat::ones(kinect.height, kinect.width, CV_8UC1);
-    
+    depthFilter.setup(kinect.width, kinect.height);
+    markerDetector.setup(kinect.width, kinect.height);
+
     depthLeftMask   = irLeftMask    = 0;
     depthRightMask  = irRightMask   = kinect.width;
     depthTopMask    = irTopMask     = 0;
@@ -130,9 +140,7 @@ void ofApp::setup(){
     depthBlurValue  = 7;
     
     // FILTER PARAMETERS IR IMAGE
-    irNumDilates    = 3;
-    irNumErodes     = 1;
-    irBlurValue     = 21;
+    irMergeDistance = 12;
 
     // KINECT PARAMETERS
     flipKinect      = false;
@@ -146,10 +154,8 @@ void ofApp::setup(){
     maxContourSize  = 250.0;
 
     irThreshold     = 70;
-    minMarkerSize   = 5.0;
+    minMarkerSize   = 2.0;
     maxMarkerSize   = 80.0;
-    irMarkerFinder.setMinAreaRadius(minMarkerSize);
-    irMarkerFinder.setMaxAreaRadius(maxMarkerSize);
 
     trackerPersistence = 200;
     trackerMaxDistance = 300;
@@ -179,6 +185,29 @@ void ofApp::setup(){
     particleSystems.push_back(boidsParticles);
     particleSystems.push_back(animationsParticles);
     currentParticleSystem = 0;
+
+    // RANDOM SEED OF THE PARTICLES, run with CREA_SEED=<seed> to repeat a run
+    const char* seedVariable = getenv("CREA_SEED");
+    randomSeed = (seedVariable != NULL) ? strtoull(seedVariable, NULL, 10) : ofGetSystemTime();
+    ofLogNotice() << "Particles random seed: " << randomSeed;
+    for(unsigned int i = 0; i < particleSystems.size(); i++){
+        particleSystems[i]->setSeed(randomSeed);
+    }
+
+    // RECORDINGS OF THE PARTICLES INPUT
+    recordParticles = false;
+    particleRecordings.resize(particleSystems.size());
+
+    // THREADS TO UPDATE THE PARTICLES
+    numThreads = MAX((int)thread::hardware_concurrency(), 1);
+    threadPool.setup(numThreads);
+    for(unsigned int i = 0; i < particleSystems.size(); i++){
+        particleSystems[i]->threadPool = &threadPool;
+    }
+
+    // THREADS TO RUN THE STAGES OF THE UPDATE AT THE SAME TIME
+    concurrentStages = true;
+    frameGraph.setup(getFrameGraphWorkers());
     
     // SCALE FACTOR TO DO FLOW AND FLUID COMPUTATIONS
     float scaleFactor = 4.0;
@@ -187,6 +216,7 @@ void ofApp::setup(){
     contour.setup(kinect.width, kinect.height, scaleFactor);
     contour.setMinAreaRadius(minContourSize);
     contour.setMaxAreaRadius(maxContourSize);
+    contour.threadPool = &threadPool;
     
     // FLUID
     fluid.setup(kinect.width, kinect.height, scaleFactor);
@@ -312,8 +342,8 @@ void ofApp::setup(){
     useFBO = false;
 
     // CREATE DIRECTORIES IN /DATA IF THEY DONT EXIST
-    string directory[3] = {"sequences", "settings", "cues"};
-    for(int i = 0; i < 3; i++){
+    string directory[4] = {"sequences", "settings", "cues", "recordings"};
+    for(int i = 0; i < 4; i++){
         if(!ofDirectory::doesDirectoryExist(directory[i])){ // relative to /data folder
             ofDirectory::createDirectory(directory[i]);
         }
@@ -322,11 +352,15 @@ void ofApp::setup(){
 
 //--------------------------------------------------------------
 void ofApp::update(){
+    uint64_t updateStartTime = ofGetElapsedTimeMicros();
 
     // Compute dt
     float time = ofGetElapsedTimef();
     float dt = ofClamp(time - time0, 0, 0.1);
     time0 = time;
+
+    // Adapt the load of the particle systems to the time of the last frame
+    frameGovernor.update(updateWorkTime + drawWorkTime, particleSystems);
     
     #ifdef SECOND_WINDOW
         windowWidth = secondWindow.getWidth();
@@ -387,82 +421,121 @@ void ofApp::update(){
         if(flipKinect) irOriginal.mirror(false, true);
     }
 
-    copy(irOriginal, irImage);
-    copy(depthOriginal, depthImage);
-    copy(depthOriginal, grayThreshNear);
-    copy(depthOriginal, grayThreshFar);
-
-    // Filter and then threshold the IR image
-    for(int i = 0; i < irNumErodes; i++){
-        erode(irImage); // delete small white dots
-    }
-    for(int i = 0; i < irNumDilates; i++){
-        dilate(irImage);
-    }
-    blur(irImage, irBlurValue);
-    threshold(irImage, irThreshold);
+    // The rest of the update is a graph of tasks that say what they read and
+    // write, so the IR and the depth images are filtered at the same time and
+    // the particle systems are updated at the same time. Tasks using OpenGL
+    // (textures, optical flow and fluid) run in this thread
+    vector<irMarker>& markers = tracker.getFollowers();   // TODO: assign dead labels to new labels and have a MAX number of markers
+    frameGraph.clear();
+
+    // Find the markers in the IR image and track them
+    frameGraph.addTask("Markers", {&irOriginal}, {&irImage, &markerDetector, &tracker, &sequence}, [&](){
+        markerDetector.threshold     = irThreshold;
+        markerDetector.cropLeft      = irLeftMask;
+        markerDetector.cropRight     = irRightMask-1;
+        markerDetector.cropTop       = irTopMask;
+        markerDetector.cropBottom    = irBottomMask-1;
+        markerDetector.mergeDistance = irMergeDistance;
+        markerDetector.minRadius     = minMarkerSize;
+        markerDetector.maxRadius     = maxMarkerSize;
+        markerDetector.update(irOriginal.getPixels(), irImage.getPixels());
+        tracker.track(markerDetector.getCentroids());
+
+        // Track markers
+        vector<unsigned int> deadLabels     = tracker.getDeadLabels();
+        vector<unsigned int> currentLabels  = tracker.getCurrentLabels();
+        // vector<unsigned int> newLabels      = tracker.getNewLabels();
+
+        // Update markers if we loose track of them
+        for(unsigned int i = 0; i < markers.size(); i++){
+            markers[i].updateLabels(deadLabels, currentLabels);
+        }
+
+        // Record sequence when recording button is true
+        if(recordingSequence->getValue() == true) sequence.record(markers);
+    });
 
     // Treshold and filter depth image
-    threshold(grayThreshNear, nearThreshold, true);
-    threshold(grayThreshFar, farThreshold);
-    bitwise_and(grayThreshNear, grayThreshFar, depthImage);
-    
-    grayThreshNear.update();
-    grayThreshFar.update();
-    
-    for(int i = 0; i < depthNumErodes; i++){
-        erode(depthImage);
-    }
-    for(int i = 0; i < depthNumDilates; i++){
-        dilate(depthImage);
-    }
-    blur(depthImage, depthBlurValue);
-
-    // Crop depth image
-    Mat depthMat = toCv(depthImage);
-    Mat depthCropped = Mat::zeros(kinect.height, kinect.width, CV_8UC1);
-    depthCropped = depthMat.mul(depthCroppingMask);
-    copy(depthCropped, depthImage);
-    
-    // Crop IR image
-    Mat irMat = toCv(irImage);
-    Mat irCropped = Mat::zeros(kinect.height, kinect.width, CV_8UC1);
-    irCropped = irMat.mul(irCroppingMask);
-    copy(irCropped, irImage);
+    frameGraph.addTask("Depth filter", {&depthOriginal}, {&depthImage, &depthFilter}, [&](){
+        depthFilter.nearThreshold = nearThreshold;
+        depthFilter.farThreshold  = farThreshold;
+        depthFilter.cropLeft      = depthLeftMask;
+        depthFilter.cropRight     = depthRightMask-1;  // the last column and row of the range were always cropped
+        depthFilter.cropTop       = depthTopMask;
+        depthFilter.cropBottom    = depthBottomMask-1;
+        depthFilter.numErodes     = depthNumErodes;
+        depthFilter.numDilates    = depthNumDilates;
+        depthFilter.blurSize      = depthBlurValue;
+        depthFilter.update(depthOriginal.getPixels(), depthImage.getPixels());
+    });
 
     // Update images
-    irImage.update();
-    depthImage.update();
-
-    // Contour Finder + marker tracker in the IR Image
-    irMarkerFinder.findContours(irImage);
-    tracker.track(irMarkerFinder.getBoundingRects());
-
-    // Track markers
-    vector<irMarker>& markers           = tracker.getFollowers();   // TODO: assign dead labels to new labels and have a MAX number of markers
-    vector<unsigned int> deadLabels     = tracker.getDeadLabels();
-    vector<unsigned int> currentLabels  = tracker.getCurrentLabels();
-    // vector<unsigned int> newLabels      = tracker.getNewLabels();
-
-    // Update markers if we loose track of them
-    for(unsigned int i = 0; i < markers.size(); i++){
-        markers[i].updateLabels(deadLabels, currentLabels);
-    }
-
-    // Record sequence when recording button is true
-    if(recordingSequence->getValue() == true) sequence.record(markers);
-
-    // Update contour
-    contour.update(dt, depthImage);
-    
-    // Update fluid
-    fluid.update(dt, markers, contour, mouseX, mouseY);
-
-    // Update particles
-    emitterParticles->update(dt, markers, contour, fluid);
-    gridParticles->update(dt, markers, contour, fluid);
-    boidsParticles->update(dt, markers, contour, fluid);
-    animationsParticles->update(dt, markers, contour, fluid);
+    frameGraph.addTask("IR texture", {}, {&irImage}, [&](){
+        irImage.update();
+    }, true);
+    frameGraph.addTask("Depth textures", {}, {&depthImage}, [&](){
+        depthImage.update();
+    }, true);
+
+    // Update contour (once per depth image)
+    frameGraph.addTask("Contour", {&depthImage}, {&contour}, [&](){
+        uint64_t stageStartTime = ofGetElapsedTimeMicros();
+        contour.update(dt, depthImage);
+        contourTime = (ofGetElapsedTimeMicros() - stageStartTime) / 1000.0f;
+    }, true);
+    fluidTime = 0.0;
+
+    // Update fluid and particles with a fixed step, as many steps as fit in the
+    // elapsed time, so they behave the same at any frame rate
+    float step = 1.0/simulationRate;
+    simulationLag += dt;
+    int steps = 0;
+    while(simulationLag >= step && steps < MAX_SIMULATION_STEPS){
+        // Update fluid
+        frameGraph.addTask("Fluid", {&tracker, &contour}, {&fluid}, [&, step](){
+            uint64_t stageStartTime = ofGetElapsedTimeMicros();
+            fluid.update(step, markers, contour, mouseX, mouseY);
+            fluidTime += (ofGetElapsedTimeMicros() - stageStartTime) / 1000.0f;
+        }, true);
+
+        // Update particles, recording what they get before they use it
+        for(unsigned int i = 0; i < particleSystems.size(); i++){
+            ParticleSystem* ps = particleSystems[i];
+            ParticleRecording* recording = &particleRecordings[i];
+            frameGraph.addTask(particleModeFiles[ps->particleMode], {&tracker, &contour, &fluid}, {ps, recording}, [&, ps, recording, step](){
+                recording->record(*ps, step, markers, contour, fluid);
+                ps->update(step, markers, contour, fluid);
+            });
+        }
+
+        simulationLag -= step;
+        steps++;
+    }
+    if(simulationLag >= step) simulationLag = fmod(simulationLag, step); // too far behind, drop it
+
+    frameGraph.run();
+
+    // Particles are drawn between the last two steps
+    for(unsigned int i = 0; i < particleSystems.size(); i++){
+        particleSystems[i]->interpolation = simulationLag/step;
+    }
+
+    float particlesTime = 0.0;
+    for(unsigned int i = 0; i < particleSystems.size(); i++) particlesTime += particleSystems[i]->updateTime;
+    updateTimeLabel->setLabel("Particles: " + ofToString(particlesTime, 2) + " ms (" + ofToString(threadPool.getNumThreads()) + " threads)");
+    stagesTimeLabel->setLabel("Contour: " + ofToString(contourTime, 2) + " ms Fluid: " + ofToString(fluidTime, 2) + " ms");
+    graphTimeLabel->setLabel("Stages: " + ofToString(frameGraph.getTotalTime(), 2) + " ms (critical path " + ofToString(frameGraph.getCriticalPathTime(), 2)
+                             + " ms of " + ofToString(frameGraph.getSequentialTime(), 2) + " ms)");
+    markersTimeLabel->setLabel("Markers: " + ofToString(markerDetector.detectTime, 2) + " ms (" + ofToString(markerDetector.getNumActiveTiles())
+                               + " of " + ofToString(markerDetector.getNumTiles()) + " tiles)");
+    depthTimeLabel->setLabel("Depth: " + ofToString(depthFilter.totalTime, 2) + " ms (threshold " + ofToString(depthFilter.thresholdTime, 2)
+                             + " erode " + ofToString(depthFilter.erodeTime, 2) + " dilate " + ofToString(depthFilter.dilateTime, 2)
+                             + " blur " + ofToString(depthFilter.blurTime, 2) + ")");
+    float minLoad = 1.0;
+    for(unsigned int i = 0; i < particleSystems.size(); i++) minLoad = MIN(minLoad, particleSystems[i]->loadScale);
+    governorLabel->setLabel("Frame: " + ofToString(frameGovernor.smoothedFrameTime, 1) + " ms Load: " + ofToString(minLoad*100, 0) + "%");
+
+    updateWorkTime = (ofGetElapsedTimeMicros() - updateStartTime) / 1000.0f;
     
     #ifdef GESTURE_FOLLOWER
     #ifdef KINECT_SEQUENCE
@@ -603,6 +676,8 @@ void ofApp::update(){
 
 //--------------------------------------------------------------
 void ofApp::draw(){
+    uint64_t drawStartTime = ofGetElapsedTimeMicros();
+
     // Clear with alpha, so we can capture via syphon and composite elsewhere should we want.
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -698,6 +773,8 @@ void ofApp::draw(){
     mClient.draw(50, 50);
     mainOutputSyphonServer.publishScreen();
     individualTextureSyphonServer.publishTexture(&tex);
+
+    drawWorkTime = (ofGetElapsedTimeMicros() - drawStartTime) / 1000.0f;
 }
 
 //--------------------------------------------------------------
@@ -749,6 +826,12 @@ void ofApp::setupHelperGUI(){
     
     guiHelper->addSpacer();
     guiHelper->addFPS(OFX_UI_FONT_SMALL);
+    updateTimeLabel = guiHelper->addLabel("Particles: 0.00 ms", OFX_UI_FONT_SMALL);
+    stagesTimeLabel = guiHelper->addLabel("Contour: 0.00 ms Fluid: 0.00 ms", OFX_UI_FONT_SMALL);
+    graphTimeLabel = guiHelper->addLabel("Stages: 0.00 ms (critical path 0.00 ms of 0.00 ms)", OFX_UI_FONT_SMALL);
+    markersTimeLabel = guiHelper->addLabel("Markers: 0.00 ms (0 of 0 tiles)", OFX_UI_FONT_SMALL);
+    depthTimeLabel = guiHelper->addLabel("Depth: 0.00 ms (threshold 0.00 erode 0.00 dilate 0.00 blur 0.00)", OFX_UI_FONT_SMALL);
+    governorLabel = guiHelper->addLabel("Frame: 0.0 ms Load: 100%", OFX_UI_FONT_SMALL);
     guiHelper->addSpacer();
 
     guiHelper->addSpacer();
@@ -841,6 +924,16 @@ void ofApp::setupBasicsGUI(){
     guiBasics->addToggle("Use FBO", &useFBO);
     guiBasics->addIntSlider("FBO Fade Amount", 0, 100, &fadeAmount);
 
+    guiBasics->addSpacer();
+    guiBasics->addLabel("Performance", OFX_UI_FONT_MEDIUM);
+    guiBasics->addSpacer();
+    guiBasics->addIntSlider("Update Threads", 1, 32, &numThreads);
+    guiBasics->addToggle("Concurrent Stages", &concurrentStages);
+    guiBasics->addSlider("Simulation Rate", 15, 120, &simulationRate);
+    guiBasics->addToggle("Frame Governor", &frameGovernor.isActive);
+    guiBasics->addSlider("Frame Budget", 8, 33, &frameGovernor.frameBudget);
+    guiBasics->addToggle("Record Particles", &recordParticles);
+
     guiBasics->addSpacer();
     guiBasics->addLabel("Music", OFX_UI_FONT_MEDIUM);
     guiBasics->addSpacer();
@@ -914,9 +1007,7 @@ void ofApp::setupKinectGUI(){
     guiKinect_2->addRangeSlider("IR Top/Bottom Crop", 0.0, 480.0, &irTopMask, &irBottomMask);
     
     guiKinect_2->addSpacer();
-    guiKinect_2->addIntSlider("IR Number of Erosions", 0, 8, &irNumErodes);
-    guiKinect_2->addIntSlider("IR Number of Dilations", 0, 8, &irNumDilates);
-    guiKinect_2->addIntSlider("IR Blur Size", 0, 41, &irBlurValue);
+    guiKinect_2->addIntSlider("IR Merge Distance", 0, 40, &irMergeDistance);
     
     guiKinect_2->addSpacer();
     guiKinect_2->addSlider("Tracker Persistence", 5.0, 500.0, &trackerPersistence);
@@ -1041,6 +1132,11 @@ void ofApp::setupCueListGUI(){
     guiCueList->addSpacer();
     guiCueList->addLabelButton("GO", false, 230, 40);
 
+    guiCueList->addSpacer();
+    guiCueList->addLabel("Start the active particles", OFX_UI_FONT_SMALL);
+    guiCueList->addLabel("of this cue as they are now:", OFX_UI_FONT_SMALL);
+    guiCueList->addLabelButton("Save Particles", false);
+
     guiCueList->addSpacer();
 
     guiCueList->autoSizeToFitWidgets();
@@ -1417,6 +1513,7 @@ void ofApp::setupGridGUI(){
     guiGrid_1->addLabel("Grid", OFX_UI_FONT_MEDIUM);
     guiGrid_1->addSpacer();
     guiGrid_1->addIntSlider("Resolution", 1, 20, &gridParticles->gridRes);
+    guiGrid_1->addToggle("Sleep at Rest", &gridParticles->sleepAtRest);
     
     guiGrid_1->addSpacer();
     guiGrid_1->addLabel("Particle", OFX_UI_FONT_MEDIUM);
@@ -1429,9 +1526,12 @@ void ofApp::setupGridGUI(){
     guiGrid_1->setWidgetPosition(OFX_UI_WIDGET_POSITION_DOWN);
     guiGrid_1->setWidgetSpacing(3);
     guiGrid_1->addSlider("Stroke Line Width", 1.0, 5.0, &gridParticles->strokeWidth);
+    guiGrid_1->addToggle("Trails", &gridParticles->drawTrails);
+    guiGrid_1->addIntSlider("Trail Length", 2, 64, &gridParticles->trailLength);
     guiGrid_1->addToggle("Connected", &gridParticles->drawConnections);
     guiGrid_1->addSlider("Connect Dist", 5.0, 100.0, &gridParticles->connectDist);
     guiGrid_1->addSlider("Connect Line Width", 1.0, 5.0, &gridParticles->connectWidth);
+    guiGrid_1->addIntSlider("Max Connections", 1, 50, &gridParticles->maxConnections);
     guiGrid_1->addSlider("Radius", 0.1, 25.0, &gridParticles->radius);
     guiGrid_1->addSpacer();
     guiGrid_1->addLabel("Physics", OFX_UI_FONT_MEDIUM);
@@ -1531,9 +1631,12 @@ void ofApp::setupBoidsGUI(){
     guiBoids_2->setWidgetPosition(OFX_UI_WIDGET_POSITION_DOWN);
     guiBoids_2->setWidgetSpacing(3);
     guiBoids_2->addSlider("Stroke Line Width", 1.0, 5.0, &boidsParticles->strokeWidth);
+    guiBoids_2->addToggle("Trails", &boidsParticles->drawTrails);
+    guiBoids_2->addIntSlider("Trail Length", 2, 64, &boidsParticles->trailLength);
     guiBoids_2->addToggle("Connected", &boidsParticles->drawConnections);
     guiBoids_2->addSlider("Connect Dist", 5.0, 100.0, &boidsParticles->connectDist);
     guiBoids_2->addSlider("Connect Line Width", 1.0, 5.0, &boidsParticles->connectWidth);
+    guiBoids_2->addIntSlider("Max Connections", 1, 50, &boidsParticles->maxConnections);
     guiBoids_2->addSpacer();
     guiBoids_2->addSlider("Radius", 0.1, 25.0, &boidsParticles->radius);
     guiBoids_2->addSlider("Radius Random[%]", 0.0, 100.0, &boidsParticles->radiusRnd);
@@ -1666,9 +1769,12 @@ void ofApp::addParticlePropertiesGUI(ofxUICanvas* gui, ParticleSystem* ps){
     gui->setWidgetPosition(OFX_UI_WIDGET_POSITION_DOWN);
     gui->setWidgetSpacing(3);
     gui->addSlider("Stroke Line Width", 1.0, 5.0, &ps->strokeWidth);
+    gui->addToggle("Trails", &ps->drawTrails);
+    gui->addIntSlider("Trail Length", 2, 64, &ps->trailLength);
     gui->addToggle("Connected", &ps->drawConnections);
     gui->addSlider("Connect Dist", 5.0, 100.0, &ps->connectDist);
     gui->addSlider("Connect Line Width", 1.0, 5.0, &ps->connectWidth);
+    gui->addIntSlider("Max Connections", 1, 50, &ps->maxConnections);
     gui->addSpacer();
     gui->addSlider("Lifetime", 0.1, 40.0, &ps->lifetime);
     gui->addSlider("Life Random[%]", 0.0, 100.0, &ps->lifetimeRnd);
@@ -1750,8 +1856,11 @@ void ofApp::saveGUISettings(const string path, const bool isCue){
         XML->pushTag("GUI", guiIndex);
         vector<ofxUIWidget*> widgets = g->getWidgets();
         for(int i = 0; i < widgets.size(); i++){
-            // Don't want to save transition frames for cues
-            if(isCue && widgets[i]->getName() == "Transition Frames") continue;
+            // Don't want to save transition frames or update threads for cues
+            if(isCue && (widgets[i]->getName() == "Transition Frames" || widgets[i]->getName() == "Update Threads" || widgets[i]->getName() == "Simulation Rate"
+                         || widgets[i]->getName() == "Frame Governor" || widgets[i]->getName() == "Frame Budget")) continue;
+            // Nor to start recording when the settings are loaded
+            if(widgets[i]->getName() == "Record Particles") continue;
             // kind number 20 is ofxUIImageToggle
             // kind number 12 is ofxUITextInput, for which we don't want to save the state
             if(widgets[i]->hasState() && widgets[i]->getKind() != 12){
@@ -1864,6 +1973,9 @@ void ofApp::loadGUISettings(const string path, const bool isCue, const bool inte
         XML->popTag();
     }
 
+    // Particles of the cue start from their snapshots
+    if(isCue) loadParticlesSnapshots(path);
+
     // Load cue list if it is not a cue
     if(!isCue){
         XML->pushTag("CUES");
@@ -1898,6 +2010,44 @@ void ofApp::loadGUISettings(const string path, const bool isCue, const bool inte
     delete XML;
 }
 
+//--------------------------------------------------------------
+int ofApp::getFrameGraphWorkers(){
+    if(!concurrentStages) return 0;
+    return MIN(FRAME_GRAPH_WORKERS, MAX((int)thread::hardware_concurrency()-1, 1));
+}
+
+//--------------------------------------------------------------
+string ofApp::getParticlesSnapshotPath(const string cuePath, ParticleSystem* ps){
+    return ofFilePath::removeExt(cuePath) + "." + particleModeFiles[ps->particleMode] + ".snapshot";
+}
+
+//--------------------------------------------------------------
+void ofApp::saveParticlesSnapshots(const string cuePath){
+    // Only the active particle systems, the others start with new particles
+    for(unsigned int i = 0; i < particleSystems.size(); i++){
+        ParticleSystem* ps = particleSystems[i];
+        string path = getParticlesSnapshotPath(cuePath, ps);
+        if(ps->isActive){
+            ofBuffer buffer;
+            ps->saveSnapshot(buffer);
+            ofBufferToFile(path, buffer, true);
+        }
+        else if(ofFile::doesFileExist(path)){
+            ofFile::removeFile(path);
+        }
+    }
+}
+
+//--------------------------------------------------------------
+void ofApp::loadParticlesSnapshots(const string cuePath){
+    for(unsigned int i = 0; i < particleSystems.size(); i++){
+        ParticleSystem* ps = particleSystems[i];
+        string path = getParticlesSnapshotPath(cuePath, ps);
+        if(ofFile::doesFileExist(path)) ps->startSnapshot = ofBufferFromFile(path, true);
+        else ps->startSnapshot.clear();
+    }
+}
+
 //--------------------------------------------------------------
 void ofApp::interpolateWidgetValues(){
 
@@ -2047,6 +2197,28 @@ void ofApp::guiEvent(ofxUIEventArgs &e){
         if(toggle->getValue() == true) song.setLoop(true);
         else song.setLoop(false);
     }
+    if(e.getName() == "Update Threads"){
+        threadPool.setup(numThreads);
+    }
+    if(e.getName() == "Concurrent Stages"){
+        frameGraph.setup(getFrameGraphWorkers());
+    }
+    if(e.getName() == "Frame Governor"){
+        if(!frameGovernor.isActive) frameGovernor.reset(particleSystems);
+    }
+    if(e.getName() == "Record Particles"){
+        string timestamp = ofGetTimestampString("%Y%m%d-%H%M%S");
+        for(unsigned int i = 0; i < particleSystems.size(); i++){
+            ParticleSystem* ps = particleSystems[i];
+            ParticleRecording& recording = particleRecordings[i];
+            if(recordParticles && ps->isActive) recording.start(*ps, threadPool.getNumThreads());
+            else if(!recordParticles && recording.isRecording){
+                recording.stop(*ps);
+                string path = "recordings/" + string(particleModeFiles[ps->particleMode]) + "-" + timestamp + ".particles";
+                if(recording.save(path)) ofLogNotice() << "Particles recorded in " << path << " (" << recording.getNumSteps() << " steps)";
+            }
+        }
+    }
     //-------------------------------------------------------------
     // KINECT
     //-------------------------------------------------------------
@@ -2067,62 +2239,12 @@ void ofApp::guiEvent(ofxUIEventArgs &e){
         contour.setMinAreaRadius(minContourSize);
         contour.setMaxAreaRadius(maxContourSize);
     }
-    if(e.getName() == "Left/Right Crop" || e.getName() == "Top/Bottom Crop"){
-        depthCroppingMask = Mat::ones(480, 640, CV_8UC1);
-        for(int i = 0; i < (int)depthLeftMask; i++){
-            for(int j = 0; j < depthCroppingMask.rows; j++){
-                depthCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-        for(int i = 0; i < depthCroppingMask.cols; i++){
-            for(int j = 0; j < (int)depthTopMask; j++){
-                depthCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-        for(int i = (int)depthRightMask-1; i < depthCroppingMask.cols; i++){
-            for(int j = 0; j < depthCroppingMask.rows; j++){
-                depthCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-        for(int i = 0; i < depthCroppingMask.cols; i++){
-            for(int j = (int)depthBottomMask-1; j < depthCroppingMask.rows; j++){
-                depthCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-    }
-    if(e.getName() == "Markers Size"){
-        irMarkerFinder.setMinAreaRadius(minMarkerSize);
-        irMarkerFinder.setMaxAreaRadius(maxMarkerSize);
-    }
     if(e.getName() == "Tracker Persistence"){
         tracker.setPersistence(trackerPersistence); // wait for 'trackerPersistence' frames before forgetting something
     }
     if(e.getName() == "Tracker Max Distance"){
         tracker.setMaximumDistance(trackerMaxDistance); // an object can move up to 'trackerMaxDistance' pixels per frame
     }
-    if(e.getName() == "IR Left/Right Crop" || e.getName() == "IR Top/Bottom Crop"){
-        irCroppingMask = Mat::ones(480, 640, CV_8UC1);
-        for(int i = 0; i < (int)irLeftMask; i++){
-            for(int j = 0; j < irCroppingMask.rows; j++){
-                irCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-        for(int i = 0; i < irCroppingMask.cols; i++){
-            for(int j = 0; j < (int)irTopMask; j++){
-                irCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-        for(int i = (int)irRightMask-1; i < irCroppingMask.cols; i++){
-            for(int j = 0; j < irCroppingMask.rows; j++){
-                irCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-        for(int i = 0; i < irCroppingMask.cols; i++){
-            for(int j = (int)irBottomMask-1; j < irCroppingMask.rows; j++){
-                irCroppingMask.at<uchar>(cv::Point(i,j)) = 0;
-            }
-        }
-    }
     if(e.getName() == "Show Markers Path"){
         ofxUIImageToggle *toggle = (ofxUIImageToggle *) e.widget;
         if(toggle->getValue() == true){
@@ -2336,6 +2458,12 @@ void ofApp::guiEvent(ofxUIEventArgs &e){
             resetCueSliders();
         }
     }
+    if(e.getName() == "Save Particles"){
+        ofxUILabelButton *button = (ofxUILabelButton *) e.widget;
+        if(button->getValue() == true){
+            if(currentCueIndex >= 0) saveParticlesSnapshots(cueList[currentCueIndex]);
+        }
+    }
     if(e.getName() == "GO"){
         ofxUILabelButton *button = (ofxUILabelButton *) e.widget;
         if(button->getValue() == true){
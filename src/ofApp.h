@@ -35,6 +35,11 @@
 #include "Contour.h"
 #include "Sequence.h"
 #include "Fluid.h"
+#include "FrameGovernor.h"
+#include "ParticleRecording.h"
+#include "TaskGraph.h"
+#include "DepthFilter.h"
+#include "MarkerDetector.h"
 
 // VMO files
 //-----------------------
@@ -56,6 +61,14 @@
 #define PROJECTOR_RESOLUTION_X 640
 #define PROJECTOR_RESOLUTION_Y 480
 
+// Maximum simulation steps in a frame, the rest of the time is dropped if the
+// simulation can not keep up
+#define MAX_SIMULATION_STEPS 4
+
+// Threads besides the main one running the stages of a frame at the same time:
+// the IR and depth filters, and the four particle systems
+#define FRAME_GRAPH_WORKERS 3
+
 class ofApp : public ofBaseApp{
     public:
         void setup();
@@ -81,6 +94,11 @@ class ofApp : public ofBaseApp{
         void loadGUISettings(const string path, const bool isCue, const bool interpolate);
         void interpolateWidgetValues();
 
+        string getParticlesSnapshotPath(const string cuePath, ParticleSystem* ps);
+        int getFrameGraphWorkers();
+        void saveParticlesSnapshots(const string cuePath);
+        void loadParticlesSnapshots(const string cuePath);
+
         void guiEvent(ofxUIEventArgs &e);
 
         void exit();
@@ -104,6 +122,8 @@ class ofApp : public ofBaseApp{
     
         //--------------------------------------------------------------
         float time0;            // Time value for computing dt
+        float simulationRate;   // Simulation steps per second (fluid and particles)
+        float simulationLag;    // Time elapsed that is not simulated yet
         //--------------------------------------------------------------
         ofxKinect kinect;
         //--------------------------------------------------------------
@@ -124,25 +144,20 @@ class ofApp : public ofBaseApp{
         int depthNumErodes;     // Number of erodes applied to depth image
         int depthBlurValue;     // Size of the blur filter to depth image
         //--------------------------------------------------------------
-        int irNumDilates;       // Number of dilates applied to IR image
-        int irNumErodes;        // Number of erodes applied to IR image
-        int irBlurValue;        // Size of the blur filter to IR image
+        int irMergeDistance;    // Pieces of a marker closer than this in the IR image are merged (pixels)
         //--------------------------------------------------------------
         ofImage irImage, irOriginal;
         ofImage depthImage, depthOriginal;
-        ofImage grayThreshNear;
-        ofImage grayThreshFar;
+        DepthFilter depthFilter;    // Threshold, crop, erosions, dilations and blur of the depth image
         //--------------------------------------------------------------
-        cv::Mat depthCroppingMask;
         float depthLeftMask, depthRightMask;
         float depthTopMask, depthBottomMask;
         //--------------------------------------------------------------
-        cv::Mat irCroppingMask;
         float irLeftMask, irRightMask;
         float irTopMask, irBottomMask;
         //--------------------------------------------------------------
-        ofxCv::ContourFinder irMarkerFinder;
-        ofxCv::RectTrackerFollower<irMarker> tracker;
+        MarkerDetector markerDetector;  // Blobs of the markers in the IR image
+        ofxCv::PointTrackerFollower<irMarker> tracker;
         //--------------------------------------------------------------
         int numMarkers;
         //--------------------------------------------------------------
@@ -157,6 +172,27 @@ class ofApp : public ofBaseApp{
         vector<ParticleSystem *> particleSystems;
         int currentParticleSystem;
         //--------------------------------------------------------------
+        uint64_t randomSeed;    // Seed of the particle systems random numbers
+        ThreadPool threadPool;  // Threads shared by the particle systems updates
+        int numThreads;         // Number of threads updating the particles
+        ofxUILabel *updateTimeLabel;
+        //--------------------------------------------------------------
+        FrameGovernor frameGovernor;    // Changes the load of the particle systems to keep the frame rate
+        float contourTime;      // Time spent updating the contour (ms)
+        float fluidTime;        // Time spent updating the fluid (ms)
+        float updateWorkTime;   // Time spent in the last update (ms)
+        float drawWorkTime;     // Time spent in the last draw (ms)
+        ofxUILabel *stagesTimeLabel;
+        TaskGraph frameGraph;       // Stages of the update with what they read and write, run at the same time when they can
+        bool concurrentStages;      // Run the stages that do not share data at the same time?
+        ofxUILabel *graphTimeLabel;
+        ofxUILabel *depthTimeLabel;
+        ofxUILabel *markersTimeLabel;
+        ofxUILabel *governorLabel;
+        //--------------------------------------------------------------
+        bool recordParticles;   // Record the input of the active particle systems to replay it?
+        vector<ParticleRecording> particleRecordings;   // Recording of each particle system
+        //--------------------------------------------------------------
         ofSoundPlayer song;     // Song
         //--------------------------------------------------------------
         Sequence sequence;      // Gestures sequence